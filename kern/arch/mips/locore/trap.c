@@ -41,6 +41,7 @@
 #include <syscall.h>
 #include <addrspace.h>
 #include <proc.h>
+#include <uthread.h>
 #include "opt-A3.h"
 #include <kern/wait.h>
 
@@ -210,6 +211,21 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * Other threads of an exiting process stop here too,
+		 * so one that never makes a system call still goes at
+		 * the next timer interrupt. But exiting takes locks and
+		 * switches away, which can't be done with interrupts
+		 * off; so if we came from user mode (where they were
+		 * on) restore that first, as below, and leave by the
+		 * ordinary exception return path.
+		 */
+		if (!iskern) {
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -330,6 +346,11 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/* other threads of an exiting process stop here */
+	if (!iskern) {
+		uthread_checkexit();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
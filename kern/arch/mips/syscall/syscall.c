@@ -36,11 +36,430 @@
 #include <current.h>
 #include <syscall.h>
 #include <addrspace.h>
+#include <copyinout.h>
+#include <endian.h>
+#include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <ktrace.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
+#include "opt-syscallstats.h"
 #include <kern/wait.h>
 
 
+/*
+ * Dispatch table.
+ *
+ * Each system call has a small function here that pulls its
+ * arguments out of the trapframe and calls the real implementation.
+ * Results that aren't error codes go in the sysret; a call whose
+ * result is 64 bits wide sets SE_RET64 and uses sr_val64.
+ *
+ * SE_NORETURN marks calls that don't come back when they succeed
+ * (so they're counted up front and can't be timed; see below).
+ */
+
+struct sysret {
+	int32_t sr_val;
+	off_t sr_val64;
+};
+
+#define SE_RET64	0x1
+#define SE_NORETURN	0x2
+
+struct syscall_entry {
+	const char *se_name;
+	int (*se_func)(struct trapframe *tf, struct sysret *ret);
+	unsigned se_flags;
+};
+
+#define SYSCALL_TABLESIZE 128
+
+static
+int
+sc_reboot(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_reboot(tf->tf_a0);
+}
+
+static
+int
+sc_time(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+#ifdef UW
+static
+int
+sc_open(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_open((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+			(mode_t)tf->tf_a2, (int *)&ret->sr_val);
+}
+
+static
+int
+sc_read(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			(int)tf->tf_a2, (int *)&ret->sr_val);
+}
+
+static
+int
+sc_write(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_write((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2, (int *)&ret->sr_val);
+}
+
+static
+int
+sc_lseek(struct trapframe *tf, struct sysret *ret)
+{
+	uint64_t pos;
+	int whence;
+	int err;
+
+	/* the 64-bit offset is in a2/a3; whence is on the stack */
+	join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		     &whence, sizeof(whence));
+	if (err) {
+		return err;
+	}
+	return sys_lseek((int)tf->tf_a0, (off_t)pos, whence, &ret->sr_val64);
+}
+
+static
+int
+sc_close(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_close((int)tf->tf_a0);
+}
+
+static
+int
+sc_dup2(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, (int *)&ret->sr_val);
+}
+
+static
+int
+sc_pipe(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_pipe((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_exit(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+#if OPT_A3
+	sys__exit((int)tf->tf_a0, __WEXITED);
+#else
+	sys__exit((int)tf->tf_a0);
+#endif
+	/* sys__exit does not return, execution should not get here */
+	panic("unexpected return from sys__exit");
+	return 0;
+}
+
+static
+int
+sc_getpid(struct trapframe *tf, struct sysret *ret)
+{
+	(void)tf;
+	return sys_getpid((pid_t *)&ret->sr_val);
+}
+
+static
+int
+sc_waitpid(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_waitpid((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2, (pid_t *)&ret->sr_val);
+}
+
+static
+int
+sc_wait4(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_wait4((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2, (userptr_t)tf->tf_a3,
+			 (pid_t *)&ret->sr_val);
+}
+
+static
+int
+sc_getrusage(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+#if OPT_A2
+static
+int
+sc_fork(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_fork(tf, (pid_t *)&ret->sr_val);
+}
+
+static
+int
+sc_execv(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_execv((char *)tf->tf_a0, (char **)tf->tf_a1);
+}
+
+static
+int
+sc_spawn(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_spawn((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			 (pid_t *)&ret->sr_val);
+}
+#endif
+
+static
+int
+sc_setaffinity(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_setaffinity((uint32_t)tf->tf_a0);
+}
+
+static
+int
+sc_getaffinity(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_getaffinity((userptr_t)tf->tf_a0);
+}
+
+static
+int
+sc_thread_create(struct trapframe *tf, struct sysret *ret)
+{
+	return sys_thread_create((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (userptr_t)tf->tf_a2, (int *)&ret->sr_val);
+}
+
+static
+int
+sc_thread_exit(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	sys_thread_exit((int)tf->tf_a0);
+	panic("unexpected return from sys_thread_exit");
+	return 0;
+}
+
+static
+int
+sc_thread_join(struct trapframe *tf, struct sysret *ret)
+{
+	(void)ret;
+	return sys_thread_join((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+#endif // UW
+
+static const struct syscall_entry syscall_table[SYSCALL_TABLESIZE] = {
+	[SYS_reboot] =		{ "reboot",		sc_reboot, 0 },
+	[SYS___time] =		{ "__time",		sc_time, 0 },
+#ifdef UW
+	[SYS_open] =		{ "open",		sc_open, 0 },
+	[SYS_read] =		{ "read",		sc_read, 0 },
+	[SYS_write] =		{ "write",		sc_write, 0 },
+	[SYS_lseek] =		{ "lseek",		sc_lseek, SE_RET64 },
+	[SYS_close] =		{ "close",		sc_close, 0 },
+	[SYS_dup2] =		{ "dup2",		sc_dup2, 0 },
+	[SYS_pipe] =		{ "pipe",		sc_pipe, 0 },
+	[SYS__exit] =		{ "_exit",		sc_exit, SE_NORETURN },
+	[SYS_getpid] =		{ "getpid",		sc_getpid, 0 },
+	[SYS_waitpid] =		{ "waitpid",		sc_waitpid, 0 },
+	[SYS_wait4] =		{ "wait4",		sc_wait4, 0 },
+	[SYS_getrusage] =	{ "getrusage",		sc_getrusage, 0 },
+#if OPT_A2
+	[SYS_fork] =		{ "fork",		sc_fork, 0 },
+	[SYS_execv] =		{ "execv",		sc_execv, SE_NORETURN },
+	[SYS_spawn] =		{ "spawn",		sc_spawn, 0 },
+#endif
+	[SYS_setaffinity] =	{ "setaffinity",	sc_setaffinity, 0 },
+	[SYS_getaffinity] =	{ "getaffinity",	sc_getaffinity, 0 },
+	[SYS___thread_create] =	{ "__thread_create",	sc_thread_create, 0 },
+	[SYS_thread_exit] =	{ "thread_exit",	sc_thread_exit, SE_NORETURN },
+	[SYS_thread_join] =	{ "thread_join",	sc_thread_join, 0 },
+#endif // UW
+};
+
+#if OPT_SYSCALLSTATS
+/*
+ * Per-syscall statistics.
+ *
+ * Each cpu counts the calls made on it, the errors, the total time
+ * spent, and a histogram of latencies: bucket 0 is under 2us and
+ * bucket N (N > 0) is [2^N, 2^(N+1)) us, with the last bucket taking
+ * everything longer. Time is wall-clock time from entry to return as
+ * read by gettime() (the clock behind __time), so it includes time
+ * spent asleep; calls that don't return are counted but not timed,
+ * and if one fails after all (execv) only the error is added.
+ *
+ * The counters are updated with interrupts off on the cpu the call
+ * finished on, so no locking is needed. Printing sums all the cpus
+ * without stopping them, which is good enough for a dump.
+ */
+
+#define SYSCALL_NBUCKETS 16
+#define SYSCALL_MAXCPUS 32		/* as for affinity masks */
+
+struct syscall_stats {
+	uint32_t ss_calls;
+	uint32_t ss_errors;
+	uint64_t ss_usecs;
+	uint32_t ss_buckets[SYSCALL_NBUCKETS];
+};
+
+static struct syscall_stats *syscall_stats[SYSCALL_MAXCPUS];
+
+void
+syscall_stats_cpuinit(unsigned cpunum)
+{
+	struct syscall_stats *ss;
+
+	KASSERT(cpunum < SYSCALL_MAXCPUS);
+	ss = kmalloc(SYSCALL_TABLESIZE * sizeof(*ss));
+	if (ss == NULL) {
+		panic("syscall_stats_cpuinit: Out of memory\n");
+	}
+	bzero(ss, SYSCALL_TABLESIZE * sizeof(*ss));
+	syscall_stats[cpunum] = ss;
+}
+
+static
+void
+syscall_stats_record(int callno, int err, bool timed,
+		     time_t secs0, uint32_t nsecs0)
+{
+	struct syscall_stats *ss;
+	time_t secs1, dsecs;
+	uint32_t nsecs1, dnsecs, usecs;
+	unsigned bucket;
+	int spl;
+
+	if (timed) {
+		gettime(&secs1, &nsecs1);
+		getinterval(secs0, nsecs0, secs1, nsecs1, &dsecs, &dnsecs);
+		/* anything over an hour just goes in the last bucket */
+		if (dsecs > 3600) {
+			dsecs = 3600;
+		}
+		usecs = dsecs * 1000000 + dnsecs / 1000;
+	}
+	else {
+		usecs = 0;
+	}
+
+	bucket = 0;
+	while (bucket < SYSCALL_NBUCKETS - 1 && (usecs >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+
+	spl = splhigh();
+	ss = &syscall_stats[curcpu->c_number][callno];
+	ss->ss_calls++;
+	if (err) {
+		ss->ss_errors++;
+	}
+	if (timed) {
+		ss->ss_usecs += usecs;
+		ss->ss_buckets[bucket]++;
+	}
+	splx(spl);
+}
+
+/* an SE_NORETURN call, already counted, came back with an error */
+static
+void
+syscall_stats_record_error(int callno)
+{
+	int spl;
+
+	spl = splhigh();
+	syscall_stats[curcpu->c_number][callno].ss_errors++;
+	splx(spl);
+}
+
+void
+syscall_stats_print(void)
+{
+	struct syscall_stats tot;
+	unsigned callno, cpu, b, lastb, timed;
+
+	kprintf("%-16s %9s %7s %9s  %s\n", "syscall", "calls", "errors",
+		"avg us", "latency histogram (us: count)");
+	for (callno=0; callno<SYSCALL_TABLESIZE; callno++) {
+		bzero(&tot, sizeof(tot));
+		for (cpu=0; cpu<SYSCALL_MAXCPUS; cpu++) {
+			if (syscall_stats[cpu] == NULL) {
+				continue;
+			}
+			tot.ss_calls += syscall_stats[cpu][callno].ss_calls;
+			tot.ss_errors += syscall_stats[cpu][callno].ss_errors;
+			tot.ss_usecs += syscall_stats[cpu][callno].ss_usecs;
+			for (b=0; b<SYSCALL_NBUCKETS; b++) {
+				tot.ss_buckets[b] +=
+					syscall_stats[cpu][callno].ss_buckets[b];
+			}
+		}
+		if (tot.ss_calls == 0) {
+			continue;
+		}
+
+		timed = 0;
+		lastb = 0;
+		for (b=0; b<SYSCALL_NBUCKETS; b++) {
+			timed += tot.ss_buckets[b];
+			if (tot.ss_buckets[b] != 0) {
+				lastb = b;
+			}
+		}
+		kprintf("%-16s %9u %7u %9llu ", syscall_table[callno].se_name,
+			tot.ss_calls, tot.ss_errors,
+			timed ? tot.ss_usecs / timed : 0ULL);
+		for (b=0; timed && b<=lastb; b++) {
+			kprintf(" %s%u:%u", b == SYSCALL_NBUCKETS - 1 ? ">=" : "",
+				b == 0 ? 0 : 1U << b, tot.ss_buckets[b]);
+		}
+		kprintf("\n");
+	}
+}
+
+void
+syscall_stats_reset(void)
+{
+	unsigned cpu;
+
+	for (cpu=0; cpu<SYSCALL_MAXCPUS; cpu++) {
+		if (syscall_stats[cpu] != NULL) {
+			bzero(syscall_stats[cpu],
+			      SYSCALL_TABLESIZE * sizeof(struct syscall_stats));
+		}
+	}
+}
+#endif /* OPT_SYSCALLSTATS */
+
+
 /*
  * System call dispatcher.
  *
@@ -83,8 +502,13 @@ void
 syscall(struct trapframe *tf)
 {
 	int callno;
-	int32_t retval;
+	const struct syscall_entry *se;
+	struct sysret ret;
 	int err;
+#if OPT_SYSCALLSTATS
+	time_t secs0;
+	uint32_t nsecs0;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -93,66 +517,43 @@ syscall(struct trapframe *tf)
 	callno = tf->tf_v0;
 
 	/*
-	 * Initialize retval to 0. Many of the system calls don't
-	 * really return a value, just 0 for success and -1 on
-	 * error. Since retval is the value returned on success,
+	 * Initialize the return value to 0. Many of the system calls
+	 * don't really return a value, just 0 for success and -1 on
+	 * error. Since the return value is only used on success,
 	 * initialize it to 0 by default; thus it's not necessary to
 	 * deal with it except for calls that return other values, 
 	 * like write.
 	 */
 
-	retval = 0;
-
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
+	ret.sr_val = 0;
+	ret.sr_val64 = 0;
 
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-#ifdef UW
-	case SYS_write:
-	  err = sys_write((int)tf->tf_a0,
-			  (userptr_t)tf->tf_a1,
-			  (int)tf->tf_a2,
-			  (int *)(&retval));
-	  break;
-	case SYS__exit:
-	#if OPT_A3
-	  sys__exit((int)tf->tf_a0, __WEXITED);
-	#else
-	  sys__exit((int)tf->tf_a0);
-	#endif
-	  /* sys__exit does not return, execution should not get here */
-	  panic("unexpected return from sys__exit");
-	  break;
-	case SYS_getpid:
-	  err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-	  err = sys_waitpid((pid_t)tf->tf_a0,
-			    (userptr_t)tf->tf_a1,
-			    (int)tf->tf_a2,
-			    (pid_t *)&retval);
-	  break;
-    #if OPT_A2
-	case SYS_fork:
-	  err = sys_fork(tf, (pid_t *)&retval);
-	  break;
-	case SYS_execv:
-		err = sys_execv((char *) tf->tf_a0, (char **)tf->tf_a1);
-		break;
-	#endif
-	#endif // UW
-
-			/* Add stuff here */
-	
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
+	if (callno < 0 || callno >= SYSCALL_TABLESIZE ||
+	    syscall_table[callno].se_func == NULL) {
+		kprintf("Unknown syscall %d\n", callno);
+		se = NULL;
+		err = ENOSYS;
+	}
+	else {
+		se = &syscall_table[callno];
+		KTRACE(KT_SYSCALL, callno, 0, NULL);
+#if OPT_SYSCALLSTATS
+		if (se->se_flags & SE_NORETURN) {
+			syscall_stats_record(callno, 0, false, 0, 0);
+		}
+		gettime(&secs0, &nsecs0);
+#endif
+		err = se->se_func(tf, &ret);
+#if OPT_SYSCALLSTATS
+		if ((se->se_flags & SE_NORETURN) == 0) {
+			syscall_stats_record(callno, err, true,
+					     secs0, nsecs0);
+		}
+		else if (err) {
+			syscall_stats_record_error(callno);
+		}
+#endif
+		KTRACE(KT_SYSRET, callno, err, NULL);
 	}
 
 
@@ -165,9 +566,14 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+	else if (se->se_flags & SE_RET64) {
+		/* Success, with a 64-bit value returned in v0/v1. */
+		split64to32(ret.sr_val64, &tf->tf_v0, &tf->tf_v1);
+		tf->tf_a3 = 0;      /* signal no error */
+	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		tf->tf_v0 = ret.sr_val;
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -195,8 +601,9 @@ syscall(struct trapframe *tf)
 void
 enter_forked_process(void *tf, unsigned long data)
 {
-	(void) data;
 	#if OPT_A2
+	  /* DATA is the user stack slot of the thread that forked */
+	  curthread->t_ustack = data;
       struct trapframe new2 = *(struct trapframe *) tf;
 	  kfree(tf);
       new2.tf_v0 = 0;
@@ -204,5 +611,7 @@ enter_forked_process(void *tf, unsigned long data)
       new2.tf_epc += 4;
 	  as_activate();
       mips_usermode(&new2);
+    #else
+	(void) data;
     #endif
 }
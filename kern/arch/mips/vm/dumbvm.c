@@ -37,6 +37,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <ktrace.h>
 #include "opt-A3.h"
 
 /*
@@ -46,6 +47,10 @@
 
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
+#define DUMBVM_STACKSIZE     (DUMBVM_STACKPAGES * PAGE_SIZE)
+
+/* base of the lowest thread stack (see AS_MAXSTACKS) */
+#define DUMBVM_STACKSBASE    (USERSTACK - AS_MAXSTACKS * DUMBVM_STACKSIZE)
 
 /*
  * Wrap rma_stealmem in a spinlock.
@@ -73,6 +78,7 @@ vm_bootstrap(void)
 		}
 		//Coremap is now initialized
 		coremap_init = true;
+		spinlock_stats_register(&coreMap_lock, "coreMap_lock");
 	#endif
 }
 
@@ -170,7 +176,8 @@ int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
+	paddr_t paddr, stackpbase;
+	unsigned slot;
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
@@ -179,6 +186,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	KTRACE(KT_VMFAULT, faulttype, faultaddress, NULL);
+	curthread->t_usage.u_faults++;
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
@@ -247,6 +256,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (faultaddress >= DUMBVM_STACKSBASE && faultaddress < stackbase) {
+		/* another thread's stack */
+		slot = (stacktop - 1 - faultaddress) / DUMBVM_STACKSIZE;
+		stackpbase = as->as_threadstacks[slot - 1];
+		if (stackpbase == 0) {
+			return EFAULT;
+		}
+		paddr = (faultaddress - (stacktop - (slot + 1) * DUMBVM_STACKSIZE))
+			+ stackpbase;
+	}
 	else {
 		return EFAULT;
 	}
@@ -290,6 +309,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 struct addrspace *
 as_create(void)
 {
+	unsigned i;
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
 		return NULL;
@@ -302,6 +322,9 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	for (i=0; i<AS_MAXSTACKS - 1; i++) {
+		as->as_threadstacks[i] = 0;
+	}
     
 	#if OPT_A3
 		as->load_finish = false;
@@ -437,10 +460,89 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_define_threadstack(struct addrspace *as, unsigned slot, vaddr_t *stackptr)
+{
+	paddr_t pbase;
+
+	KASSERT(slot > 0 && slot < AS_MAXSTACKS);
+
+	if (as->as_threadstacks[slot - 1] == 0) {
+		pbase = getppages(DUMBVM_STACKPAGES);
+		if (pbase == 0) {
+			return ENOMEM;
+		}
+#if OPT_A3
+		if (pbase == ENOMEM) {
+			return ENOMEM;
+		}
+#endif
+		as_zero_region(pbase, DUMBVM_STACKPAGES);
+		as->as_threadstacks[slot - 1] = pbase;
+	}
+
+	*stackptr = USERSTACK - slot * DUMBVM_STACKSIZE;
+	return 0;
+}
+
+/*
+ * Every region is one physically contiguous run of pages, so the
+ * translation holds to the end of the region.
+ */
+int
+as_translate(struct addrspace *as, vaddr_t vaddr, bool write,
+	     paddr_t *paddr, size_t *contig)
+{
+	vaddr_t top, stackbase;
+	paddr_t pbase;
+	unsigned slot;
+
+	(void)write;	/* only text is ever read-only */
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+
+	if (vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+#if OPT_A3
+		if (write && as->load_finish) {
+			return EFAULT;
+		}
+#endif
+		top = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+		pbase = as->as_pbase1 + (vaddr - as->as_vbase1);
+	}
+	else if (vaddr >= as->as_vbase2 &&
+		 vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		top = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+		pbase = as->as_pbase2 + (vaddr - as->as_vbase2);
+	}
+	else if (vaddr >= stackbase && vaddr < USERSTACK) {
+		top = USERSTACK;
+		pbase = as->as_stackpbase + (vaddr - stackbase);
+	}
+	else if (vaddr >= DUMBVM_STACKSBASE && vaddr < stackbase) {
+		slot = (USERSTACK - 1 - vaddr) / DUMBVM_STACKSIZE;
+		if (as->as_threadstacks[slot - 1] == 0) {
+			return EFAULT;
+		}
+		top = USERSTACK - slot * DUMBVM_STACKSIZE;
+		pbase = as->as_threadstacks[slot - 1] +
+			(vaddr - (top - DUMBVM_STACKSIZE));
+	}
+	else {
+		return EFAULT;
+	}
+
+	*paddr = pbase;
+	*contig = top - vaddr;
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	vaddr_t stackptr;
+	unsigned i;
 
 	new = as_create();
 	if (new==NULL) {
@@ -473,6 +575,23 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	/*
+	 * The forking thread may be running on any of the stacks, so
+	 * bring them all along.
+	 */
+	for (i=1; i<AS_MAXSTACKS; i++) {
+		if (old->as_threadstacks[i - 1] == 0) {
+			continue;
+		}
+		if (as_define_threadstack(new, i, &stackptr)) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(new->as_threadstacks[i - 1]),
+			(const void *)PADDR_TO_KVADDR(old->as_threadstacks[i - 1]),
+			DUMBVM_STACKSIZE);
+	}
 	
 	*ret = new;
 	return 0;
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <mips/specialreg.h>
 #include <mips/trapframe.h>
 #include <cpu.h>
 #include <spl.h>
@@ -40,6 +41,7 @@
 #include <mainbus.h>
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
+#include <prof.h>
 #include "autoconf.h"
 
 /*
@@ -270,8 +272,12 @@ mainbus_interrupt(struct trapframe *tf)
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
 		mips_timer_set(CPU_FREQUENCY / HZ);
+#if OPT_PROF
+		/* profile the tick, since only we have the trapframe */
+		prof_sample(tf->tf_epc, (tf->tf_status & CST_KUp) != 0);
+#endif
 		/* and call hardclock */
-		hardclock();
+		hardclock((tf->tf_status & CST_KUp) != 0);
 	}
 	else {
 		panic("Unknown interrupt; cause register is %08x\n", cause);
@@ -155,18 +155,23 @@ putch_intr(struct con_softc *cs, int ch)
 
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ * The wait is interruptible (see thread_interrupt), since a user
+ * process can sit in it indefinitely.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_intr(struct con_softc *cs, int *ret)
 {
-	unsigned char ret;
+	int result;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
+	result = P_intr(cs->cs_rsem);
+	if (result) {
+		return result;
+	}
+	*ret = (unsigned char)cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	return ret;
+	return 0;
 }
 
 /*
@@ -269,10 +274,15 @@ int
 getch(void)
 {
 	struct con_softc *cs = the_console;
+	int ch, result;
+
 	KASSERT(cs != NULL);
 	KASSERT(!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0);
 
-	return getch_intr(cs);
+	/* nobody interrupts the kernel threads that use this */
+	result = getch_intr(cs, &ch);
+	KASSERT(result == 0);
+	return ch;
 }
 
 ////////////////////////////////////////////////////////////
@@ -302,7 +312,7 @@ static
 int
 con_io(struct device *dev, struct uio *uio)
 {
-	int result;
+	int result, inch;
 	char ch;
 	struct lock *lk;
 
@@ -320,7 +330,13 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			KASSERT(the_console != NULL);
+			result = getch_intr(the_console, &inch);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+			ch = inch;
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -479,11 +479,21 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/*
+	 * Someone may have picked up the vnode since VOP_DECREF
+	 * decided to reclaim it; if so, consume the reference it
+	 * handed us and leave the vnode alone.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
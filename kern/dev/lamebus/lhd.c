@@ -39,6 +39,7 @@
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
+#include <ktrace.h>
 #include "autoconf.h"
 
 /* Registers (offsets within slot) */
@@ -102,6 +103,7 @@ static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
+	KTRACE(KT_DISKDONE, err, 0, NULL);
 	lh->lh_result = err;
 	V(lh->lh_done);
 }
@@ -208,7 +210,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -225,12 +227,16 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/*
+	 * Wait until nobody else is using the device, and keep it
+	 * for the whole request so a multi-sector transfer isn't
+	 * interleaved with anyone else's.
+	 */
+	P(lh->lh_clear);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -238,8 +244,7 @@ lhd_io(struct device *d, struct uio *uio)
 		if (uio->uio_rw == UIO_WRITE) {
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
@@ -247,6 +252,7 @@ lhd_io(struct device *d, struct uio *uio)
 		lhd_wreg(lh, LHD_REG_SECT, sector+i);
 
 		/* and start the operation. */
+		KTRACE(KT_DISKIO, sector+i, uio->uio_rw == UIO_WRITE, NULL);
 		lhd_wreg(lh, LHD_REG_STAT, statval);
 
 		/* Now wait until the interrupt handler tells us we're done. */
@@ -263,16 +269,16 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	/* Tell another thread it's cleared to go ahead. */
+	V(lh->lh_clear);
+
+	return result;
 }
 
 /*
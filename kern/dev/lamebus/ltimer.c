@@ -114,7 +114,8 @@ ltimer_irq(void *vlt)
 		 * (Any additional timer devices are unused.)
 		 */
 		if (lt->lt_hardclock) {
-			hardclock();
+			/* no trapframe here, so no user/kernel split */
+			hardclock(false);
 		}
 		/*
 		 * Likewise for timerclock.
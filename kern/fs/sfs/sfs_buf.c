@@ -0,0 +1,757 @@
+/*
+ * SFS buffer cache. See sfs.h for the interface.
+ *
+ * There is one cache shared by all mounted SFS volumes, keyed by
+ * (volume, block). Buffers are allocated as they're first needed, up
+ * to sfs_maxbufs (1/SFS_BUFFRACTION of physical memory), and are
+ * never freed after that; once the limit is reached the least
+ * recently used idle buffer is recycled, writing it out first if it's
+ * dirty. Dirty buffers otherwise stay in memory until sfs_bflush,
+ * which the syncer thread gets called every SFS_SYNCSECS seconds.
+ *
+ * On a volume with a journal, a metadata buffer (b_meta) mustn't be
+ * written out until the journal holds it, so it's passed over until
+ * a commit has logged it (then it's b_logged); and a logged buffer
+ * is left for the journal's checkpoint (sfs_bcheckpoint) rather than
+ * written out at every sync.
+ *
+ * A buffer is held by one thread at a time (b_busy). b_refcount
+ * counts the holder and everyone waiting for it, and keeps the
+ * buffer from being recycled while they wait. All of the bookkeeping
+ * is under sfs_buflock; the block contents belong to the holder, and
+ * disk I/O is done holding only the buffer, not the lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
+#include <mainbus.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* cache size: this fraction of physical memory, but at least the min */
+#define SFS_BUFFRACTION	16
+#define SFS_MINBUFS	32
+
+/* how often the syncer writes dirty buffers back */
+#define SFS_SYNCSECS	5
+
+static struct lock *sfs_buflock;	/* protects everything below */
+static struct cv *sfs_bufcv;		/* for busy buffers, and a free one */
+
+static struct sfs_buf **sfs_bufs;	/* every buffer, for flushing */
+static unsigned sfs_nbufs;		/* how many there are so far */
+static unsigned sfs_maxbufs;		/* how many there can be */
+
+static struct sfs_buf **sfs_bufhash;	/* hash chains, by (fs, block) */
+static unsigned sfs_hashmask;		/* number of chains less one */
+
+/* LRU list; the head's next is the most recently used */
+static struct sfs_buf sfs_lru;
+
+/* counters, for sfs_bufstats_print */
+static struct {
+	unsigned hits;		/* sfs_bread found the block */
+	unsigned misses;	/* sfs_bread had to read it */
+	unsigned raread;	/* blocks read ahead */
+	unsigned raused;	/* ...and later asked for */
+	unsigned writes;	/* dirty blocks written back */
+} sfs_bufstats;
+
+static void sfs_syncer(void *, unsigned long);
+
+int
+sfs_bufbootstrap(void)
+{
+	unsigned nhash;
+	int result;
+
+	if (sfs_buflock != NULL) {
+		/* already done by an earlier mount */
+		return 0;
+	}
+
+	sfs_maxbufs = mainbus_ramsize() / SFS_BUFFRACTION / SFS_BLOCKSIZE;
+	if (sfs_maxbufs < SFS_MINBUFS) {
+		sfs_maxbufs = SFS_MINBUFS;
+	}
+	/* about two buffers per chain */
+	for (nhash = 1; nhash * 2 < sfs_maxbufs; nhash *= 2);
+
+	sfs_bufs = kmalloc(sfs_maxbufs * sizeof(struct sfs_buf *));
+	if (sfs_bufs == NULL) {
+		return ENOMEM;
+	}
+	sfs_bufhash = kmalloc(nhash * sizeof(struct sfs_buf *));
+	if (sfs_bufhash == NULL) {
+		kfree(sfs_bufs);
+		return ENOMEM;
+	}
+	bzero(sfs_bufhash, nhash * sizeof(struct sfs_buf *));
+	sfs_hashmask = nhash - 1;
+
+	sfs_bufcv = cv_create("sfs_buf");
+	if (sfs_bufcv == NULL) {
+		kfree(sfs_bufhash);
+		kfree(sfs_bufs);
+		return ENOMEM;
+	}
+	sfs_buflock = lock_create("sfs_buflock");
+	if (sfs_buflock == NULL) {
+		cv_destroy(sfs_bufcv);
+		kfree(sfs_bufhash);
+		kfree(sfs_bufs);
+		return ENOMEM;
+	}
+
+	sfs_nbufs = 0;
+	sfs_lru.b_lrunext = sfs_lru.b_lruprev = &sfs_lru;
+
+	result = thread_fork("sfs_syncer", NULL, sfs_syncer, NULL, 0);
+	if (result) {
+		lock_destroy(sfs_buflock);
+		sfs_buflock = NULL;
+		cv_destroy(sfs_bufcv);
+		kfree(sfs_bufhash);
+		kfree(sfs_bufs);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * The syncer: write-behind for dirty buffers. Syncing the whole
+ * filesystem, rather than just flushing the cache, also gets inodes
+ * of files still open and the free block bitmap onto the disk.
+ */
+static
+void
+sfs_syncer(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_SYNCSECS);
+		vfs_sync();
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+sfs_bufhashfn(struct sfs_fs *sfs, uint32_t block)
+{
+	return (((uintptr_t)sfs >> 6) ^ (block * 2654435761U)) & sfs_hashmask;
+}
+
+static
+struct sfs_buf *
+sfs_buflookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sfs_bufhash[sfs_bufhashfn(sfs, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_bufhash_add(struct sfs_buf *b)
+{
+	unsigned h = sfs_bufhashfn(b->b_fs, b->b_block);
+
+	b->b_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = b;
+}
+
+static
+void
+sfs_bufhash_remove(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	for (pp = &sfs_bufhash[sfs_bufhashfn(b->b_fs, b->b_block)];
+	     *pp != NULL; pp = &(*pp)->b_hashnext) {
+		if (*pp == b) {
+			*pp = b->b_hashnext;
+			b->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("sfs: buffer for block %u not in hash\n", b->b_block);
+}
+
+/* make B the most recently used */
+static
+void
+sfs_buftouch(struct sfs_buf *b)
+{
+	b->b_lruprev->b_lrunext = b->b_lrunext;
+	b->b_lrunext->b_lruprev = b->b_lruprev;
+	b->b_lrunext = sfs_lru.b_lrunext;
+	b->b_lruprev = &sfs_lru;
+	sfs_lru.b_lrunext->b_lruprev = b;
+	sfs_lru.b_lrunext = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting buffers
+
+/*
+ * Wait for B, which someone else may hold, and take it.
+ */
+static
+void
+sfs_bufwait(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	b->b_refcount++;
+	while (b->b_busy) {
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+	b->b_busy = true;
+}
+
+/*
+ * Let go of B, which we hold. Its contents may no longer be wanted.
+ */
+static
+void
+sfs_bufunbusy(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_refcount > 0);
+
+	b->b_busy = false;
+	b->b_refcount--;
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+}
+
+/*
+ * Write out B, which we hold, if it's dirty. Called with the lock
+ * held; drops it for the I/O.
+ */
+static
+int
+sfs_bufclean(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	if (!b->b_dirty) {
+		return 0;
+	}
+
+	lock_release(sfs_buflock);
+	result = sfs_wblock(b->b_fs, b->b_data, b->b_block);
+	lock_acquire(sfs_buflock);
+
+	if (result == 0) {
+		b->b_dirty = false;
+		b->b_logged = false;
+		if (b->b_meta) {
+			b->b_meta = false;
+			b->b_fs->sfs_nmeta--;
+		}
+		sfs_bufstats.writes++;
+	}
+	return result;
+}
+
+/*
+ * Forget B's block, dirty or not.
+ */
+static
+void
+sfs_bufforget(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	sfs_bufhash_remove(b);
+	if (b->b_meta) {
+		b->b_fs->sfs_nmeta--;
+	}
+	b->b_fs = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_meta = false;
+	b->b_logged = false;
+}
+
+/*
+ * Make a new buffer if we're allowed to.
+ */
+static
+struct sfs_buf *
+sfs_bufcreate(void)
+{
+	struct sfs_buf *b;
+
+	if (sfs_nbufs >= sfs_maxbufs) {
+		return NULL;
+	}
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(SFS_BLOCKSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_ra = false;
+	b->b_meta = false;
+	b->b_logged = false;
+	b->b_refcount = 0;
+	b->b_hashnext = NULL;
+	b->b_lrunext = sfs_lru.b_lrunext;
+	b->b_lruprev = &sfs_lru;
+	sfs_lru.b_lrunext->b_lruprev = b;
+	sfs_lru.b_lrunext = b;
+
+	sfs_bufs[sfs_nbufs++] = b;
+	return b;
+}
+
+/*
+ * Find a buffer nobody is using to hold another block, cleaning it
+ * if need be. Returns NULL if there is none right now, or if the lock
+ * had to be dropped (in which case the caller must look again for
+ * the block it wants, since someone else may have loaded it).
+ *
+ * Metadata that isn't in the journal yet is only written out if
+ * there's nothing else at all. That isn't crash-safe, but sfs_jbegin
+ * commits long before the cache fills up that way.
+ */
+static
+struct sfs_buf *
+sfs_bufrecycle(bool *dropped)
+{
+	struct sfs_buf *b;
+	unsigned pass;
+	int result;
+
+	*dropped = false;
+
+	b = sfs_bufcreate();
+	if (b != NULL) {
+		return b;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (b = sfs_lru.b_lruprev; b != &sfs_lru;
+		     b = b->b_lruprev) {
+			if (b->b_refcount > 0) {
+				continue;
+			}
+			if (b->b_meta && pass == 0) {
+				continue;
+			}
+			if (b->b_dirty) {
+				/* write it out and let the caller try again */
+				sfs_bufwait(b);
+				result = sfs_bufclean(b);
+				if (result) {
+					/* don't keep trying forever */
+					kprintf("sfs: block %u: %s; discarding "
+						"changes\n", b->b_block,
+						strerror(result));
+					if (b->b_meta) {
+						b->b_fs->sfs_nmeta--;
+					}
+					b->b_dirty = false;
+					b->b_meta = false;
+					b->b_logged = false;
+				}
+				sfs_bufunbusy(b);
+				*dropped = true;
+				return NULL;
+			}
+			if (b->b_fs != NULL) {
+				sfs_bufhash_remove(b);
+			}
+			b->b_fs = NULL;
+			b->b_valid = false;
+			b->b_ra = false;
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get BLOCK's buffer, held by us, with or without its contents.
+ */
+static
+struct sfs_buf *
+sfs_bufget(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+	bool dropped;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	while (1) {
+		b = sfs_buflookup(sfs, block);
+		if (b != NULL) {
+			sfs_bufwait(b);
+			if (b->b_fs == sfs && b->b_block == block) {
+				break;
+			}
+			/* invalidated while we waited */
+			sfs_bufunbusy(b);
+			continue;
+		}
+		b = sfs_bufrecycle(&dropped);
+		if (b != NULL) {
+			b->b_fs = sfs;
+			b->b_block = block;
+			sfs_bufhash_add(b);
+			b->b_refcount = 1;
+			b->b_busy = true;
+			break;
+		}
+		if (!dropped) {
+			/* everything is in use; wait for a release */
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+	}
+	sfs_buftouch(b);
+	return b;
+}
+
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_bufget(sfs, block);
+	if (b->b_valid) {
+		sfs_bufstats.hits++;
+		if (b->b_ra) {
+			sfs_bufstats.raused++;
+			b->b_ra = false;
+		}
+	}
+	else {
+		sfs_bufstats.misses++;
+		lock_release(sfs_buflock);
+		result = sfs_rblock(sfs, b->b_data, block);
+		lock_acquire(sfs_buflock);
+		if (result) {
+			sfs_bufunbusy(b);
+			lock_release(sfs_buflock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	lock_release(sfs_buflock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+sfs_bprefetch(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+	int result = 0;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_bufget(sfs, block);
+	if (!b->b_valid) {
+		lock_release(sfs_buflock);
+		result = sfs_rblock(sfs, b->b_data, block);
+		lock_acquire(sfs_buflock);
+		if (result == 0) {
+			b->b_valid = true;
+			b->b_ra = true;
+			sfs_bufstats.raread++;
+		}
+	}
+	sfs_bufunbusy(b);
+	lock_release(sfs_buflock);
+	return result;
+}
+
+bool
+sfs_bincore(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+	bool ret;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_buflookup(sfs, block);
+	ret = (b != NULL && b->b_valid);
+	lock_release(sfs_buflock);
+	return ret;
+}
+
+void
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	lock_acquire(sfs_buflock);
+	*ret = sfs_bufget(sfs, block);
+	lock_release(sfs_buflock);
+}
+
+void
+sfs_bdirty(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+	b->b_ra = false;
+}
+
+void
+sfs_bdirtymeta(struct sfs_buf *b)
+{
+	sfs_bdirty(b);
+	if (b->b_fs->sfs_super.sp_jblocks > 0 && !b->b_meta) {
+		lock_acquire(sfs_buflock);
+		b->b_meta = true;
+		b->b_fs->sfs_nmeta++;
+		lock_release(sfs_buflock);
+	}
+}
+
+void
+sfs_brelse(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	sfs_bufunbusy(b);
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O around the cache
+
+struct sfs_buf *
+sfs_bpeek(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_buflookup(sfs, block);
+	if (b != NULL) {
+		sfs_bufwait(b);
+		if (b->b_fs != sfs || b->b_block != block) {
+			/* invalidated while we waited */
+			sfs_bufunbusy(b);
+			b = NULL;
+		}
+	}
+	lock_release(sfs_buflock);
+	return b;
+}
+
+void
+sfs_bforget(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_fs != NULL);
+	sfs_bufforget(b);
+	sfs_bufunbusy(b);
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-volume operations
+
+void
+sfs_binval(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_buflookup(sfs, block);
+	if (b != NULL) {
+		sfs_bufwait(b);
+		/* sfs_bufrecycle skips held buffers, so it's still BLOCK */
+		if (b->b_fs == sfs) {
+			sfs_bufforget(b);
+		}
+		sfs_bufunbusy(b);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Write out SFS's dirty buffers: ALL of them, or only those that
+ * aren't waiting for the journal.
+ */
+static
+int
+sfs_bufflush(struct sfs_fs *sfs, bool all)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result, ret;
+
+	ret = 0;
+	lock_acquire(sfs_buflock);
+	/* sfs_bufs only ever grows, so indexing survives dropping the lock */
+	for (i=0; i<sfs_nbufs; i++) {
+		b = sfs_bufs[i];
+		if (b->b_fs != sfs || !b->b_dirty ||
+		    (!all && (b->b_meta || b->b_logged))) {
+			continue;
+		}
+		sfs_bufwait(b);
+		/* it may have changed while we waited */
+		if (b->b_fs == sfs && (all || (!b->b_meta && !b->b_logged))) {
+			result = sfs_bufclean(b);
+			if (result && ret == 0) {
+				ret = result;
+			}
+		}
+		sfs_bufunbusy(b);
+	}
+	lock_release(sfs_buflock);
+	return ret;
+}
+
+int
+sfs_bflush(struct sfs_fs *sfs)
+{
+	return sfs_bufflush(sfs, false);
+}
+
+int
+sfs_bcheckpoint(struct sfs_fs *sfs)
+{
+	return sfs_bufflush(sfs, true);
+}
+
+unsigned
+sfs_bmetalist(struct sfs_fs *sfs, uint32_t *blocks, unsigned max)
+{
+	struct sfs_buf *b;
+	unsigned i, n;
+
+	n = 0;
+	lock_acquire(sfs_buflock);
+	for (i=0; i<sfs_nbufs; i++) {
+		b = sfs_bufs[i];
+		if (b->b_fs == sfs && b->b_meta) {
+			if (n < max) {
+				blocks[n] = b->b_block;
+			}
+			n++;
+		}
+	}
+	lock_release(sfs_buflock);
+	return n;
+}
+
+void
+sfs_bcommitted(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<sfs_nbufs; i++) {
+		b = sfs_bufs[i];
+		if (b->b_fs == sfs && b->b_meta) {
+			KASSERT(b->b_dirty);
+			b->b_meta = false;
+			b->b_logged = true;
+			sfs->sfs_nmeta--;
+		}
+	}
+	KASSERT(sfs->sfs_nmeta == 0);
+	lock_release(sfs_buflock);
+}
+
+bool
+sfs_bmetafull(struct sfs_fs *sfs)
+{
+	/* only a hint, so no lock */
+	return sfs->sfs_nmeta * 2 >= sfs_maxbufs;
+}
+
+void
+sfs_bdiscard(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<sfs_nbufs; i++) {
+		b = sfs_bufs[i];
+		if (b->b_fs != sfs) {
+			continue;
+		}
+		KASSERT(b->b_refcount == 0);
+		if (b->b_dirty) {
+			kprintf("sfs: discarding dirty block %u at unmount\n",
+				b->b_block);
+		}
+		sfs_bufforget(b);
+	}
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+sfs_bufstats_print(void)
+{
+	unsigned lookups;
+
+	if (sfs_buflock == NULL) {
+		kprintf("sfs: no buffer cache (nothing mounted yet)\n");
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+	lookups = sfs_bufstats.hits + sfs_bufstats.misses;
+	kprintf("sfs buffer cache: %u of %u buffers\n",
+		sfs_nbufs, sfs_maxbufs);
+	kprintf("    %u hits, %u misses (%u%% hit)\n",
+		sfs_bufstats.hits, sfs_bufstats.misses,
+		lookups == 0 ? 0 : sfs_bufstats.hits * 100 / lookups);
+	kprintf("    %u blocks read ahead, %u used\n",
+		sfs_bufstats.raread, sfs_bufstats.raused);
+	kprintf("    %u dirty blocks written back\n", sfs_bufstats.writes);
+	lock_release(sfs_buflock);
+}
+
+void
+sfs_bufstats_reset(void)
+{
+	if (sfs_buflock == NULL) {
+		return;
+	}
+	lock_acquire(sfs_buflock);
+	bzero(&sfs_bufstats, sizeof(sfs_bufstats));
+	lock_release(sfs_buflock);
+}
@@ -39,64 +39,127 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
 
-/* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
-
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Routines for doing I/O (reads or writes) on the free block bitmap.
+ * It's read in a block at a time, the first time one of its bits is
+ * wanted, and only the blocks that changed are written back; a sync
+ * after changing one bit writes one block, not the whole bitmap.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
- * that the bitmap will (in general) contain space for some number of
- * invalid sectors that are actually beyond the end of the disk
- * device. This is ok. These sectors are supposed to be marked "in
- * use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_BITBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of bits is
+ * thus rounded up to the nearest multiple of SFS_BLOCKBITS. (This
+ * rounded number is SFS_BITMAPSIZE.) This means that the bitmap will
+ * (in general) contain space for some number of invalid blocks that
+ * are actually beyond the end of the disk device. This is ok. These
+ * blocks are supposed to be marked "in use" by mksfs and never get
+ * marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
- * likewise marked in use by mksfs.
+ * The blocks used by the superblock, the bitmap itself, and the
+ * journal are likewise marked in use by mksfs.
  */
 
+/* Set LEN bytes of the in-memory bitmap, making it all in use */
 static
+void
+sfs_mapfill(char *ptr, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		ptr[i] = (char)0xff;
+	}
+}
+
 int
-sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_mapload(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t j = block / SFS_BLOCKBITS;
+	char *ptr;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(j < SFS_FS_BITBLOCKS(sfs));
+
+	if (bitmap_isset(sfs->sfs_maploaded, j)) {
+		return 0;
+	}
+
+	ptr = (char *)bitmap_getdata(sfs->sfs_freemap) + j*SFS_BLOCKSIZE;
+	result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+	if (result) {
+		/* Whatever got read, it's not loaded; all in use again */
+		sfs_mapfill(ptr, SFS_BLOCKSIZE);
+		return result;
+	}
+	bitmap_mark(sfs->sfs_maploaded, j);
+	return 0;
+}
+
+int
+sfs_maploadnext(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t i, j, mapsize;
+
+	mapsize = SFS_FS_BITBLOCKS(sfs);
+	for (i=0; i<mapsize; i++) {
+		j = (block / SFS_BLOCKBITS + i) % mapsize;
+		if (!bitmap_isset(sfs->sfs_maploaded, j)) {
+			return sfs_mapload(sfs, j * SFS_BLOCKBITS);
+		}
+	}
+	return ENOSPC;
+}
+
+void
+sfs_dirtymap(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t j = block / SFS_BLOCKBITS;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(bitmap_isset(sfs->sfs_maploaded, j));
+
+	if (!bitmap_isset(sfs->sfs_mapdirty, j)) {
+		bitmap_mark(sfs->sfs_mapdirty, j);
+		sfs->sfs_nmapdirty++;
+	}
+}
+
+int
+sfs_mapsync(struct sfs_fs *sfs)
 {
 	uint32_t j, mapsize;
 	char *bitdata;
 	int result;
 
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
 	/* Number of blocks in the bitmap. */
 	mapsize = SFS_FS_BITBLOCKS(sfs);
 
 	/* Pointer to our bitmap data in memory. */
 	bitdata = bitmap_getdata(sfs->sfs_freemap);
-	
-	/* For each sector in the bitmap... */
-	for (j=0; j<mapsize; j++) {
 
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
-
-		/* and read or write it. The bitmap starts at sector 2. */ 
-		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
-		}
-		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+	/* For each block in the bitmap that changed... */
+	for (j=0; j<mapsize && sfs->sfs_nmapdirty > 0; j++) {
+		if (!bitmap_isset(sfs->sfs_mapdirty, j)) {
+			continue;
 		}
 
+		/* write it. The bitmap starts at SFS_MAP_LOCATION. */
+		result = sfs_wblock(sfs, bitdata + j*SFS_BLOCKSIZE,
+				    SFS_MAP_LOCATION+j);
+
 		/* If we failed, stop. */
 		if (result) {
 			return result;
 		}
+		bitmap_unmark(sfs->sfs_mapdirty, j);
+		sfs->sfs_nmapdirty--;
 	}
 	return 0;
 }
@@ -111,11 +174,10 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct vnodearray *snapshot;
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,34 +210,87 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* With a journal, a commit does it all. */
+	if (sfs->sfs_super.sp_jblocks > 0) {
+		return sfs_jcommit(sfs);
+	}
+
+	/*
+	 * Take the dirty vnodes off the dirty list, with a reference
+	 * to each, so we can sync them without holding sfs_vnlock;
+	 * the vnode's own lock must come before sfs_vnlock. (Holding
+	 * sfs_vnlock here keeps sfs_reclaim from freeing one between
+	 * deciding to and taking it off the list.) Any that get
+	 * dirtied again go back on the list.
+	 */
+	snapshot = vnodearray_create();
+	if (snapshot == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_ndirty;
+	result = vnodearray_setsize(snapshot, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(snapshot);
+		return result;
+	}
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	/* more may have been dirtied since; leave them for next time */
+	for (i=0; i<num && sfs->sfs_dirtyvnodes != NULL; i++) {
+		struct sfs_vnode *sv = sfs->sfs_dirtyvnodes;
+		sfs_undirty(sv);
+		VOP_INCREF(&sv->sv_v);
+		vnodearray_set(snapshot, i, &sv->sv_v);
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
+	num = i;
+
+	/*
+	 * Go over the dirty vnodes, pushing their inodes into the
+	 * buffer cache as we go. (Not VOP_FSYNC, which would flush
+	 * the whole cache once per vnode.)
+	 */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(snapshot, i);
+		struct sfs_vnode *sv = v->vn_data;
+
+		lock_acquire(sv->sv_lock);
+		sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+	vnodearray_setsize(snapshot, 0);
+	vnodearray_destroy(snapshot);
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	/* Write out the dirty blocks. */
+	result = sfs_bflush(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Write the parts of the free block map that changed. */
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_mapsync(sfs);
+	lock_release(sfs->sfs_freemaplock);
+	if (result) {
+		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
+	lock_acquire(sfs->sfs_superlock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_superlock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_superlock);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -189,13 +304,45 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
+	/* The volume name never changes after mount; no lock needed. */
+	return sfs->sfs_super.sp_volname;
+}
 
-	return ret;
+/*
+ * Create and destroy the per-filesystem locks.
+ */
+static
+int
+sfs_fs_createlocks(struct sfs_fs *sfs)
+{
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sfs->sfs_superlock = lock_create("sfs_superlock");
+	if (sfs->sfs_superlock == NULL) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	spinlock_init(&sfs->sfs_dirtylock);
+	return 0;
+}
+
+static
+void
+sfs_fs_destroylocks(struct sfs_fs *sfs)
+{
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_superlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 }
 
 /*
@@ -208,31 +355,47 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * The sync left committed changes in the journal; write them
+	 * home so it can be emptied.
+	 */
+	result = sfs_jcheckpoint(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_nmapdirty == 0);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_dirtyvnodes == NULL);
+	sfs_bdiscard(sfs);
+	bitmap_destroy(sfs->sfs_mapdirty);
+	bitmap_destroy(sfs->sfs_maploaded);
 	bitmap_destroy(sfs->sfs_freemap);
+	sfs_junmount(sfs);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Destroy the fs object */
+	sfs_fs_destroylocks(sfs);
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -256,8 +419,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	uint32_t blocksize;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -270,42 +432,51 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors don't divide our
+	 * blocks evenly. Each block is SFS_BLOCKSIZE/d_blocksize
+	 * sectors, moved in one transfer.
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
+	if (dev->d_blocksize == 0 || SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		return ENXIO;
 	}
 
+	/* Set up the buffer cache and read-ahead, if this is the first mount */
+	result = sfs_bufbootstrap();
+	if (result) {
+		return result;
+	}
+	result = sfs_rabootstrap();
+	if (result) {
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate locks */
+	result = sfs_fs_createlocks(sfs);
+	if (result) {
 		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		return result;
 	}
 
+	/* Empty vnode table and dirty list */
+	bzero(sfs->sfs_vnhash, sizeof(sfs->sfs_vnhash));
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_dirtyvnodes = NULL;
+	sfs->sfs_ndirty = 0;
+
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
 
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_fs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,36 +487,71 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_fs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
+	blocksize = sfs->sfs_super.sp_blocksize;
+	if (blocksize == 0) {
+		blocksize = SFS_OLDBLOCKSIZE;
+	}
+	if (blocksize != SFS_BLOCKSIZE) {
+		kprintf("sfs: Volume has %u-byte blocks; this kernel "
+			"uses %u\n", blocksize, SFS_BLOCKSIZE);
+		sfs_fs_destroylocks(sfs);
+		kfree(sfs);
+		return EINVAL;
+	}
+
+	if (sfs->sfs_super.sp_nblocks >
+	    dev->d_blocks / (SFS_BLOCKSIZE / dev->d_blocksize)) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
+			sfs->sfs_super.sp_nblocks,
+			dev->d_blocks / (SFS_BLOCKSIZE / dev->d_blocksize));
+	}
+
+	/*
+	 * Set up the journal, replaying it if the volume wasn't
+	 * unmounted cleanly. This can change anything on disk, the
+	 * superblock included, so it comes before the rest is loaded.
+	 */
+	result = sfs_jmount(sfs);
+	if (result) {
+		sfs_fs_destroylocks(sfs);
+		kfree(sfs);
+		return result;
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
-	/* Load free space bitmap */
+	/*
+	 * Set up the free space bitmap. None of it is read in yet;
+	 * until it is, it's all in use.
+	 */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
-	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+	sfs->sfs_maploaded = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	sfs->sfs_mapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_maploaded == NULL ||
+	    sfs->sfs_mapdirty == NULL) {
+		if (sfs->sfs_mapdirty != NULL) {
+			bitmap_destroy(sfs->sfs_mapdirty);
+		}
+		if (sfs->sfs_maploaded != NULL) {
+			bitmap_destroy(sfs->sfs_maploaded);
+		}
+		if (sfs->sfs_freemap != NULL) {
+			bitmap_destroy(sfs->sfs_freemap);
+		}
+		sfs_junmount(sfs);
+		sfs_fs_destroylocks(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_mapio(sfs, UIO_READ);
-	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
-	}
+	sfs_mapfill(bitmap_getdata(sfs->sfs_freemap),
+		    SFS_FS_BITBLOCKS(sfs) * SFS_BLOCKSIZE);
+	sfs->sfs_nmapdirty = 0;
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -356,12 +562,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* the other fields */
 	sfs->sfs_superdirty = false;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_alloccursor = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -49,14 +49,29 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
+	struct iovec saveiov;
+	off_t saveoffset;
+	size_t saveresid;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	/*
+	 * The transfer may be several blocks long, and a failure
+	 * partway through leaves the uio advanced; remember where
+	 * it started so a retry can start over.
+	 */
+	KASSERT(uio->uio_iovcnt == 1);
+	saveiov = *uio->uio_iov;
+	saveoffset = uio->uio_offset;
+	saveresid = uio->uio_resid;
 
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
  retry:
+	*uio->uio_iov = saveiov;
+	uio->uio_iovcnt = 1;
+	uio->uio_offset = saveoffset;
+	uio->uio_resid = saveresid;
 	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
 	if (result == EINVAL) {
 		/*
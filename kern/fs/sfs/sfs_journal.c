@@ -0,0 +1,913 @@
+/*
+ * SFS metadata journal. See kern/sfs.h for the on-disk format, and
+ * sfs.h for the interface.
+ *
+ * Metadata is changed in the buffer cache as before, but its buffers
+ * (b_meta) aren't written back until a commit has put them in the
+ * log. A commit gathers everything changed since the last one: the
+ * dirty inodes, the metadata buffers, the freemap blocks that
+ * changed, the superblock if it did, and the blocks to revoke. (The
+ * freemap blocks are in sfs_mapdirty until logged, and then in
+ * sfs_jmaplogged until written home.) It writes them to the
+ * log as one transaction, in order from the log head, and then the
+ * commit block. That's all a sync of metadata usually costs: the
+ * buffers stay dirty (b_logged), so a block changed over and over is
+ * only written home once, at a checkpoint. A checkpoint writes
+ * everything home and starts the log over. It happens when the log
+ * is half full, or at unmount.
+ *
+ * So that a transaction never holds half an operation, operations
+ * that change metadata run between sfs_jbegin and sfs_jend. A commit
+ * waits for those under way to finish and holds off new ones until
+ * it's done. While it waits, nothing changes metadata, so it can push
+ * dirty inodes into the cache without their vnode locks. sfs_jbegin
+ * commits first if the changes waiting would take more than a
+ * quarter of the log, or half the buffer cache.
+ *
+ * A block freed by an operation isn't free for reuse until a commit
+ * says so. Until then it stays marked in the freemap, and is noted in
+ * sfs_jfreemap. Otherwise it could be reused and overwritten with
+ * file data while the disk still says it's what it was; a crash then
+ * would leave that data where an inode or directory should be. So
+ * when the disk is full apart from such blocks, allocating fails with
+ * ENOSPC, and sets sfs_jlowspace so the next sfs_jbegin commits first
+ * and the blocks are really free by the time they're asked for. If
+ * a freed block has an image in the log, the commit also revokes it,
+ * so that replaying the log can't write an old image over whatever
+ * the block is used for next.
+ *
+ * File data isn't logged. But a commit writes dirty file blocks
+ * before logging, so committed metadata never points at blocks that
+ * were never written.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Blocks of log after the header, and where log block N is */
+#define SFS_JLOGLEN(sfs)	((sfs)->sfs_super.sp_jblocks - 1)
+#define SFS_JLOGBLOCK(sfs, n)	((sfs)->sfs_super.sp_jstart + 1 + (n))
+
+/* Whether the volume has a journal */
+#define SFS_HASJOURNAL(sfs)	((sfs)->sfs_super.sp_jblocks > 0)
+
+/* Fold a block into a checksum */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/4; i++) {
+		sum = SFS_JSUM_STEP(sum, words[i]);
+	}
+	return sum;
+}
+
+/* Write the log header, saying the log starts with transaction SEQ. */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh = sfs->sfs_jbuf;
+
+	bzero(jh, SFS_BLOCKSIZE);
+	jh->jh_magic = SFS_JHMAGIC;
+	jh->jh_seq = seq;
+	return sfs_wblock(sfs, jh, sfs->sfs_super.sp_jstart);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Replay
+//
+// This goes over the log three times: to find the transactions that
+// were committed, to collect what they revoke, and to write their
+// images home. Nothing else is going on yet (the freemap isn't even
+// loaded), so it does its own I/O around the buffer cache.
+
+struct sfs_jrevoked {
+	uint32_t jr_block;
+	uint32_t jr_seq;		/* transaction that revoked it */
+};
+
+struct sfs_jreplay {
+	uint32_t *jp_desc;		/* a descriptor or commit block */
+	void *jp_data;			/* an image */
+	struct sfs_jrevoked *jp_revoked;
+	unsigned jp_nrevoked;
+	unsigned jp_maxrevoked;
+	unsigned jp_nimages;		/* images written home */
+};
+
+#define SFS_JSCAN	0		/* check the transaction */
+#define SFS_JREVOKES	1		/* collect what it revokes */
+#define SFS_JAPPLY	2		/* write its images home */
+
+/* Whether a transaction after SEQ revokes BLOCK */
+static
+bool
+sfs_jisrevoked(struct sfs_jreplay *jp, uint32_t block, uint32_t seq)
+{
+	unsigned i;
+
+	for (i=0; i<jp->jp_nrevoked; i++) {
+		if (jp->jp_revoked[i].jr_block == block &&
+		    jp->jp_revoked[i].jr_seq - seq < 0x80000000U &&
+		    jp->jp_revoked[i].jr_seq != seq) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Do PASS to the transaction SEQ that starts at log block POS. On
+ * success, hand back its length in blocks, and for SFS_JSCAN how many
+ * revokes it holds. Returns -1 for SFS_JSCAN if there's no committed
+ * transaction there, or an errno for an I/O error.
+ */
+static
+int
+sfs_jreplaytxn(struct sfs_fs *sfs, struct sfs_jreplay *jp, unsigned pass,
+	       uint32_t pos, uint32_t seq, uint32_t *lenret,
+	       unsigned *nrevokeret)
+{
+	struct sfs_jdesc *jd = (struct sfs_jdesc *)jp->jp_desc;
+	struct sfs_jcommit *jc = (struct sfs_jcommit *)jp->jp_desc;
+	uint32_t loglen = SFS_JLOGLEN(sfs);
+	uint32_t p, i, home, sum;
+	unsigned nrevoke;
+	int result;
+
+	sum = SFS_JSUM_INIT;
+	nrevoke = 0;
+	p = pos;
+	while (1) {
+		if (p >= loglen) {
+			return -1;
+		}
+		result = sfs_rblock(sfs, jp->jp_desc, SFS_JLOGBLOCK(sfs, p));
+		if (result) {
+			return result;
+		}
+		if (jc->jc_magic == SFS_JCMAGIC && jc->jc_seq == seq &&
+		    p > pos) {
+			if (jc->jc_sum != sum) {
+				return -1;
+			}
+			break;
+		}
+		if (jd->jd_magic != SFS_JDMAGIC || jd->jd_seq != seq ||
+		    jd->jd_nblocks > SFS_JDESCMAX ||
+		    jd->jd_nrevoke > SFS_JDESCMAX - jd->jd_nblocks ||
+		    jd->jd_nblocks >= loglen - p) {
+			return -1;
+		}
+		sum = sfs_jsum(sum, jd);
+		nrevoke += jd->jd_nrevoke;
+
+		if (pass == SFS_JREVOKES) {
+			for (i=0; i<jd->jd_nrevoke; i++) {
+				KASSERT(jp->jp_nrevoked < jp->jp_maxrevoked);
+				jp->jp_revoked[jp->jp_nrevoked].jr_block =
+					jd->jd_blocks[jd->jd_nblocks + i];
+				jp->jp_revoked[jp->jp_nrevoked].jr_seq = seq;
+				jp->jp_nrevoked++;
+			}
+		}
+
+		for (i=0; i<jd->jd_nblocks; i++) {
+			home = jd->jd_blocks[i];
+			if (pass == SFS_JREVOKES) {
+				continue;
+			}
+			if (pass == SFS_JAPPLY &&
+			    (home >= sfs->sfs_super.sp_nblocks ||
+			     sfs_jisrevoked(jp, home, seq))) {
+				continue;
+			}
+			result = sfs_rblock(sfs, jp->jp_data,
+					    SFS_JLOGBLOCK(sfs, p + 1 + i));
+			if (result) {
+				return result;
+			}
+			if (pass == SFS_JSCAN) {
+				sum = sfs_jsum(sum, jp->jp_data);
+				continue;
+			}
+			result = sfs_wblock(sfs, jp->jp_data, home);
+			if (result) {
+				return result;
+			}
+			jp->jp_nimages++;
+		}
+		p += 1 + jd->jd_nblocks;
+	}
+
+	*lenret = p + 1 - pos;
+	if (nrevokeret != NULL) {
+		*nrevokeret = nrevoke;
+	}
+	return 0;
+}
+
+/*
+ * Replay the log, and then empty it. Hands back the sequence number
+ * for the next transaction.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, uint32_t *seqret)
+{
+	struct sfs_jreplay jp;
+	struct sfs_jheader *jh;
+	uint32_t firstseq, seq, pos, len, ntxns, n;
+	unsigned nrevoke, pass;
+	int result;
+
+	jh = sfs->sfs_jbuf;
+	result = sfs_rblock(sfs, jh, sfs->sfs_super.sp_jstart);
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic != SFS_JHMAGIC) {
+		kprintf("sfs: Bad journal header (magic 0x%x)\n",
+			jh->jh_magic);
+		return EINVAL;
+	}
+	firstseq = jh->jh_seq;
+
+	bzero(&jp, sizeof(jp));
+	jp.jp_desc = kmalloc(SFS_BLOCKSIZE);
+	jp.jp_data = kmalloc(SFS_BLOCKSIZE);
+	if (jp.jp_desc == NULL || jp.jp_data == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/* Find the committed transactions */
+	ntxns = 0;
+	pos = 0;
+	seq = firstseq;
+	while (1) {
+		result = sfs_jreplaytxn(sfs, &jp, SFS_JSCAN, pos, seq,
+					&len, &nrevoke);
+		if (result == -1) {
+			break;
+		}
+		if (result) {
+			goto out;
+		}
+		jp.jp_maxrevoked += nrevoke;
+		ntxns++;
+		pos += len;
+		seq++;
+	}
+	result = 0;
+	*seqret = seq;
+	if (ntxns == 0) {
+		goto out;
+	}
+
+	if (jp.jp_maxrevoked > 0) {
+		jp.jp_revoked = kmalloc(jp.jp_maxrevoked *
+					sizeof(struct sfs_jrevoked));
+		if (jp.jp_revoked == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+	}
+
+	/* Collect the revokes, and then write the images home */
+	for (pass = SFS_JREVOKES; pass <= SFS_JAPPLY; pass++) {
+		pos = 0;
+		seq = firstseq;
+		for (n=0; n<ntxns; n++) {
+			result = sfs_jreplaytxn(sfs, &jp, pass, pos, seq,
+						&len, NULL);
+			if (result) {
+				/* it read fine a moment ago */
+				if (result == -1) {
+					result = EIO;
+				}
+				goto out;
+			}
+			pos += len;
+			seq++;
+		}
+	}
+
+	kprintf("sfs: Replayed %u transactions (%u blocks) from the "
+		"journal\n", ntxns, jp.jp_nimages);
+
+	/* The images are home; start the log over */
+	result = sfs_jwriteheader(sfs, *seqret);
+
+ out:
+	if (jp.jp_revoked != NULL) {
+		kfree(jp.jp_revoked);
+	}
+	if (jp.jp_data != NULL) {
+		kfree(jp.jp_data);
+	}
+	if (jp.jp_desc != NULL) {
+		kfree(jp.jp_desc);
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mount and unmount
+
+void
+sfs_junmount(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_jmaplogged != NULL) {
+		bitmap_destroy(sfs->sfs_jmaplogged);
+	}
+	if (sfs->sfs_jlogmap != NULL) {
+		bitmap_destroy(sfs->sfs_jlogmap);
+	}
+	if (sfs->sfs_jfreemap != NULL) {
+		bitmap_destroy(sfs->sfs_jfreemap);
+	}
+	if (sfs->sfs_jrevoke != NULL) {
+		kfree(sfs->sfs_jrevoke);
+	}
+	if (sfs->sfs_jblocks != NULL) {
+		kfree(sfs->sfs_jblocks);
+	}
+	if (sfs->sfs_jbuf != NULL) {
+		kfree(sfs->sfs_jbuf);
+	}
+	if (sfs->sfs_jcv != NULL) {
+		cv_destroy(sfs->sfs_jcv);
+	}
+	if (sfs->sfs_jlock != NULL) {
+		lock_destroy(sfs->sfs_jlock);
+	}
+}
+
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	uint32_t loglen;
+	int result;
+
+	sfs->sfs_nmeta = 0;
+	sfs->sfs_jlock = NULL;
+	sfs->sfs_jactive = 0;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jcv = NULL;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jhead = 0;
+	sfs->sfs_jmaplogged = NULL;
+	sfs->sfs_jsuperlogged = false;
+	sfs->sfs_jfreemap = NULL;
+	sfs->sfs_jnfreed = 0;
+	sfs->sfs_jlowspace = false;
+	sfs->sfs_jlogmap = NULL;
+	sfs->sfs_jrevoke = NULL;
+	sfs->sfs_jnrevoke = 0;
+	sfs->sfs_jblocks = NULL;
+	sfs->sfs_jbuf = NULL;
+
+	if (!SFS_HASJOURNAL(sfs)) {
+		return 0;
+	}
+
+	/* header, and room for a transaction of at least one block */
+	if (sp->sp_jblocks < 4 ||
+	    sp->sp_jstart < SFS_MAP_LOCATION + SFS_FS_BITBLOCKS(sfs) ||
+	    sp->sp_jstart >= sp->sp_nblocks ||
+	    sp->sp_jblocks > sp->sp_nblocks - sp->sp_jstart) {
+		kprintf("sfs: Bad journal location (%u blocks at %u)\n",
+			sp->sp_jblocks, sp->sp_jstart);
+		return EINVAL;
+	}
+	loglen = SFS_JLOGLEN(sfs);
+
+	sfs->sfs_jlock = lock_create("sfs_jlock");
+	sfs->sfs_jcv = cv_create("sfs_jcv");
+	sfs->sfs_jbuf = kmalloc(SFS_BLOCKSIZE);
+	sfs->sfs_jblocks = kmalloc(loglen * sizeof(uint32_t));
+	sfs->sfs_jrevoke = kmalloc(loglen * sizeof(uint32_t));
+	sfs->sfs_jfreemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	sfs->sfs_jlogmap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	sfs->sfs_jmaplogged = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_jlock == NULL || sfs->sfs_jcv == NULL ||
+	    sfs->sfs_jbuf == NULL || sfs->sfs_jblocks == NULL ||
+	    sfs->sfs_jrevoke == NULL || sfs->sfs_jfreemap == NULL ||
+	    sfs->sfs_jlogmap == NULL || sfs->sfs_jmaplogged == NULL) {
+		sfs_junmount(sfs);
+		return ENOMEM;
+	}
+
+	result = sfs_jreplay(sfs, &sfs->sfs_jseq);
+	if (result) {
+		sfs_junmount(sfs);
+		return result;
+	}
+
+	/* The superblock may have been replayed */
+	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	if (result) {
+		sfs_junmount(sfs);
+		return result;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Whether the changes waiting for the next commit are getting too
+ * big, or blocks they free are needed. Only a hint, so no locks.
+ */
+static
+bool
+sfs_jfull(struct sfs_fs *sfs)
+{
+	uint32_t pending, nfreed;
+
+	/* Each block freed can dirty another freemap block */
+	nfreed = sfs->sfs_jnfreed;
+	if (nfreed > SFS_FS_BITBLOCKS(sfs)) {
+		nfreed = SFS_FS_BITBLOCKS(sfs);
+	}
+	pending = sfs->sfs_nmeta + sfs->sfs_nmapdirty + nfreed + 2;
+	return pending > SFS_JLOGLEN(sfs) / 4 || sfs_bmetafull(sfs) ||
+		sfs->sfs_jlowspace;
+}
+
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	if (!SFS_HASJOURNAL(sfs)) {
+		return;
+	}
+
+	if (sfs_jfull(sfs)) {
+		(void)sfs_jcommit(sfs);
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jcommitting) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jactive++;
+	lock_release(sfs->sfs_jlock);
+}
+
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	if (!SFS_HASJOURNAL(sfs)) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jactive > 0);
+	sfs->sfs_jactive--;
+	if (sfs->sfs_jactive == 0 && sfs->sfs_jcommitting) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Wait for any other commit, and then for the operations under way,
+ * and keep new ones from starting until sfs_jresume.
+ */
+static
+void
+sfs_jstop(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jcommitting) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jcommitting = true;
+	while (sfs->sfs_jactive > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+static
+void
+sfs_jresume(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jcommitting = false;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Freeing blocks
+
+void
+sfs_jfree(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(bitmap_isset(sfs->sfs_freemap, block));
+
+	if (!SFS_HASJOURNAL(sfs)) {
+		bitmap_unmark(sfs->sfs_freemap, block);
+		sfs_dirtymap(sfs, block);
+		return;
+	}
+
+	KASSERT(!bitmap_isset(sfs->sfs_jfreemap, block));
+
+	bitmap_mark(sfs->sfs_jfreemap, block);
+	sfs->sfs_jnfreed++;
+}
+
+/*
+ * Revoke BLOCK in the next commit if it has an image in the log.
+ * (Every block with an image holds a log block, so there's always
+ * room in sfs_jrevoke.)
+ */
+static
+void
+sfs_jrevoke(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (bitmap_isset(sfs->sfs_jlogmap, block)) {
+		bitmap_unmark(sfs->sfs_jlogmap, block);
+		KASSERT(sfs->sfs_jnrevoke < SFS_JLOGLEN(sfs));
+		sfs->sfs_jrevoke[sfs->sfs_jnrevoke++] = block;
+	}
+}
+
+/*
+ * Really free the blocks freed since the last commit, revoking those
+ * with images in the log. Called while committing.
+ */
+static
+void
+sfs_jfreeblocks(struct sfs_fs *sfs)
+{
+	uint8_t *bits;
+	uint32_t byte, block;
+	unsigned bit;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_jnfreed > 0) {
+		bits = bitmap_getdata(sfs->sfs_jfreemap);
+		for (byte=0; byte < SFS_FS_BITMAPSIZE(sfs) / CHAR_BIT;
+		     byte++) {
+			if (bits[byte] == 0) {
+				continue;
+			}
+			for (bit=0; bit<CHAR_BIT; bit++) {
+				block = byte * CHAR_BIT + bit;
+				if (!bitmap_isset(sfs->sfs_jfreemap, block)) {
+					continue;
+				}
+				bitmap_unmark(sfs->sfs_jfreemap, block);
+				bitmap_unmark(sfs->sfs_freemap, block);
+				sfs_dirtymap(sfs, block);
+				sfs_jrevoke(sfs, block);
+				sfs->sfs_jnfreed--;
+			}
+		}
+		KASSERT(sfs->sfs_jnfreed == 0);
+	}
+	sfs->sfs_jlowspace = false;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit and checkpoint
+
+/*
+ * Push the dirty inodes into the buffer cache. With every operation
+ * stopped, nobody is changing them, so their locks aren't needed.
+ */
+static
+void
+sfs_jpushinodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+
+	lock_acquire(sfs->sfs_vnlock);
+	while (1) {
+		spinlock_acquire(&sfs->sfs_dirtylock);
+		sv = sfs->sfs_dirtyvnodes;
+		if (sv != NULL) {
+			sfs_undirty(sv);
+		}
+		spinlock_release(&sfs->sfs_dirtylock);
+		if (sv == NULL) {
+			break;
+		}
+		sfs_sync_inode(sv);
+	}
+	lock_release(sfs->sfs_vnlock);
+}
+
+/*
+ * Write back everything: the dirty buffers, logged or not, the
+ * freemap, and the superblock. Then start the log over. With nothing
+ * left uncommitted, this is a checkpoint; otherwise it writes the
+ * uncommitted changes home without the journal, which is only done
+ * with a transaction too big for the log.
+ */
+static
+int
+sfs_jwriteall(struct sfs_fs *sfs)
+{
+	uint32_t j;
+	int result;
+
+	result = sfs_bcheckpoint(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* The freemap blocks to write are the logged ones and the dirty */
+	lock_acquire(sfs->sfs_freemaplock);
+	for (j=0; j<SFS_FS_BITBLOCKS(sfs); j++) {
+		if (bitmap_isset(sfs->sfs_jmaplogged, j)) {
+			bitmap_unmark(sfs->sfs_jmaplogged, j);
+			sfs_dirtymap(sfs, j * SFS_BLOCKBITS);
+		}
+	}
+	result = sfs_mapsync(sfs);
+	lock_release(sfs->sfs_freemaplock);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_superlock);
+	if (sfs->sfs_superdirty || sfs->sfs_jsuperlogged) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_superlock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+		sfs->sfs_jsuperlogged = false;
+	}
+	lock_release(sfs->sfs_superlock);
+
+	/* Nothing in the log is needed any more */
+	result = sfs_jwriteheader(sfs, sfs->sfs_jseq);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jhead = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	bzero(bitmap_getdata(sfs->sfs_jlogmap),
+	      SFS_FS_BITMAPSIZE(sfs) / CHAR_BIT);
+	sfs->sfs_jnrevoke = 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	return 0;
+}
+
+/*
+ * Where image I of a transaction comes from. sfs_jblocks lists the
+ * homes of the first NMETA + NMAP: NMETA from buffers, then NMAP
+ * freemap blocks. After them comes the superblock. Hands back the
+ * contents; for a buffer, it's held, to be let go of with
+ * sfs_brelse.
+ */
+static
+int
+sfs_jimage(struct sfs_fs *sfs, uint32_t i, uint32_t nmeta, uint32_t nmap,
+	   void **data, struct sfs_buf **bufret)
+{
+	int result;
+
+	*bufret = NULL;
+	if (i < nmeta) {
+		result = sfs_bread(sfs, sfs->sfs_jblocks[i], bufret);
+		if (result) {
+			return result;
+		}
+		*data = (*bufret)->b_data;
+	}
+	else if (i < nmeta + nmap) {
+		*data = (char *)bitmap_getdata(sfs->sfs_freemap) +
+			(sfs->sfs_jblocks[i] - SFS_MAP_LOCATION) *
+			SFS_BLOCKSIZE;
+	}
+	else {
+		*data = &sfs->sfs_super;
+	}
+	return 0;
+}
+
+/*
+ * Commit, with every operation stopped.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs)
+{
+	struct sfs_jdesc *jd = sfs->sfs_jbuf;
+	struct sfs_jcommit *jc = sfs->sfs_jbuf;
+	struct sfs_buf *b;
+	uint32_t loglen = SFS_JLOGLEN(sfs);
+	uint32_t nmeta, nmap, nsuper, nimages, nrevoke, ndesc, len;
+	uint32_t i, j, r, v, nb, nv, pos, sum;
+	void *data;
+	int result;
+
+	sfs_jpushinodes(sfs);
+
+	/* File data first, so metadata never points at unwritten blocks */
+	result = sfs_bflush(sfs);
+	if (result) {
+		return result;
+	}
+
+	sfs_jfreeblocks(sfs);
+
+	/* What goes in this transaction: the buffers, freemap blocks, */
+	nmeta = sfs_bmetalist(sfs, sfs->sfs_jblocks, loglen);
+	nmap = sfs->sfs_nmapdirty;
+	if (nmeta + nmap <= loglen) {
+		i = nmeta;
+		for (j=0; j<SFS_FS_BITBLOCKS(sfs); j++) {
+			if (bitmap_isset(sfs->sfs_mapdirty, j)) {
+				sfs->sfs_jblocks[i++] = SFS_MAP_LOCATION + j;
+			}
+		}
+		KASSERT(i == nmeta + nmap);
+	}
+	/* and the superblock */
+	nsuper = sfs->sfs_superdirty ? 1 : 0;
+	nimages = nmeta + nmap + nsuper;
+	nrevoke = sfs->sfs_jnrevoke;
+	if (nimages == 0 && nrevoke == 0) {
+		return 0;
+	}
+	ndesc = DIVROUNDUP(nimages + nrevoke, SFS_JDESCMAX);
+	len = ndesc + nimages + 1;
+
+	if (nmeta + nmap > loglen || len > loglen - sfs->sfs_jhead) {
+		/* Too big for the log. Write it in place. */
+		return sfs_jwriteall(sfs);
+	}
+
+	/*
+	 * Write the descriptors and images, from the head of the log.
+	 * The freemap and superblock can be read without their locks;
+	 * only operations change them.
+	 */
+	pos = sfs->sfs_jhead;
+	sum = SFS_JSUM_INIT;
+	r = v = 0;
+	while (r < nimages || v < nrevoke) {
+		nb = nimages - r;
+		if (nb > SFS_JDESCMAX) {
+			nb = SFS_JDESCMAX;
+		}
+		nv = nrevoke - v;
+		if (nv > SFS_JDESCMAX - nb) {
+			nv = SFS_JDESCMAX - nb;
+		}
+
+		/* Fill in the descriptor (homes go in as we get them) */
+		bzero(jd, SFS_BLOCKSIZE);
+		jd->jd_magic = SFS_JDMAGIC;
+		jd->jd_seq = sfs->sfs_jseq;
+		jd->jd_nblocks = nb;
+		jd->jd_nrevoke = nv;
+		for (i=0; i<nb; i++) {
+			if (r + i < nmeta + nmap) {
+				jd->jd_blocks[i] = sfs->sfs_jblocks[r + i];
+			}
+			else {
+				jd->jd_blocks[i] = SFS_SB_LOCATION;
+			}
+		}
+		for (i=0; i<nv; i++) {
+			jd->jd_blocks[nb + i] = sfs->sfs_jrevoke[v + i];
+		}
+		sum = sfs_jsum(sum, jd);
+		result = sfs_wblock(sfs, jd, SFS_JLOGBLOCK(sfs, pos));
+		if (result) {
+			return result;
+		}
+		pos++;
+
+		for (i=0; i<nb; i++) {
+			result = sfs_jimage(sfs, r + i, nmeta, nmap,
+					    &data, &b);
+			if (result) {
+				return result;
+			}
+			sum = sfs_jsum(sum, data);
+			result = sfs_wblock(sfs, data, SFS_JLOGBLOCK(sfs, pos));
+			if (b != NULL) {
+				sfs_brelse(b);
+			}
+			if (result) {
+				return result;
+			}
+			pos++;
+		}
+		r += nb;
+		v += nv;
+	}
+
+	/* The commit block; once it's on disk, the transaction counts */
+	bzero(jc, SFS_BLOCKSIZE);
+	jc->jc_magic = SFS_JCMAGIC;
+	jc->jc_seq = sfs->sfs_jseq;
+	jc->jc_sum = sum;
+	result = sfs_wblock(sfs, jc, SFS_JLOGBLOCK(sfs, pos));
+	if (result) {
+		return result;
+	}
+	pos++;
+	KASSERT(pos - sfs->sfs_jhead == len);
+
+	sfs->sfs_jhead = pos;
+	sfs->sfs_jseq++;
+
+	/* Everything logged can go home whenever it likes now */
+	sfs_bcommitted(sfs);
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<nmeta; i++) {
+		if (!bitmap_isset(sfs->sfs_jlogmap, sfs->sfs_jblocks[i])) {
+			bitmap_mark(sfs->sfs_jlogmap, sfs->sfs_jblocks[i]);
+		}
+	}
+	for (i=nmeta; i<nmeta + nmap; i++) {
+		j = sfs->sfs_jblocks[i] - SFS_MAP_LOCATION;
+		bitmap_unmark(sfs->sfs_mapdirty, j);
+		if (!bitmap_isset(sfs->sfs_jmaplogged, j)) {
+			bitmap_mark(sfs->sfs_jmaplogged, j);
+		}
+	}
+	sfs->sfs_nmapdirty -= nmap;
+	sfs->sfs_jnrevoke = 0;
+	lock_release(sfs->sfs_freemaplock);
+	if (nsuper > 0) {
+		lock_acquire(sfs->sfs_superlock);
+		sfs->sfs_superdirty = false;
+		sfs->sfs_jsuperlogged = true;
+		lock_release(sfs->sfs_superlock);
+	}
+
+	/* Keep half the log free for the next transaction */
+	if (sfs->sfs_jhead > loglen / 2) {
+		return sfs_jwriteall(sfs);
+	}
+	return 0;
+}
+
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!SFS_HASJOURNAL(sfs)) {
+		return 0;
+	}
+
+	sfs_jstop(sfs);
+	result = sfs_jdocommit(sfs);
+	sfs_jresume(sfs);
+	return result;
+}
+
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!SFS_HASJOURNAL(sfs)) {
+		return 0;
+	}
+
+	sfs_jstop(sfs);
+	result = sfs_jdocommit(sfs);
+	if (result == 0) {
+		result = sfs_jwriteall(sfs);
+	}
+	sfs_jresume(sfs);
+	return result;
+}
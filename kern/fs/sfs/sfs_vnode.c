@@ -41,39 +41,150 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
 
+/* Free blocks sfs_balloc sets aside for a file to grow into (32K) */
+#define SFS_EXTENT	8
+
+/* Most blocks sfs_io moves in one device transfer (128K) */
+#define SFS_MAXRUN	32
+
+/* How far to read ahead of a sequential reader (64K), and queue length */
+#define SFS_RABLOCKS	16
+#define SFS_RAQSIZE	32
+
+/* Most slots a flat directory grows to before it's made hashed */
+#define SFS_DIRFLATMAX	(SFS_DIRHASH_MIN/2)
+
+/* Levels of indirect blocks: single, double, and triple */
+#define SFS_NINDIRECT	3
+
+/* Largest file: as far as the indirect blocks reach, in 32 bits */
+#define SFS_MAXBLOCKS	((uint64_t)SFS_NDIRECT + SFS_DBPERIDB + \
+			 (uint64_t)SFS_DBPERIDB * SFS_DBPERIDB + \
+			 (uint64_t)SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+#define SFS_MAXFILESIZE	(SFS_MAXBLOCKS * SFS_BLOCKSIZE < 0xffffffffULL ? \
+			 SFS_MAXBLOCKS * SFS_BLOCKSIZE : 0xffffffffULL)
+
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
+/* Chain in the loaded vnode table for inode INO */
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino & (SFS_VNHASHSIZE - 1);
+}
+
 /* Zero out a disk block. */
 static
-int
+void
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *b;
+
+	sfs_bget(sfs, block, &b);
+	bzero(b->b_data, SFS_BLOCKSIZE);
+	sfs_bdirty(b);
+	sfs_brelse(b);
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Note that a buffer holding part of SV has changed. A directory's
+ * blocks are metadata, which the journal has to log.
+ */
 static
+void
+sfs_bdirtyfile(struct sfs_vnode *sv, struct sfs_buf *b)
+{
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_bdirtymeta(b);
+	}
+	else {
+		sfs_bdirty(b);
+	}
+}
+
+/*
+ * Note that a vnode's inode has changed, and put it on the volume's
+ * dirty list for sfs_sync to find. Called with sv_lock held (or on
+ * a vnode nobody else can see yet).
+ */
+static
+void
+sfs_dirty(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	sv->sv_dirty = true;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (!sv->sv_ondirtylist) {
+		sv->sv_dirtyprev = NULL;
+		sv->sv_dirtynext = sfs->sfs_dirtyvnodes;
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv;
+		}
+		sfs->sfs_dirtyvnodes = sv;
+		sfs->sfs_ndirty++;
+		sv->sv_ondirtylist = true;
+	}
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+void
+sfs_undirty(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(spinlock_do_i_hold(&sfs->sfs_dirtylock));
+	KASSERT(sv->sv_ondirtylist);
+
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		sfs->sfs_dirtyvnodes = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+	sfs->sfs_ndirty--;
+	sv->sv_ondirtylist = false;
+}
+
+/*
+ * Write an on-disk inode structure back out. It goes to the buffer
+ * cache, and on to the disk at the next sync. (A journal commit
+ * does this without the vnode's lock; nothing else is running.)
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *b;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock) || sfs->sfs_jcommitting);
+
 	if (sv->sv_dirty) {
-		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
-		if (result) {
-			return result;
-		}
+		/* the inode is the whole block */
+		sfs_bget(sfs, sv->sv_ino, &b);
+		memcpy(b->b_data, &sv->sv_i, sizeof(sv->sv_i));
+		sfs_bdirtymeta(b);
+		sfs_brelse(b);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -83,27 +194,94 @@ sfs_sync_inode(struct sfs_vnode *sv)
 //
 // Space allocation
 
+/*
+ * Look for LEN free blocks in a row from the allocation cursor,
+ * reading in more of the freemap until there's such a run or it's
+ * all in. (Parts not read in look full.)
+ */
+static
+int
+sfs_findrun(struct sfs_fs *sfs, unsigned len, unsigned *block)
+{
+	int result;
+
+	while (1) {
+		result = bitmap_findrun(sfs->sfs_freemap,
+					sfs->sfs_alloccursor, len, block);
+		if (result != ENOSPC) {
+			return result;
+		}
+		/* ENOSPC once there's no more to read */
+		result = sfs_maploadnext(sfs, sfs->sfs_alloccursor);
+		if (result) {
+			return result;
+		}
+	}
+}
+
 /*
  * Allocate a block.
+ *
+ * HINT is where the caller would like it (the block after the one
+ * before it in the file), or 0 for no preference. If that's taken,
+ * look onward from the allocation cursor for SFS_EXTENT free blocks
+ * in a row, take the first, and move the cursor past the rest; they
+ * aren't marked, but other files won't be given them until the
+ * cursor comes around again, so the file can grow into them. If
+ * there's no such run, take any free block after the cursor.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t hint, uint32_t *diskblock)
 {
+	struct bitmap *map = sfs->sfs_freemap;
+	unsigned block;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
-	if (result) {
-		return result;
+	lock_acquire(sfs->sfs_freemaplock);
+	if (hint != 0 && hint < sfs->sfs_super.sp_nblocks &&
+	    sfs_mapload(sfs, hint) == 0 && !bitmap_isset(map, hint)) {
+		block = hint;
+	}
+	else {
+		result = sfs_findrun(sfs, SFS_EXTENT, &block);
+		if (result == 0) {
+			sfs->sfs_alloccursor = block + SFS_EXTENT;
+		}
+		else if (result == ENOSPC) {
+			result = sfs_findrun(sfs, 1, &block);
+			if (result == 0) {
+				sfs->sfs_alloccursor = block + 1;
+			}
+			else if (result == ENOSPC &&
+				 sfs->sfs_jnfreed > 0) {
+				/*
+				 * There are blocks freed since the last
+				 * commit, but they can't be used until
+				 * it's committed; have the next operation
+				 * do that first.
+				 */
+				sfs->sfs_jlowspace = true;
+			}
+		}
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 	}
-	sfs->sfs_freemapdirty = true;
+	bitmap_mark(map, block);
+	sfs_dirtymap(sfs, block);
+	lock_release(sfs->sfs_freemaplock);
+
+	*diskblock = block;
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
 	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	sfs_clearblock(sfs, *diskblock);
+	return 0;
 }
 
 /*
@@ -113,8 +291,27 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	int result;
+
+	/*
+	 * Drop any cached copy first, so it can't be written over
+	 * whatever the block gets reused for. Once the bit is clear
+	 * someone may already be reusing it. (With a journal, the bit
+	 * is cleared at the next commit.)
+	 */
+	sfs_binval(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_mapload(sfs, diskblock);
+	if (result) {
+		/* sfsck will find it */
+		kprintf("sfs: Cannot read the freemap to free block %u: "
+			"%s\n", diskblock, strerror(result));
+	}
+	else {
+		sfs_jfree(sfs, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,17 +321,45 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs_mapload(sfs, diskblock)) {
+		/* Can't tell; don't complain about it */
+		ret = 1;
+	}
+	else {
+		ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * The inode's pointer to its indirect block with LEVELS levels: the
+ * single, double, or triple indirect block.
+ */
+static
+uint32_t *
+sfs_indirectptr(struct sfs_vnode *sv, unsigned levels)
+{
+	switch (levels) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: No indirect block with %u levels\n", levels);
+	return NULL;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +371,18 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;
+	uint32_t *idbuf, *idptr;
 	uint32_t block;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idoff;
+	uint32_t hint;
+	uint64_t rest, span;
+	unsigned levels;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -173,17 +394,26 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		block = sv->sv_i.sfi_direct[fileblock];
 
 		/*
-		 * Do we need to allocate?
+		 * Do we need to allocate? If so, try to put it right
+		 * after the block before it, or for the first block,
+		 * right after the inode.
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			if (fileblock == 0) {
+				hint = sv->sv_ino + 1;
+			}
+			else {
+				hint = sv->sv_i.sfi_direct[fileblock-1];
+				hint = hint ? hint + 1 : 0;
+			}
+			result = sfs_balloc(sfs, hint, &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty(sv);
 		}
 
 		/*
@@ -198,27 +428,29 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block, so it's under one of the indirect
+	 * blocks: the (single) indirect block maps the next
+	 * SFS_DBPERIDB blocks of the file, the double indirect block
+	 * the SFS_DBPERIDB^2 after those, and the triple indirect block
+	 * the SFS_DBPERIDB^3 after those. Subtract off the blocks
+	 * before each one we pass, so REST ends up as the offset
+	 * into the space of the one we want, which maps SPAN blocks
+	 * with LEVELS levels of indirect blocks.
 	 */
-	if (idnum > 0) {
-		return EFBIG;
+	rest = fileblock - SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	for (levels = 1; rest >= span; levels++) {
+		if (levels == SFS_NINDIRECT) {
+			/* Past the end of the triple indirect block */
+			return EFBIG;
+		}
+		rest -= span;
+		span *= SFS_DBPERIDB;
 	}
+	idptr = sfs_indirectptr(sv, levels);
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	idblock = *idptr;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -229,55 +461,78 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * allocate a block whose number needs to be stored
+		 * under it. Thus, we need to allocate an indirect
+		 * block. (sfs_balloc clears it.) Put it in line after
+		 * the last direct block, and the blocks it points to
+		 * will follow it.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		hint = sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+		result = sfs_balloc(sfs, hint ? hint + 1 : 0, &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idptr = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirty(sv);
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Go down through the indirect blocks. At each level, each
+	 * entry covers SPAN/SFS_DBPERIDB blocks of the file; at the
+	 * bottom, each is one data block.
+	 */
+	while (1) {
+		span /= SFS_DBPERIDB;
+		idoff = rest / span;
+		rest %= span;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Get the indirect block from the buffer cache. */
+		result = sfs_bread(sfs, idblock, &idb);
 		if (result) {
 			return result;
 		}
+		idbuf = idb->b_data;
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the block out of the indirect block buffer */
+		block = idbuf[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		/*
+		 * If there's no block there, allocate one (data or
+		 * indirect), after the one before it or, for the
+		 * first, right after this indirect block.
+		 */
+		if (block==0 && doalloc) {
+			if (idoff == 0) {
+				hint = idblock + 1;
+			}
+			else {
+				hint = idbuf[idoff-1];
+				hint = hint ? hint + 1 : 0;
+			}
+			result = sfs_balloc(sfs, hint, &block);
+			if (result) {
+				sfs_brelse(idb);
+				return result;
+			}
+
+			/* Remember it; the indirect block is dirty */
+			idbuf[idoff] = block;
+			sfs_bdirtymeta(idb);
+		}
+		sfs_brelse(idb);
+
+		if (span == 1 || block == 0) {
+			break;
 		}
+		idblock = block;
 	}
 
 	/* Hand back the result and return. */
@@ -308,16 +563,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +586,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block, and perform the requested operation into/out
+	 * of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &b);
 	if (result) {
 		return result;
 	}
+	result = uiomove((char *)b->b_data + skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer is now dirty. (Even if the
+	 * uiomove failed partway, part of it may have changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_bdirtyfile(sv, b);
 	}
+	sfs_brelse(b);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +622,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -412,34 +648,299 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &b);
+		if (result) {
+			return result;
+		}
+		result = uiomove(b->b_data, SFS_BLOCKSIZE, uio);
+		sfs_brelse(b);
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Writing the whole block, so there's no need to read it
+	 * first. If the copy fails partway into a buffer that didn't
+	 * hold the block, leave it invalid so the old contents are
+	 * read back from disk next time; if it did hold the block,
+	 * some of it may have changed, as for sfs_partialio.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
+	sfs_bget(sfs, diskblock, &b);
+	result = uiomove(b->b_data, SFS_BLOCKSIZE, uio);
+	if (result == 0 || b->b_valid) {
+		sfs_bdirtyfile(sv, b);
+	}
+	sfs_brelse(b);
+	return result;
+}
+
+/*
+ * Do I/O to a run of whole blocks of a file, starting at the uio's
+ * offset and at most NBLOCKS long. If the blocks are next to each
+ * other on disk (up to SFS_MAXRUN of them), move them straight
+ * between the disk and the uio in one device transfer; otherwise
+ * (or for a hole) do the first block through the cache with
+ * sfs_blockio. Either way, the uio advances by however much was
+ * done, and the caller loops.
+ *
+ * The cache mustn't disagree with the disk about these blocks. A
+ * read run stops at the first block that's in the cache (read
+ * ahead, or dirty), which is read from there instead. For a write,
+ * the run's buffers are held while the disk is written (so nobody
+ * flushes them over the new data) and then forgotten. If the write
+ * stops partway, the buffers past that point are kept, so blocks
+ * just allocated still read as zeros.
+ *
+ * Nobody else touches the file's blocks meanwhile, because we hold
+ * sv_lock (as the read-ahead thread does too).
+ */
+static
+int
+sfs_runio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *bufs[SFS_MAXRUN];
+	uint32_t fileblock, diskblock, next;
+	uint32_t run, i, done;
+	off_t fileoffset;
+	size_t resid;
+	int result;
+	int doalloc = (uio->uio_rw==UIO_WRITE);
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	KASSERT(nblocks > 0);
+
+	if (nblocks > SFS_MAXRUN) {
+		nblocks = SFS_MAXRUN;
+	}
+
+	/* Find out how far the blocks continue on from the first one */
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	if (result) {
+		return result;
+	}
+	run = 1;
+	if (diskblock != 0 &&
+	    (doalloc || !sfs_bincore(sfs, diskblock))) {
+		for (; run < nblocks; run++) {
+			result = sfs_bmap(sv, fileblock + run, doalloc, &next);
+			if (result) {
+				return result;
+			}
+			if (next != diskblock + run) {
+				break;
+			}
+			if (!doalloc && sfs_bincore(sfs, next)) {
+				break;
+			}
+		}
+	}
+
+	if (run == 1) {
+		return sfs_blockio(sv, uio);
+	}
+
+	/* For a write, get the cache out of the way */
+	if (uio->uio_rw == UIO_WRITE) {
+		for (i=0; i<run; i++) {
+			bufs[i] = sfs_bpeek(sfs, diskblock + i);
+		}
+	}
+
+	/* Point the uio at the disk, do the transfer, and point it back */
+	fileoffset = uio->uio_offset;
+	resid = uio->uio_resid;
+	uio->uio_offset = (off_t)diskblock * SFS_BLOCKSIZE;
+	uio->uio_resid = run * SFS_BLOCKSIZE;
+
 	result = sfs_rwblock(sfs, uio);
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	done = run * SFS_BLOCKSIZE - uio->uio_resid;
+	uio->uio_offset = fileoffset + done;
+	uio->uio_resid = resid - done;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		for (i=0; i<run; i++) {
+			if (bufs[i] == NULL) {
+				continue;
+			}
+			if (i < done / SFS_BLOCKSIZE) {
+				sfs_bforget(bufs[i]);
+			}
+			else {
+				sfs_brelse(bufs[i]);
+			}
+		}
+	}
 
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+//
+// Sequential access is noticed per vnode, not per open file: VOP_READ
+// isn't told which open file it's for. A read that starts where the
+// last one left off (or in the block it ended in) counts as
+// sequential; after two in a row, each read queues the next
+// SFS_RABLOCKS blocks past what's already been asked for. A request
+// holds a reference to the vnode; the read-ahead thread locks it,
+// maps the blocks, and reads the ones that aren't cached. If the
+// queue is full the request is dropped: read-ahead is only a hint.
+
+struct sfs_rareq {
+	struct sfs_vnode *rq_sv;
+	uint32_t rq_block;		/* first file block */
+	uint32_t rq_nblocks;
+};
+
+static struct lock *sfs_ralock;		/* protects the queue */
+static struct cv *sfs_racv;
+static struct sfs_rareq sfs_raq[SFS_RAQSIZE];
+static unsigned sfs_raqhead, sfs_raqcount;
+
+static
+void
+sfs_rathread(void *data1, unsigned long data2)
+{
+	struct sfs_rareq rq;
+	struct sfs_vnode *sv;
+	struct sfs_fs *sfs;
+	uint32_t i, fileblocks, diskblock;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_ralock);
+		while (sfs_raqcount == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+		rq = sfs_raq[sfs_raqhead];
+		sfs_raqhead = (sfs_raqhead + 1) % SFS_RAQSIZE;
+		sfs_raqcount--;
+		lock_release(sfs_ralock);
+
+		sv = rq.rq_sv;
+		sfs = sv->sv_v.vn_fs->fs_data;
+
+		lock_acquire(sv->sv_lock);
+		fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+		for (i=0; i<rq.rq_nblocks; i++) {
+			if (rq.rq_block + i >= fileblocks) {
+				break;
+			}
+			result = sfs_bmap(sv, rq.rq_block + i, 0, &diskblock);
+			if (result) {
+				break;
+			}
+			if (diskblock == 0) {
+				continue;
+			}
+			result = sfs_bprefetch(sfs, diskblock);
+			if (result) {
+				break;
+			}
+		}
+		lock_release(sv->sv_lock);
+
+		VOP_DECREF(&sv->sv_v);
+	}
+}
+
+int
+sfs_rabootstrap(void)
+{
+	int result;
+
+	if (sfs_ralock != NULL) {
+		/* already done by an earlier mount */
+		return 0;
+	}
+
+	sfs_racv = cv_create("sfs_ra");
+	if (sfs_racv == NULL) {
+		return ENOMEM;
+	}
+	sfs_ralock = lock_create("sfs_ralock");
+	if (sfs_ralock == NULL) {
+		cv_destroy(sfs_racv);
+		return ENOMEM;
+	}
+	sfs_raqhead = sfs_raqcount = 0;
+
+	result = thread_fork("sfs_readahead", NULL, sfs_rathread, NULL, 0);
+	if (result) {
+		lock_destroy(sfs_ralock);
+		sfs_ralock = NULL;
+		cv_destroy(sfs_racv);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Note a read of SV from file offset START up to END, and queue
+ * read-ahead if it's part of a sequential scan.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	uint32_t startblock, endblock, fileblocks;
+	unsigned slot;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (end <= start) {
+		return;
+	}
+	startblock = start / SFS_BLOCKSIZE;
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+
+	if (startblock == sv->sv_nextblock ||
+	    startblock + 1 == sv->sv_nextblock) {
+		sv->sv_seqcount++;
+	}
+	else {
+		sv->sv_seqcount = 0;
+		sv->sv_rablock = 0;
+	}
+	sv->sv_nextblock = end / SFS_BLOCKSIZE;
+
+	if (sv->sv_seqcount < 2) {
+		return;
+	}
+	if (sv->sv_rablock < endblock) {
+		sv->sv_rablock = endblock;
+	}
+	if (sv->sv_rablock >= endblock + SFS_RABLOCKS) {
+		/* already far enough ahead */
+		return;
+	}
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (sv->sv_rablock >= fileblocks) {
+		return;
+	}
+
+	lock_acquire(sfs_ralock);
+	if (sfs_raqcount < SFS_RAQSIZE) {
+		slot = (sfs_raqhead + sfs_raqcount) % SFS_RAQSIZE;
+		VOP_INCREF(&sv->sv_v);
+		sfs_raq[slot].rq_sv = sv;
+		sfs_raq[slot].rq_block = sv->sv_rablock;
+		sfs_raq[slot].rq_nblocks =
+			endblock + SFS_RABLOCKS - sv->sv_rablock;
+		sfs_raqcount++;
+		sv->sv_rablock = endblock + SFS_RABLOCKS;
+		cv_signal(sfs_racv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -448,10 +949,12 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -502,12 +1005,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole
+	 * blocks, as many at a time as lie together on disk.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while ((nblocks = uio->uio_resid / SFS_BLOCKSIZE) > 0) {
+		result = sfs_runio(sv, uio, nblocks);
 		if (result) {
 			goto out;
 		}
@@ -531,7 +1034,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -636,6 +1139,70 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+/*
+ * Hash a name, for a hashed directory. See <kern/sfs.h>.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	while (*name) {
+		h = SFS_DIRHASH_STEP(h, *name++);
+	}
+	return h;
+}
+
+/*
+ * Search a hashed directory for a name: probe from the name's home
+ * slot up to the first free one, which is handed back as the empty
+ * slot (it's where the name goes if it isn't there). If the table is
+ * completely full, there's no empty slot to report.
+ */
+static
+int
+sfs_dir_hfindname(struct sfs_vnode *sv, const char *name,
+		  uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dir tsd;
+	uint32_t mask = sv->sv_i.sfi_dirslots - 1;
+	uint32_t i, n;
+	int result;
+
+	if ((mask & (mask+1)) != 0 ||
+	    sv->sv_i.sfi_size != (mask+1) * sizeof(struct sfs_dir)) {
+		panic("sfs: directory %u: Invalid hash table size %u\n",
+		      sv->sv_ino, mask+1);
+	}
+
+	i = sfs_dirhash(name) & mask;
+	for (n=0; n<=mask; n++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			if (emptyslot != NULL) {
+				*emptyslot = i;
+			}
+			return ENOENT;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = i;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+		i = (i+1) & mask;
+	}
+	return ENOENT;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -649,9 +1216,14 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 {
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
+	int nentries;
 	int i, result;
 
+	if (sv->sv_i.sfi_dirslots != 0) {
+		return sfs_dir_hfindname(sv, name, ino, slot, emptyslot);
+	}
+	nentries = sfs_dir_nentries(sv);
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -666,40 +1238,184 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				*emptyslot = i;
 			}
 		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+		else {
+			/* Ensure null termination, just in case */
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (!strcmp(tsd.sfd_name, name)) {
+
+				/* Each name may legally appear only once... */
+				KASSERT(found==0);
+
+				found = 1;
+				if (slot != NULL) {
+					*slot = i;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+			}
+		}
+	}
+
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Rebuild a directory as a hash table of NEWSLOTS slots.
+ *
+ * The new table is built past the end of the directory, so that if
+ * there isn't space for it the old one is still intact, and then
+ * copied down over the old one. (That's why the old directory mustn't
+ * be sparse: copying into a hole would need a block.) Entries change
+ * slots, so slot numbers from before this are no good afterwards.
+ */
+static
+int
+sfs_dir_rehash(struct sfs_vnode *sv, uint32_t newslots)
+{
+	struct sfs_dir sd, tsd;
+	off_t oldsize = sv->sv_i.sfi_size;
+	uint32_t oldslots = sfs_dir_nentries(sv);
+	uint32_t mask = newslots - 1;
+	uint32_t i, j, used;
+	int result;
+
+	KASSERT((newslots & mask) == 0);
+	KASSERT(oldslots < newslots);
+
+	/* Clear the space for the new table, allocating it. */
+	bzero(&sd, sizeof(sd));
+	for (i=0; i<newslots; i++) {
+		result = sfs_writedir(sv, &sd, oldslots + i);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* Put each entry in its place in the new table. */
+	used = 0;
+	for (i=0; i<oldslots; i++) {
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			goto fail;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+
+		/* There's room: it's less than half full. */
+		j = sfs_dirhash(sd.sfd_name) & mask;
+		while (1) {
+			result = sfs_readdir(sv, &tsd, oldslots + j);
+			if (result) {
+				goto fail;
+			}
+			if (tsd.sfd_ino == SFS_NOINO) {
+				break;
+			}
+			j = (j+1) & mask;
+		}
+		result = sfs_writedir(sv, &sd, oldslots + j);
+		if (result) {
+			goto fail;
+		}
+		used++;
+	}
+
+	/*
+	 * Copy it down. Every block involved is allocated by now, so
+	 * only an I/O error can stop this, and there's no going back.
+	 */
+	for (i=0; i<newslots; i++) {
+		result = sfs_readdir(sv, &sd, oldslots + i);
+		if (result == 0) {
+			result = sfs_writedir(sv, &sd, i);
+		}
+		if (result) {
+			panic("sfs: directory %u: Rehash failed: %s\n",
+			      sv->sv_ino, strerror(result));
+		}
+	}
 
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+	sv->sv_i.sfi_dirslots = newslots;
+	sv->sv_i.sfi_dirused = used;
+	sfs_dirty(sv);
 
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
-			}
+	/* Let go of the space the new table was built in. */
+	return sfs_itrunc(sv, newslots * sizeof(struct sfs_dir));
+
+ fail:
+	/* Give back whatever we got; the old table is untouched. */
+	sfs_itrunc(sv, oldsize);
+	return result;
+}
+
+/*
+ * Make sure a directory has room for one more entry at a reasonable
+ * cost: make a flat directory that's grown to SFS_DIRFLATMAX slots
+ * hashed, and double a hashed one before it gets more than 3/4 full.
+ * If there isn't space to do that, carry on with the directory as it
+ * is; it's slower, but still works until it's actually full.
+ */
+static
+int
+sfs_dir_makeroom(struct sfs_vnode *sv)
+{
+	uint32_t oldslots, newslots;
+	int result;
+
+	oldslots = sfs_dir_nentries(sv);
+	if (sv->sv_i.sfi_dirslots == 0) {
+		if (oldslots < SFS_DIRFLATMAX) {
+			return 0;
+		}
+		newslots = SFS_DIRHASH_MIN;
+		while (newslots < 2*oldslots) {
+			newslots *= 2;
+		}
+	}
+	else {
+		if ((sv->sv_i.sfi_dirused + 1) * 4 <= oldslots * 3) {
+			return 0;
 		}
+		newslots = 2*oldslots;
 	}
 
-	return found ? 0 : ENOENT;
+	/* The new table is built past the old one, so both must fit. */
+	if ((uint64_t)(oldslots + newslots) * sizeof(struct sfs_dir) >
+	    SFS_MAXFILESIZE) {
+		return 0;
+	}
+
+	result = sfs_dir_rehash(sv, newslots);
+	if (result == ENOSPC) {
+		return 0;
+	}
+	return result;
 }
 
 /*
  * Create a link in a directory to the specified inode by number, with
- * the specified name, and optionally hand back the slot.
+ * the specified name, and optionally hand back the slot. Whatever the
+ * name cache let go of comes back in OLD, for the caller to drop with
+ * dcache_putrefs once it's unlocked everything and called sfs_jend.
  */
 static
 int
-sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
+sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot,
+	     struct dcache_refs *old)
 {
 	int emptyslot = -1;
 	int result;
 	struct sfs_dir sd;
 
+	/* Grow (or index) the directory first, if it's due. */
+	result = sfs_dir_makeroom(sv);
+	if (result) {
+		return result;
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -713,8 +1429,14 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot, add the entry at the end,
+	 * unless the directory is hashed, in which case it's full.
+	 */
 	if (emptyslot < 0) {
+		if (sv->sv_i.sfi_dirslots != 0) {
+			return ENOSPC;
+		}
 		emptyslot = sfs_dir_nentries(sv);
 	}
 
@@ -728,21 +1450,99 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
+	/* The name exists now; forget that it didn't. */
+	dcache_remove(&sv->sv_v, name, old);
+
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_i.sfi_dirslots != 0) {
+		sv->sv_i.sfi_dirused++;
+		sfs_dirty(sv);
+	}
+	return 0;
+}
+
+/*
+ * Unlink the name in slot SLOT of a hashed directory. Rather than
+ * leave a free slot in the middle of some other name's probe
+ * sequence, move later entries of the run back into it where they're
+ * allowed to go (where it doesn't come before their home slot), and
+ * free the last slot moved from instead.
+ */
+static
+int
+sfs_dir_hunlink(struct sfs_vnode *sv, int slot)
+{
+	struct sfs_dir sd;
+	uint32_t mask = sv->sv_i.sfi_dirslots - 1;
+	uint32_t hole = slot, i = slot, home;
+	int result;
+
+	while (1) {
+		i = (i+1) & mask;
+		if (i == (uint32_t)slot) {
+			break;
+		}
+		result = sfs_readdir(sv, &sd, i);
+		if (result) {
+			return result;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			break;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		home = sfs_dirhash(sd.sfd_name) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			result = sfs_writedir(sv, &sd, hole);
+			if (result) {
+				return result;
+			}
+			hole = i;
+		}
+	}
+
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = SFS_NOINO;
+	result = sfs_writedir(sv, &sd, hole);
+	if (result) {
+		return result;
+	}
+
+	KASSERT(sv->sv_i.sfi_dirused > 0);
+	sv->sv_i.sfi_dirused--;
+	sfs_dirty(sv);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. As with sfs_dir_link,
+ * the caller drops what comes back in OLD.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, int slot, struct dcache_refs *old)
 {
 	struct sfs_dir sd;
+	int result;
+
+	/* Drop the name from the lookup cache... */
+	result = sfs_readdir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+	sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+	dcache_remove(&sv->sv_v, sd.sfd_name, old);
+
+	/* ... a hashed directory has its own way of freeing the slot... */
+	if (sv->sv_i.sfi_dirslots != 0) {
+		return sfs_dir_hunlink(sv, slot);
+	}
 
-	/* Initialize a suitable directory entry... */ 
+	/* ... otherwise, initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
@@ -774,10 +1574,20 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	/*
+	 * Check the link count, under the vnode's lock; but if NAME
+	 * was "." (or ".." in the root) it's SV, whose lock we hold.
+	 */
+	if (*ret == sv) {
+		KASSERT(sv->sv_i.sfi_linkcount > 0);
+		return 0;
+	}
+	lock_acquire((*ret)->sv_lock);
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: Link count of file %u found in dir %u is 0\n",
 		      (*ret)->sv_ino, sv->sv_ino);
 	}
+	lock_release((*ret)->sv_lock);
 
 	return 0;
 }
@@ -801,7 +1611,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -870,13 +1680,25 @@ sfs_opendir(struct vnode *v, int openflags)
  *
  * This function should attempt to avoid returning errors, as handling
  * them usefully is often not possible.
+ *
+ * The inode only goes as far as the buffer cache; the next sync
+ * writes it out.
  */
 static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -890,31 +1712,40 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **svp;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from finding it while we look.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 	}
@@ -922,7 +1753,9 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -931,28 +1764,36 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	/*
+	 * Remove the vnode structure from the table in the struct
+	 * sfs_fs, and from the dirty list if it's still there. (It
+	 * can't be on its way through sfs_sync; that holds a
+	 * reference.)
+	 */
+	for (svp = &sfs->sfs_vnhash[sfs_vnhashfn(sv->sv_ino)];
+	     *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	*svp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	if (sv->sv_ondirtylist) {
+		sfs_undirty(sv);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	spinlock_release(&sfs->sfs_dirtylock);
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -967,13 +1808,18 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	start = uio->uio_offset;
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -986,13 +1832,24 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	/* sfi_size is 32 bits, and the indirect blocks only go so far */
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+	if ((uint64_t)uio->uio_offset + uio->uio_resid > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	return result;
 }
@@ -1033,7 +1890,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1912,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type is fixed when the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1094,19 +1950,31 @@ sfs_tryseek(struct vnode *v, off_t pos)
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * The buffer cache doesn't know which file a block belongs to, so
+ * this writes out all the volume's dirty blocks, not just the file's.
+ * With a journal, that's a commit.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	if (sfs->sfs_super.sp_jblocks > 0) {
+		return sfs_jcommit(sfs);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	return sfs_bflush(sfs);
 }
 
 /*
@@ -1121,35 +1989,116 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks of a file past BLOCKLEN (a length in blocks)
+ * that are under the indirect block *IDBLOCKP, which has LEVELS
+ * levels and maps the file's blocks from BASE on. If that leaves it
+ * empty, free it too and clear *IDBLOCKP.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_itrunc_indirect(struct sfs_vnode *sv, uint32_t *idblockp,
+		    unsigned levels, uint64_t base, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;
+	uint32_t *idbuf;
+	uint64_t span;
+	uint32_t j, old;
+	int result;
+	int hasnonzero, iddirty;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* Blocks of the file per entry */
+	span = 1;
+	for (j=1; j<levels; j++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	/* Nothing to do if it's all before the new EOF, or isn't there */
+	if (*idblockp == 0 || blocklen >= base + span * SFS_DBPERIDB) {
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = sfs_bread(sfs, *idblockp, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = idb->b_data;
+
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		/* Discard any blocks that are past the new EOF */
+		if (idbuf[j] != 0 && blocklen < base + (j+1) * span) {
+			if (levels == 1) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = 1;
+			}
+			else {
+				old = idbuf[j];
+				result = sfs_itrunc_indirect(sv, &idbuf[j],
+							     levels - 1,
+							     base + j * span,
+							     blocklen);
+				if (idbuf[j] != old) {
+					iddirty = 1;
+				}
+				if (result) {
+					if (iddirty) {
+						sfs_bdirtymeta(idb);
+					}
+					sfs_brelse(idb);
+					return result;
+				}
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j]!=0) {
+			hasnonzero=1;
+		}
+	}
+
+	if (!hasnonzero) {
+		/*
+		 * The whole indirect block is empty now; free it.
+		 * (Let go of it first; freeing it drops it from
+		 * the cache.)
+		 */
+		sfs_brelse(idb);
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+	}
+	else {
+		/* The indirect block may be dirty */
+		if (iddirty) {
+			sfs_bdirtymeta(idb);
+		}
+		sfs_brelse(idb);
+	}
+	return 0;
+}
+
+/*
+ * Discard the blocks of a file past LEN and set its size to LEN.
+ * The vnode must be locked. Used by sfs_truncate and sfs_reclaim.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, old;
+	uint32_t *idptr;
+	uint64_t base, span;
+	unsigned levels;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1160,70 +2109,59 @@ sfs_truncate(struct vnode *v, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	/*
+	 * Then the single, double, and triple indirect blocks, each
+	 * of which maps the blocks after the one before.
+	 */
+	base = SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	for (levels=1; levels<=SFS_NINDIRECT; levels++) {
+		idptr = sfs_indirectptr(sv, levels);
+		old = *idptr;
+		result = sfs_itrunc_indirect(sv, idptr, levels, base, blocklen);
+		if (*idptr != old) {
+			sfs_dirty(sv);
+		}
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		base += span;
+		span *= SFS_DBPERIDB;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1256,21 +2194,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *newguy;
+	struct dcache_refs old = DCACHE_REFS_INITIALIZER;
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -1278,18 +2220,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1297,22 +2242,29 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	(void)mode;
 
 	/* Link it into the directory */
-	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
+	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL, &old);
 	if (result) {
+		lock_release(sv->sv_lock);
+		/* reclaiming it starts an operation of its own */
+		sfs_jend(sfs);
+		dcache_putrefs(&old);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty(newguy);
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	dcache_putrefs(&old);
 	return 0;
 }
 
@@ -1327,27 +2279,47 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+	struct dcache_refs old = DCACHE_REFS_INITIALIZER;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
-	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
+	result = sfs_dir_link(sv, name, f->sv_ino, NULL, &old);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		dcache_putrefs(&old);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	dcache_putrefs(&old);
 	return 0;
 }
 
+/*
+ * Check for "." and "..", which name a directory and can't be
+ * removed or renamed (nor made by rename).
+ */
+static
+bool
+sfs_isdotname(const char *name)
+{
+	return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
 /*
  * Delete a file.
  */
@@ -1356,32 +2328,51 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
+	struct dcache_refs old = DCACHE_REFS_INITIALIZER;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	if (sfs_isdotname(name)) {
+		return EINVAL;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
+	/* only "." and ".." lead back to the directory (no subdirs) */
+	KASSERT(victim != sv);
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, slot, &old);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty(victim);
+		lock_release(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us, and the name
+	 * cache's. This may reclaim the victim, which locks it and
+	 * starts an operation of its own, so neither can be held here.
+	 */
+	dcache_putrefs(&old);
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1397,19 +2388,29 @@ sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *g1;
+	struct dcache_refs old1 = DCACHE_REFS_INITIALIZER;
+	struct dcache_refs old2 = DCACHE_REFS_INITIALIZER;
+	struct dcache_refs old3 = DCACHE_REFS_INITIALIZER;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	if (sfs_isdotname(n1) || sfs_isdotname(n2)) {
+		return EINVAL;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1424,17 +2425,26 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * the new name doesn't already exist; might as well use the
 	 * existing link routine.
 	 */
-	result = sfs_dir_link(sv, n2, g1->sv_ino, &slot2);
+	result = sfs_dir_link(sv, n2, g1->sv_ino, NULL, &old1);
 	if (result) {
 		goto puke;
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty(g1);
+	lock_release(g1->sv_lock);
 
-	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	/*
+	 * Unlink the old slot. Linking may have rehashed the
+	 * directory, so find it again first.
+	 */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
+	result = sfs_dir_unlink(sv, slot1, &old2);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1443,32 +2453,48 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty(g1);
+	lock_release(g1->sv_lock);
 
-	/* Let go of the reference to g1 */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	/* Let go of the reference to g1, and the name cache's */
+	dcache_putrefs(&old1);
+	dcache_putrefs(&old2);
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
 	/*
-	 * Error recovery: try to undo what we already did
+	 * Error recovery: try to undo what we already did. (The new
+	 * name may have moved, if the directory is hashed.)
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_findname(sv, n2, NULL, &slot2, NULL);
+	if (result2 == 0) {
+		result2 = sfs_dir_unlink(sv, slot2, &old3);
+	}
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
-	/* Let go of the reference to g1 */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	/* Let go of the reference to g1, and the name cache's */
+	dcache_putrefs(&old1);
+	dcache_putrefs(&old2);
+	dcache_putrefs(&old3);
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2512,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* sfi_type is fixed at load time, so this needs no lock. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2525,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1510,7 +2532,8 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. The answer, including "not there", goes in the name cache,
+ * which sfs_dir_link and sfs_dir_unlink keep up to date.
  */
 static
 int
@@ -1518,24 +2541,41 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *final;
+	struct vnode *cached;
+	struct dcache_refs old = DCACHE_REFS_INITIALIZER;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
+	if (dcache_lookup(&sv->sv_v, path, &cached)) {
+		lock_release(sv->sv_lock);
+		if (cached == NULL) {
+			return ENOENT;
+		}
+		*ret = cached;
+		return 0;
+	}
 	result = sfs_lookonce(sv, path, &final, NULL);
+	if (result == 0) {
+		dcache_enter(&sv->sv_v, path, &final->sv_v, &old);
+	}
+	else if (result == ENOENT) {
+		dcache_enter(&sv->sv_v, path, NULL, &old);
+	}
+	lock_release(sv->sv_lock);
+
+	/* the entry recycled may have been the last reference to a vnode */
+	dcache_putrefs(&old);
+
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,39 +2685,40 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The whole thing runs under sfs_vnlock so that two threads looking
+ * for the same inode can't both load it.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *b;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned h;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	h = sfs_vnhashfn(ino);
+	for (sv = sfs->sfs_vnhash[h]; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +2728,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,11 +2746,15 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_bread(sfs, ino, &b);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, b->b_data, sizeof(sv->sv_i));
+	sfs_brelse(b);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -1714,7 +2767,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		sv->sv_dirty = true;	/* goes on the dirty list below */
 	}
 
 	/*
@@ -1736,21 +2789,31 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_nextblock = 0;
+	sv->sv_seqcount = 0;
+	sv->sv_rablock = 0;
+	sv->sv_ondirtylist = false;
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+
+	if (sv->sv_dirty) {
+		sfs_dirty(sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +2830,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
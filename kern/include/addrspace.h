@@ -40,6 +40,13 @@
 
 struct vnode;
 
+/*
+ * Number of user stacks an address space can hold: one for each
+ * thread of a multithreaded process. Stack 0 is the original one at
+ * USERSTACK; stack N sits directly below stack N-1.
+ */
+#define AS_MAXSTACKS 16
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -56,6 +63,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  paddr_t as_threadstacks[AS_MAXSTACKS - 1]; /* stacks 1.., or 0 */
   #if OPT_A3
     bool load_finish;
   #endif
@@ -95,6 +103,18 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - make sure stack SLOT (1..AS_MAXSTACKS-1)
+ *                exists, for a new user thread, and hand back its
+ *                initial stack pointer. A stack that already exists
+ *                (left by an earlier thread) is reused as is.
+ *
+ *    as_translate - find the physical address of user address VADDR
+ *                in AS, which need not be the current address space,
+ *                and how many bytes from there on are physically
+ *                contiguous. EFAULT if VADDR isn't mapped, or if
+ *                WRITE is set and it's read-only. Lets the kernel
+ *                move data into another process's memory directly.
  */
 
 struct addrspace *as_create(void);
@@ -111,6 +131,10 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_threadstack(struct addrspace *as, unsigned slot,
+                                        vaddr_t *initstackptr);
+int               as_translate(struct addrspace *as, vaddr_t vaddr,
+                               bool write, paddr_t *paddr, size_t *contig);
 
 
 /*
@@ -36,7 +36,8 @@
  * Time-related definitions.
  *
  * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * when the CPU is not idle, for scheduling. USERMODE says whether the
+ * tick interrupted user code (false if the timer can't tell).
  *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -58,7 +59,7 @@
 
 void hardclock_bootstrap(void);
 
-void hardclock(void);
+void hardclock(bool usermode);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
@@ -59,15 +59,21 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Reaped threads, with stacks */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_ctxswitches;		/* Counter of context switches */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	bool c_rehome;			/* Runqueue has threads not allowed here */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+#if OPT_LOCKSTATS
+	char c_runqueue_lockname[16];	/* its name in the lock stats */
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -193,8 +193,53 @@ typedef struct {
 #define	PF_X		0x1	/* Segment is executable */
 
 
+/*
+ * Section header, and the symbol table entries found in sections of
+ * type SHT_SYMTAB. Not needed to load programs; used by the profiler
+ * to look up kernel symbols.
+ *
+ * There are Ehdr.e_shnum section headers at Ehdr.e_shoff. A symbol
+ * table's sh_link is the index of the section holding its names.
+ */
+typedef struct {
+	uint32_t	sh_name;     /* Name (offset in section name table) */
+	uint32_t	sh_type;     /* Type of section */
+	uint32_t	sh_flags;    /* Flags */
+	uint32_t	sh_addr;     /* Virtual address, if loaded */
+	uint32_t	sh_offset;   /* Location of data within file */
+	uint32_t	sh_size;     /* Size of data */
+	uint32_t	sh_link;     /* Related section */
+	uint32_t	sh_info;     /* Extra information */
+	uint32_t	sh_addralign; /* Required alignment */
+	uint32_t	sh_entsize;  /* Size of each entry, for tables */
+} Elf32_Shdr;
+
+/* values for sh_type */
+#define	SHT_NULL	0		/* Section header entry unused */
+#define	SHT_PROGBITS	1		/* Program data */
+#define	SHT_SYMTAB	2		/* Symbol table */
+#define	SHT_STRTAB	3		/* String table */
+
+typedef struct {
+	uint32_t	st_name;     /* Name (offset in string table) */
+	uint32_t	st_value;    /* Address */
+	uint32_t	st_size;     /* Size of object */
+	unsigned char	st_info;     /* Type and binding */
+	unsigned char	st_other;    /* Ignore */
+	uint16_t	st_shndx;    /* Section it's in */
+} Elf32_Sym;
+
+/* symbol types, from st_info */
+#define	ELF32_ST_TYPE(info)	((info) & 0xf)
+#define	STT_NOTYPE	0		/* Unspecified */
+#define	STT_OBJECT	1		/* Data */
+#define	STT_FUNC	2		/* Code */
+
+
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
 
 
 #endif /* _ELF_H_ */
@@ -0,0 +1,87 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what open() creates: a vnode plus the access mode
+ * and the seek position. It is reference counted because fork and
+ * dup2 make several descriptors (possibly in several processes)
+ * share one openfile, and with it one seek position.
+ *
+ * of_offset is protected by of_offsetlock, which read and write hold
+ * across the I/O so that concurrent users of the same openfile get
+ * distinct ranges. Files that aren't seekable (the console) don't
+ * use the offset, so they skip the lock.
+ *
+ * A filetable maps descriptor numbers to openfiles. Each slot holds
+ * one reference. ft_lock only covers the slot array; lookups take a
+ * reference of their own before dropping it, so a concurrent close
+ * can't free an openfile out from under a read or write.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;		/* the file */
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_append;			/* O_APPEND */
+	bool of_seekable;		/* VOP_TRYSEEK allowed it at open */
+	struct lock *of_offsetlock;	/* protects of_offset */
+	off_t of_offset;		/* current seek position */
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;		/* descriptors + in-flight users */
+};
+
+/*
+ * openfile_open	Open PATH (which may be destroyed) and make an openfile
+ *			for it with one reference.
+ * openfile_fromvnode	Make an openfile with one reference for V, which
+ *			must already be open (as from vfs_open). Takes
+ *			over the caller's reference to V. FLAGS gives the
+ *			access mode. For objects that aren't opened by
+ *			name, like pipes.
+ * openfile_incref	Add a reference.
+ * openfile_decref	Drop a reference; the last one closes the vnode.
+ */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+int openfile_fromvnode(struct vnode *v, int flags, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable {
+	struct spinlock ft_lock;
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/*
+ * filetable_create	Make an empty table.
+ * filetable_destroy	Close every descriptor and free the table.
+ * filetable_copy	Make a new table sharing all of SRC's openfiles
+ *			(for fork).
+ * filetable_stdio	Open the console as descriptors 0, 1 and 2 (where
+ *			they aren't already open).
+ * filetable_place	Put OF in the lowest free slot and return it in FD.
+ *			Takes over the caller's reference. EMFILE if full.
+ * filetable_get	Return FD's openfile with a new reference, which the
+ *			caller must drop. EBADF if FD isn't open.
+ * filetable_remove	Empty slot FD and hand back the reference it held.
+ * filetable_setfd	Make FD refer to OF (adding a reference) and hand
+ *			back the reference to whatever FD had before, or
+ *			NULL. For dup2.
+ */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+int filetable_stdio(struct filetable *ft);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_remove(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_setfd(struct filetable *ft, int fd, struct openfile *of,
+		    struct openfile **oldret);
+
+#endif /* _FILE_H_ */
@@ -0,0 +1,50 @@
+#ifndef _KERN_KTRACE_H_
+#define _KERN_KTRACE_H_
+
+/*
+ * Kernel trace records, as written out by "kt save" from the menu and
+ * read by ktdecode. See ktrace.h for the kernel side.
+ *
+ * A trace file is a struct ktrace_header followed by kh_nevents
+ * events in time order. Everything is in the kernel's byte order
+ * (big-endian on MIPS).
+ */
+
+#define KTRACE_MAGIC	0x6b747231	/* "ktr1" */
+
+struct ktrace_header {
+	uint32_t kh_magic;
+	uint32_t kh_nevents;
+};
+
+struct ktrace_event {
+	uint32_t ke_secs;		/* time of day, as from gettime */
+	uint32_t ke_nsecs;
+	uint16_t ke_type;		/* KT_* */
+	uint16_t ke_cpu;		/* cpu number */
+	uint32_t ke_thread;		/* struct thread * of curthread */
+	uint32_t ke_arg0;		/* event-specific */
+	uint32_t ke_arg1;
+	char ke_name[8];		/* event-specific, not terminated */
+};
+
+/*
+ * Event types, with what goes in the arguments.
+ */
+#define KT_SWITCH	1	/* new thread; -; new thread's name */
+#define KT_SLEEP	2	/* wchan; -; wchan name */
+#define KT_WAKEONE	3	/* wchan; woken thread; wchan name */
+#define KT_WAKEALL	4	/* wchan; -; wchan name */
+#define KT_SYSCALL	5	/* call number; - */
+#define KT_SYSRET	6	/* call number; error */
+#define KT_VMFAULT	7	/* fault type; fault address */
+#define KT_DISKIO	8	/* sector; nonzero if write */
+#define KT_DISKDONE	9	/* error; - */
+#define KT_NTYPES	10
+
+#define KTRACE_TYPENAMES { \
+	"?", "switch", "sleep", "wakeone", "wakeall", \
+	"syscall", "sysret", "vmfault", "diskio", "diskdone", \
+}
+
+#endif /* _KERN_KTRACE_H_ */
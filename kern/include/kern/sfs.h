@@ -36,16 +36,28 @@
  * and is used by tools that work on SFS volumes, such as mksfs.
  */
 
+/*
+ * The block size is chosen when the kernel and the tools are built,
+ * and recorded in the superblock; a volume can only be used with the
+ * block size it was made with. It must be a power of 2 and a multiple
+ * of the 512-byte disk sector. Volumes from before sp_blocksize was
+ * recorded (it reads as 0) have 512-byte blocks.
+ */
+#ifndef SFS_BLOCKSIZE
+#define SFS_BLOCKSIZE     4096          /* size of our blocks */
+#endif
+#define SFS_OLDBLOCKSIZE  512           /* size if sp_blocksize is 0 */
+
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_DBPERIDB      (SFS_BLOCKSIZE/4) /* # blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
+#define SFS_DIRHASH_MIN   32            /* smallest hashed dir (slots) */
 
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
@@ -59,6 +71,10 @@
 /* Size of bitmap (in blocks) */
 #define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
 
+/* Inodes have double and triple indirect blocks (tested by sfsck) */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -71,7 +87,10 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_blocksize;			/* SFS_BLOCKSIZE */
+	uint32_t sp_jstart;			/* First block of journal */
+	uint32_t sp_jblocks;			/* Its size, or 0 if none */
+	uint32_t reserved[SFS_BLOCKSIZE/4-13];
 };
 
 /*
@@ -83,7 +102,11 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirslots;			/* Hashed dir: table size */
+	uint32_t sfi_dirused;			/* Hashed dir: slots in use */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[SFS_BLOCKSIZE/4-7-SFS_NDIRECT]; /* set to 0 */
 };
 
 /*
@@ -94,5 +117,76 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * A directory is an array of struct sfs_dir, whose free slots have
+ * sfd_ino SFS_NOINO and an empty name. In a flat directory (one with
+ * sfi_dirslots 0) entries may be in any slot. A hashed directory is
+ * an open hash table of sfi_dirslots slots (a power of 2, and the
+ * directory's whole size): an entry goes in the first free slot at
+ * or after (cyclically) slot SFS_DIRHASH(name) % sfi_dirslots, so a
+ * name is looked for from there up to the next free slot. A hashed
+ * directory is still a valid flat one.
+ *
+ * SFS_DIRHASH is 32-bit FNV-1a: start from SFS_DIRHASH_INIT and apply
+ * SFS_DIRHASH_STEP for each character of the name.
+ */
+#define SFS_DIRHASH_INIT	2166136261U
+#define SFS_DIRHASH_STEP(h, c)	\
+	((uint32_t)(((h) ^ (unsigned char)(c)) * 16777619U))
+
+/*
+ * Metadata journal. If sp_jblocks isn't 0, the sp_jblocks blocks from
+ * sp_jstart on are a write-ahead log of changes to metadata blocks
+ * (inodes, indirect blocks, directory blocks, the freemap, and the
+ * superblock); file data isn't logged. (Volumes without one, such as
+ * those from before journals, are updated in place.)
+ *
+ * The first block is a struct sfs_jheader, and the rest hold
+ * transactions, one after another from the block after it. Each
+ * transaction is one or more groups, each a struct sfs_jdesc followed
+ * by jd_nblocks block images, and then a struct sfs_jcommit. The
+ * descriptor's jd_blocks lists where each image belongs, and then
+ * jd_nrevoke blocks freed in this transaction. Every block of a
+ * transaction carries its sequence number, and transactions run on
+ * consecutively from jh_seq; the log ends at the first block that
+ * doesn't fit, or the first transaction whose jc_sum is wrong.
+ *
+ * To replay the log, write each image to where it belongs, in order,
+ * except for images of blocks that a later transaction revokes.
+ *
+ * jc_sum is SFS_JSUM_STEP applied from SFS_JSUM_INIT over every
+ * 32-bit word (as a number, not as bytes) of the transaction's
+ * descriptors and images, in the order they're in the log.
+ */
+#define SFS_JHMAGIC       0x4a524e4c    /* journal header */
+#define SFS_JDMAGIC       0x4a444553    /* descriptor */
+#define SFS_JCMAGIC       0x4a434d54    /* commit */
+#define SFS_JDESCMAX      (SFS_BLOCKSIZE/4-4) /* entries per descriptor */
+
+#define SFS_JSUM_INIT     2166136261U
+#define SFS_JSUM_STEP(sum, w) \
+	((uint32_t)(((sum) ^ (uint32_t)(w)) * 16777619U))
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JHMAGIC */
+	uint32_t jh_seq;			/* Sequence # of 1st transaction */
+	uint32_t reserved[SFS_BLOCKSIZE/4-2];
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JDMAGIC */
+	uint32_t jd_seq;			/* Sequence # of transaction */
+	uint32_t jd_nblocks;			/* Images after this block */
+	uint32_t jd_nrevoke;			/* Revoked blocks */
+	uint32_t jd_blocks[SFS_JDESCMAX];	/* Homes, then revokes */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCMAGIC */
+	uint32_t jc_seq;			/* Sequence # of transaction */
+	uint32_t jc_sum;			/* Checksum (see above) */
+	uint32_t reserved[SFS_BLOCKSIZE/4-3];
+};
+
 
 #endif /* _KERN_SFS_H_ */
@@ -0,0 +1,54 @@
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+/*
+ * Kernel event tracing.
+ *
+ * Each cpu logs compact binary events (see <kern/ktrace.h>) into its
+ * own ring of KTRACE_NEVENTS, overwriting the oldest. Logging takes
+ * no locks: a cpu only ever writes its own ring, and does so with
+ * interrupts off. This makes it cheap enough to leave on and, unlike
+ * DEBUG kprintfs, doesn't go through the console, so it doesn't
+ * change the timing it's trying to show.
+ *
+ * Use the KTRACE macro at trace points so they vanish when the
+ * option is off.
+ *
+ * ktrace_cpuinit	Set up the ring for a cpu (from cpu_create).
+ * ktrace_log		Log an event on the current cpu. NAME may be NULL.
+ * ktrace_enable	Turn logging on or off. It starts on.
+ * ktrace_clear		Empty all the rings.
+ * ktrace_dump		Print the last COUNT events (0 for all of them),
+ *			merged across cpus in time order.
+ * ktrace_save		Write all the events to the file PATH (which is
+ *			destroyed) for ktdecode.
+ *
+ * Dumping and saving pause logging while they read the rings.
+ */
+
+#include <kern/ktrace.h>
+#include "opt-ktrace.h"
+
+#define KTRACE_NEVENTS	1024	/* per cpu; must be a power of 2 */
+
+#if OPT_KTRACE
+
+void ktrace_cpuinit(unsigned cpunum);
+void ktrace_log(unsigned type, uint32_t arg0, uint32_t arg1,
+		const char *name);
+void ktrace_enable(bool on);
+void ktrace_clear(void);
+void ktrace_dump(unsigned count);
+int ktrace_save(char *path);
+
+#define KTRACE(type, arg0, arg1, name) \
+	ktrace_log(type, (uint32_t)(uintptr_t)(arg0), \
+		   (uint32_t)(uintptr_t)(arg1), name)
+
+#else
+
+#define KTRACE(type, arg0, arg1, name) ((void)0)
+
+#endif /* OPT_KTRACE */
+
+#endif /* _KTRACE_H_ */
@@ -0,0 +1,31 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Pipes.
+ *
+ * A pipe is a PIPE_SIZE ring buffer with a vnode for each end. Reads
+ * block while the pipe is empty and the write end is open, and then
+ * return whatever is there; a read of an empty pipe whose write end
+ * is closed returns 0 (EOF). Writes block while the pipe is full and
+ * return EPIPE once the read end is closed. Both ends are unseekable.
+ *
+ * Large reads skip the ring: a reader that finds the pipe empty and
+ * wants at least PIPE_DIRECTMIN bytes posts its buffer, and the next
+ * writer copies straight from its own buffer into the reader's memory
+ * (found with as_translate), so the data is copied once instead of
+ * twice.
+ *
+ * pipe_create	Make a pipe and hand back its read and write ends,
+ *		each with one reference and opened once, as from
+ *		vfs_open. vfs_close closes an end.
+ */
+
+#define PIPE_SIZE	4096
+#define PIPE_DIRECTMIN	1024
+
+struct vnode;
+
+int pipe_create(struct vnode **readret, struct vnode **writeret);
+
+#endif /* _PIPE_H_ */
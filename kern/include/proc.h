@@ -43,6 +43,8 @@
 
 struct addrspace;
 struct vnode;
+struct filetable;
+struct uthreads;
 #ifdef UW
 struct semaphore;
 #endif // UW
@@ -54,12 +56,18 @@ struct proc {
 	char *p_name;			/* Name of this process */
 	struct spinlock p_lock;		/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
+	struct uthreads *p_uthreads;	/* user threads, once there's >1 */
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+	struct filetable *p_filetable;	/* open file descriptors */
+
+	/* Accounting (see usage.h), protected by p_lock */
+	struct usage p_usage;		/* from threads that have left */
+	struct usage p_cusage;		/* from children waited for */
 
 #ifdef UW
   /* a vnode to refer to the console device */
@@ -73,12 +81,7 @@ struct proc {
 	/* add more material here as needed */
 	#if OPT_A2
 	pid_t PID;
-	int exitCode;
-	bool zombie;
-	struct proc* parent; 
-	struct cv* p_cv;
-	struct array* children;
-	struct lock* pLock; 
+	struct cv* p_cv;		/* waitpid sleeps here for children */
 	#endif
 };
 
@@ -105,6 +108,33 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+#if OPT_A2
+/*
+ * Parent/child bookkeeping. Exit status and family ties are kept in
+ * the PID table, not in struct proc, so an exited process costs only
+ * its table slot until the parent waits for it (see proc.c).
+ *
+ * proc_addchild	Make CHILD a child of PARENT.
+ * proc_exit		Record PROC's exit status and wake its parent; after
+ *			this PROC can be destroyed.
+ * proc_wait		Wait for PARENT's child PID and collect its status
+ *			and, if USAGE isn't NULL, its resource usage.
+ *			With NOHANG, *retpid is 0 if it hasn't exited yet.
+ * proc_reaper_start	Start the thread that frees unwaited-for zombies.
+ */
+void proc_addchild(struct proc *parent, struct proc *child);
+void proc_exit(struct proc *proc, int status);
+int proc_wait(struct proc *parent, pid_t pid, bool nohang,
+	      int *status, pid_t *retpid, struct usage *usage);
+void proc_reaper_start(void);
+#endif
+
+/*
+ * Resource usage of PROC so far (all its threads, past and present),
+ * or with CHILDREN, of its children that have been waited for.
+ */
+void proc_getusage(struct proc *proc, bool children, struct usage *ret);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
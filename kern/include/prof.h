@@ -0,0 +1,45 @@
+#ifndef _PROF_H_
+#define _PROF_H_
+
+/*
+ * Sampling profiler.
+ *
+ * On every hardclock tick each cpu records where it was interrupted:
+ * kernel PCs go in a histogram over the kernel text with
+ * PROF_KSHIFT-sized buckets, user PCs in a coarser one over the
+ * usual place user programs' text goes, and ticks taken in the idle
+ * loop just get counted. Each cpu has its own counters and only
+ * touches them from the timer interrupt, so there's no locking.
+ *
+ * Kernel buckets are turned back into function names when printing
+ * by reading the symbol table out of the kernel's ELF file, because
+ * the symbol table isn't loaded into memory. A bucket is charged to
+ * the function it starts in.
+ *
+ * prof_cpuinit	Set up the counters for a cpu (from cpu_create).
+ * prof_sample	Record one tick (from the timer interrupt).
+ * prof_enable	Start or stop sampling. It starts stopped.
+ * prof_reset	Zero all the counters.
+ * prof_print	Print the COUNT busiest kernel functions, looking
+ *		them up in the kernel image KERNFILE (which is
+ *		destroyed), and the COUNT busiest user ranges.
+ */
+
+#include "opt-prof.h"
+
+#define PROF_KSHIFT	4		/* 16-byte kernel buckets */
+#define PROF_USHIFT	8		/* 256-byte user buckets */
+#define PROF_UBASE	0x00400000	/* where user text is linked */
+#define PROF_UNBUCKETS	4096		/* so 1M of user text */
+
+#if OPT_PROF
+
+void prof_cpuinit(unsigned cpunum);
+void prof_sample(vaddr_t pc, bool usermode);
+void prof_enable(bool on);
+void prof_reset(void);
+int prof_print(unsigned count, char *kernfile);
+
+#endif /* OPT_PROF */
+
+#endif /* _PROF_H_ */
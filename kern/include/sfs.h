@@ -48,23 +48,107 @@
  */
 #include <kern/sfs.h>
 
+struct lock; /* from synch.h */
+
+/*
+ * Locking:
+ *
+ *    sv_lock          - protects sv_i, sv_dirty and the read-ahead
+ *                       state of one vnode, and for directories,
+ *                       the directory contents.
+ *    sfs_vnlock       - protects the loaded vnode table (sfs_vnhash,
+ *                       sv_hashnext, sfs_nvnodes).
+ *    sfs_dirtylock    - (spinlock) protects the dirty vnode list:
+ *                       sfs_dirtyvnodes, sfs_ndirty, sv_ondirtylist,
+ *                       sv_dirtynext and sv_dirtyprev.
+ *    sfs_freemaplock  - protects sfs_freemap, sfs_maploaded,
+ *                       sfs_mapdirty, sfs_nmapdirty,
+ *                       sfs_alloccursor, and the journal's
+ *                       sfs_jmaplogged, sfs_jfreemap, sfs_jnfreed,
+ *                       sfs_jlowspace, sfs_jlogmap, sfs_jrevoke and
+ *                       sfs_jnrevoke.
+ *    sfs_superlock    - protects sfs_super and sfs_superdirty.
+ *    sfs_jlock        - protects sfs_jactive and sfs_jcommitting.
+ *                       The rest of the journal state belongs to
+ *                       whoever is committing.
+ *
+ * Lock ordering: a directory's sv_lock before the sv_lock of a file
+ * in it; any sv_lock before sfs_vnlock; sfs_vnlock before
+ * sfs_freemaplock. sfs_superlock and sfs_jlock are leaves. Holding a
+ * buffer (see below) comes after all of these. On a volume with a
+ * journal, sfs_jbegin comes before all of them (see below).
+ *
+ * A vnode whose inode changes (sv_dirty) is put on its volume's dirty
+ * list, so sfs_sync only has to visit those.
+ *
+ * The freemap is read in a block at a time as it's needed, and only
+ * the blocks of it that change are written back; sfs_maploaded and
+ * sfs_mapdirty have a bit for each of its blocks. Until a block is
+ * read in, its bits are all set in memory, so searches for free
+ * space pass over it.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for this vnode */
+	uint32_t sv_nextblock;          /* where a sequential read goes on */
+	unsigned sv_seqcount;           /* sequential reads in a row */
+	uint32_t sv_rablock;            /* read ahead up to here */
+	struct sfs_vnode *sv_hashnext;  /* loaded vnode table chain */
+	bool sv_ondirtylist;            /* on sfs_dirtyvnodes */
+	struct sfs_vnode *sv_dirtynext; /* dirty vnode list */
+	struct sfs_vnode *sv_dirtyprev;
 };
 
+/* Chains in the loaded vnode table (a power of 2) */
+#define SFS_VNHASHSIZE 64
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* how many are loaded */
+	struct spinlock sfs_dirtylock;  /* lock for the dirty list */
+	struct sfs_vnode *sfs_dirtyvnodes; /* vnodes with sv_dirty set */
+	unsigned sfs_ndirty;            /* how many */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_maploaded;   /* freemap blocks read in */
+	struct bitmap *sfs_mapdirty;    /* freemap blocks modified */
+	unsigned sfs_nmapdirty;         /* how many */
+	uint32_t sfs_alloccursor;       /* where sfs_balloc looks next */
+	struct lock *sfs_vnlock;        /* lock for sfs_vnhash */
+	struct lock *sfs_freemaplock;   /* lock for sfs_freemap */
+	struct lock *sfs_superlock;     /* lock for sfs_super */
+	unsigned sfs_nmeta;             /* buffers with b_meta set */
+
+	/* The journal, if sfs_super.sp_jblocks isn't 0 */
+	struct lock *sfs_jlock;         /* lock for the next two */
+	unsigned sfs_jactive;           /* operations under way */
+	bool sfs_jcommitting;           /* a commit is waiting or under way */
+	struct cv *sfs_jcv;             /* for changes to those */
+	uint32_t sfs_jseq;              /* sequence # of the next transaction */
+	uint32_t sfs_jhead;             /* where it goes in the log */
+	struct bitmap *sfs_jmaplogged;  /* freemap blocks logged, not home */
+	bool sfs_jsuperlogged;          /* superblock likewise */
+	struct bitmap *sfs_jfreemap;    /* blocks freed since the last commit */
+	unsigned sfs_jnfreed;           /* how many */
+	bool sfs_jlowspace;             /* they're needed; commit soon */
+	struct bitmap *sfs_jlogmap;     /* blocks with images in the log */
+	uint32_t *sfs_jrevoke;          /* logged blocks to revoke next commit */
+	unsigned sfs_jnrevoke;          /* how many */
+	uint32_t *sfs_jblocks;          /* for the committer: buffers to log */
+	void *sfs_jbuf;                 /* for the committer: a block */
 };
 
+/* Shortcuts for the size macros in kern/sfs.h */
+#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
+#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -84,6 +168,148 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/*
+ * Freemap I/O, all with sfs_freemaplock held. BLOCK is the disk block
+ * whose bit is wanted.
+ *
+ * sfs_mapload      Read in the freemap block with BLOCK's bit, if it
+ *                  isn't already.
+ * sfs_maploadnext  Read in the next freemap block that isn't, going
+ *                  on from the one with BLOCK's bit; ENOSPC if
+ *                  they're all in.
+ * sfs_dirtymap     Note that BLOCK's bit (which is read in) changed.
+ * sfs_mapsync      Write out the freemap blocks that changed.
+ */
+int sfs_mapload(struct sfs_fs *sfs, uint32_t block);
+int sfs_maploadnext(struct sfs_fs *sfs, uint32_t block);
+void sfs_dirtymap(struct sfs_fs *sfs, uint32_t block);
+int sfs_mapsync(struct sfs_fs *sfs);
+
+/*
+ * Buffer cache. Every inode, indirect, directory and file block is
+ * read and written through here; only the superblock and the free
+ * block bitmap, which have their own copies in struct sfs_fs, go to
+ * the disk directly, and so do the journal and runs of consecutive
+ * file blocks, which sfs_io moves straight between the disk and the
+ * caller.
+ *
+ * A buffer is held by one thread at a time, from sfs_bread or
+ * sfs_bget until sfs_brelse; its contents are in b_data. Don't ask
+ * for a block you already hold.
+ *
+ * sfs_bufbootstrap  Set up the cache (from mount; only the first time
+ *                   does anything).
+ * sfs_bread         Get a block's buffer with its contents.
+ * sfs_bget          Get a block's buffer without reading it. If
+ *                   b_valid is false the contents are garbage, and
+ *                   the caller must fill all of b_data before calling
+ *                   sfs_bdirty.
+ * sfs_bdirty        Note that the caller changed the contents. They'll
+ *                   be written out later.
+ * sfs_bdirtymeta    The same, for metadata. On a volume with a journal
+ *                   the buffer (b_meta) isn't written out until it's
+ *                   been committed to the journal.
+ * sfs_brelse        Let go of a buffer.
+ * sfs_binval        Forget a block, dirty or not (when it's freed).
+ * sfs_bpeek         Get a block's buffer if it's already cached, or
+ *                   NULL; for I/O that goes around the cache.
+ * sfs_bforget       Let go of a held buffer and forget its block.
+ * sfs_bflush        Write out all of a volume's dirty buffers, except
+ *                   metadata waiting for the journal (b_meta, b_logged).
+ * sfs_bcheckpoint   Write out all of a volume's dirty buffers.
+ * sfs_bmetalist     List the blocks of a volume's b_meta buffers.
+ * sfs_bcommitted    Note that they're in the journal: clear b_meta and
+ *                   set b_logged.
+ * sfs_bmetafull     Whether b_meta buffers take half the cache.
+ * sfs_bdiscard      Forget all of a volume's buffers (at unmount).
+ * sfs_bincore       Whether a block's contents are in the cache.
+ * sfs_bprefetch     Read a block into the cache, if it isn't there,
+ *                   and let go of it (for read-ahead).
+ * sfs_bufstats_print, sfs_bufstats_reset
+ *                   Hit, miss, read-ahead and write-back counts.
+ *
+ * Dirty buffers are written back by a syncer thread, which syncs all
+ * the filesystems every SFS_SYNCSECS seconds, as well as by sync,
+ * fsync, and recycling.
+ */
+struct sfs_buf {
+	struct sfs_fs *b_fs;            /* volume, or NULL if unused */
+	uint32_t b_block;               /* block number on the volume */
+	void *b_data;                   /* SFS_BLOCKSIZE bytes */
+	bool b_valid;                   /* b_data holds the block */
+	bool b_dirty;                   /* b_data is newer than the disk */
+	bool b_busy;                    /* someone holds it */
+	bool b_ra;                      /* read ahead and not used yet */
+	bool b_meta;                    /* metadata not yet in the journal */
+	bool b_logged;                  /* in the journal, not written home */
+	unsigned b_refcount;            /* holder + waiters */
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lrunext;      /* LRU list */
+	struct sfs_buf *b_lruprev;
+};
+
+int sfs_bufbootstrap(void);
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_bdirty(struct sfs_buf *b);
+void sfs_bdirtymeta(struct sfs_buf *b);
+void sfs_brelse(struct sfs_buf *b);
+void sfs_binval(struct sfs_fs *sfs, uint32_t block);
+struct sfs_buf *sfs_bpeek(struct sfs_fs *sfs, uint32_t block);
+void sfs_bforget(struct sfs_buf *b);
+int sfs_bflush(struct sfs_fs *sfs);
+int sfs_bcheckpoint(struct sfs_fs *sfs);
+unsigned sfs_bmetalist(struct sfs_fs *sfs, uint32_t *blocks, unsigned max);
+void sfs_bcommitted(struct sfs_fs *sfs);
+bool sfs_bmetafull(struct sfs_fs *sfs);
+void sfs_bdiscard(struct sfs_fs *sfs);
+bool sfs_bincore(struct sfs_fs *sfs, uint32_t block);
+int sfs_bprefetch(struct sfs_fs *sfs, uint32_t block);
+void sfs_bufstats_print(void);
+void sfs_bufstats_reset(void);
+
+/*
+ * Read-ahead. Once a file has been read sequentially, each read
+ * queues the next SFS_RABLOCKS blocks after it for a worker thread
+ * to bring into the buffer cache. sfs_rabootstrap starts the worker
+ * (from mount; only the first time does anything).
+ */
+int sfs_rabootstrap(void);
+
+/*
+ * Metadata journal (see sfs_journal.c). On a volume without one
+ * these do nothing, or return 0.
+ *
+ * sfs_jmount       Check the journal, replay it, and set up (from
+ *                  mount, with the superblock loaded and the freemap
+ *                  not yet).
+ * sfs_junmount     Let go of the journal's memory.
+ * sfs_jbegin       Start an operation that changes metadata: write,
+ *                  truncate, creat, link, remove, rename, close, or
+ *                  reclaim. Call it before taking any vnode lock.
+ * sfs_jend         Finish one, after letting go of the vnode locks.
+ *                  In between, don't drop a vnode reference; that
+ *                  can reclaim, which is an operation of its own.
+ * sfs_jcommit      Commit everything done so far (for sync and fsync).
+ * sfs_jcheckpoint  Commit, write everything back home, and empty the
+ *                  log (at unmount).
+ * sfs_jfree        Free a block once the next commit is on disk
+ *                  (sfs_freemaplock held).
+ */
+int sfs_jmount(struct sfs_fs *sfs);
+void sfs_junmount(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jcheckpoint(struct sfs_fs *sfs);
+void sfs_jfree(struct sfs_fs *sfs, uint32_t block);
+
+/* Push a vnode's inode into the buffer cache (sv_lock held, or committing) */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
+/* Take a vnode off its volume's dirty list (sfs_dirtylock held) */
+void sfs_undirty(struct sfs_vnode *sv);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstats.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -50,19 +51,42 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * This is a ticket lock: each acquirer atomically takes the next
+ * ticket from lk_next and then spins until lk_serving reaches it.
+ * Release just advances lk_serving. This hands the lock out in FIFO
+ * order, so a CPU that keeps reacquiring a hot lock (e.g. a
+ * runqueue lock) cannot starve the others waiting for it.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
+#if OPT_LOCKSTATS
+struct spinlock_stats {
+	uint32_t ls_acquires;		/* Total acquisitions. */
+	uint32_t ls_contended;		/* Acquisitions that had to wait. */
+	uint64_t ls_spins;		/* Total iterations spent waiting. */
+};
+#define SPINLOCK_STATS_INITIALIZER	, { 0, 0, 0 }
+#else
+#define SPINLOCK_STATS_INITIALIZER	/* nothing */
+#endif
+
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
-	struct cpu *lk_holder;		/* CPU holding this lock. */
+	volatile spinlock_data_t lk_next;	/* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving;	/* Ticket now holding the lock. */
+	struct cpu *lk_holder;			/* CPU holding this lock. */
+#if OPT_LOCKSTATS
+	struct spinlock_stats lk_stats;		/* Protected by the lock itself. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL \
+	  SPINLOCK_STATS_INITIALIZER }
 
 /*
  * Spinlock functions.
@@ -84,5 +108,26 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+/*
+ * Contention statistics (options lockstats).
+ *
+ * stats_register	Give a lock a name and add it to the table printed
+ *			by stats_print. Locks not registered still count,
+ *			they just aren't listed. Registering the same lock
+ *			again only renames it. Registered locks must never
+ *			be cleaned up.
+ * stats_print		Print acquire/contention/spin counts for all
+ *			registered locks (menu command "lks").
+ * stats_reset		Zero the counters of all registered locks.
+ */
+
+#if OPT_LOCKSTATS
+void spinlock_stats_register(struct spinlock *lk, const char *name);
+void spinlock_stats_print(void);
+void spinlock_stats_reset(void);
+#else
+#define spinlock_stats_register(lk, name) ((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
@@ -62,6 +62,13 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_intr is P as an interruptible wait (see thread_interrupt): it
+ * fails with EINTR, without decrementing, if the thread is
+ * interrupted before it can.
+ */
+int P_intr(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -131,12 +138,21 @@ void cv_destroy(struct cv *);
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
  * For all three operations, the current thread must hold the lock passed 
- * in. Note that under normal circumstances the same lock should be used
- * on all operations with any particular CV.
+ * in. The same lock must be used on all operations with any particular
+ * CV: cv_signal and cv_broadcast don't actually wake the waiters but
+ * move them onto the lock's queue ("wait morphing"), and lock_release
+ * then hands the lock directly to them one at a time.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * cv_wait_intr is cv_wait as an interruptible wait (see
+ * thread_interrupt): it returns EINTR, still with the lock
+ * re-acquired, if the thread was interrupted. Since that may
+ * swallow a cv_signal meant for some waiter, CVs waited on this way
+ * should be woken with cv_broadcast.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_wait_intr(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
@@ -40,6 +40,14 @@ struct trapframe; /* from <machine/trapframe.h> */
 
 void syscall(struct trapframe *tf);
 
+/*
+ * Per-syscall statistics (only with "options syscallstats").
+ * syscall_stats_cpuinit is called for each cpu as it's created.
+ */
+void syscall_stats_cpuinit(unsigned cpunum);
+void syscall_stats_print(void);
+void syscall_stats_reset(void);
+
 /*
  * Support functions.
  */
@@ -60,7 +68,13 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_close(int fdesc);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_pipe(userptr_t fds);
 int sys_fork(struct trapframe *tf, int *retval);
 #if OPT_A3
 void sys__exit(int exitcode, int exit_status);
@@ -69,7 +83,17 @@ void sys__exit(int exitcode);
 #endif
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_wait4(pid_t pid, userptr_t status, int options, userptr_t rusage,
+	      pid_t *retval);
+int sys_getrusage(int who, userptr_t rusage);
 int sys_execv(const char * program_name, char ** args);
+int sys_spawn(userptr_t uprog, userptr_t uargs, pid_t *retval);
+int sys_setaffinity(uint32_t mask);
+int sys_getaffinity(userptr_t mask);
+int sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+		      int *retval);
+void sys_thread_exit(int code);
+int sys_thread_join(int tid, userptr_t code);
 
 #endif // UW
 
@@ -57,6 +57,7 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
@@ -83,7 +84,10 @@ int nettest(int, char **);
 
 /* Routine for running a user-level program. */
 #if OPT_A2
+struct vnode;
 int runprogram(char *progname, char ** args);
+int runprogram_load(struct vnode *v, char **args, int *argc, userptr_t *argv,
+		    vaddr_t *stackptr, vaddr_t *entrypoint);
 #else
 int runprogram(char *progname);	
 #endif
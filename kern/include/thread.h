@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <usage.h>
 
 struct cpu;
 
@@ -82,8 +83,14 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	uint32_t t_cpumask;		/* CPUs (by c_number) allowed to run on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/* Interruptible sleeps; see wchan.h */
+	struct spinlock t_intrlock;	/* protects the next two */
+	bool t_intr;			/* thread_interrupt was called */
+	struct wchan *t_intrwc;		/* channel of an interruptible wait */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -106,8 +113,13 @@ struct thread {
 	 */
 
 	/* add more here as needed */
+	unsigned t_ustack;		/* user stack slot / thread slot */
+	struct usage t_usage;		/* resources used; see usage.h */
 };
 
+/* Affinity mask allowing every cpu. Bit N is cpu number N. */
+#define THREAD_CPUMASK_ALL	0xffffffff
+
 /*
  * Array of threads.
  */
@@ -150,6 +162,15 @@ int thread_fork(const char *name, struct proc *proc,
  */
 void thread_exit(void);
 
+/*
+ * Interrupt thread T: if it's in an interruptible wait (see wchan.h)
+ * wake it, and make that and any later interruptible wait it tries
+ * fail with EINTR. There's no undoing it; it's meant for threads that
+ * are being told to exit. The caller must keep T from going away
+ * (e.g. by holding the lock of T's process, for threads of another).
+ */
+void thread_interrupt(struct thread *t);
+
 /*
  * Cause the current thread to yield to the next runnable thread, but
  * itself stay runnable.
@@ -168,5 +189,23 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Total number of context switches done so far, summed over all
+ * CPUs. The count is not synchronized against the other CPUs and is
+ * intended for diagnostics and benchmarks, which look at differences.
+ */
+unsigned thread_ctxswitches(void);
+
+/*
+ * Get and set the current thread's cpu affinity mask (bit N allows
+ * running on cpu number N). The mask is inherited by thread_fork.
+ * Setting a mask that contains no existing cpu fails with EINVAL. If
+ * the current cpu isn't in the new mask, thread_set_cpumask moves the
+ * thread to one that is before returning (which takes a short-lived
+ * helper thread, so it can also fail with ENOMEM).
+ */
+uint32_t thread_get_cpumask(void);
+int thread_set_cpumask(uint32_t mask);
+
 
 #endif /* _THREAD_H_ */
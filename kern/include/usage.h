@@ -0,0 +1,42 @@
+#ifndef _USAGE_H_
+#define _USAGE_H_
+
+/*
+ * Resource usage accounting.
+ *
+ * Each thread counts what it uses in its t_usage. Only the thread's
+ * own cpu ever updates it (from the thread itself, or from an
+ * interrupt taken while it runs), so no locking is needed. When a
+ * thread leaves its process the counts are added into the process's
+ * p_usage; when a process exits its total, along with its waited-for
+ * children's, is kept with its exit status and added to the parent's
+ * p_cusage when the parent waits for it. This is what getrusage and
+ * wait4 report.
+ *
+ * Ticks are hardclocks, charged to whatever thread was running (not
+ * counting the idle loop), in user or kernel mode according to where
+ * the interrupt came from. A switch is voluntary if the thread went
+ * to sleep and involuntary if it was made to yield. Bytes are counted
+ * as they're moved to or from user space by uiomove, so they cover
+ * reads and writes of all kinds of objects, and loading programs.
+ *
+ * usage_add		Add FROM into TO.
+ * usage_torusage	Fill in a struct rusage for user space.
+ */
+
+struct rusage;
+
+struct usage {
+	uint32_t u_uticks;		/* hardclocks in user mode */
+	uint32_t u_sticks;		/* hardclocks in the kernel */
+	uint32_t u_nvcsw;		/* voluntary context switches */
+	uint32_t u_nivcsw;		/* involuntary context switches */
+	uint32_t u_faults;		/* calls to vm_fault */
+	uint64_t u_inbytes;		/* bytes moved to user space */
+	uint64_t u_outbytes;		/* bytes moved from user space */
+};
+
+void usage_add(struct usage *to, const struct usage *from);
+void usage_torusage(const struct usage *u, struct rusage *ru);
+
+#endif /* _USAGE_H_ */
@@ -0,0 +1,69 @@
+#ifndef _UTHREAD_H_
+#define _UTHREAD_H_
+
+/*
+ * Threads of multithreaded user processes.
+ *
+ * A process starts out with one thread and no struct uthreads; the
+ * first thread_create makes one. Each user thread has a slot, which
+ * is also the number of its user stack in the address space (see
+ * as_define_threadstack), so there are at most AS_MAXSTACKS threads
+ * per process. The kernel thread keeps its slot in t_ustack; the
+ * original thread is slot 0 and uses the original stack.
+ *
+ * Thread ids work like PIDs: a slot hands out id N, then
+ * N+AS_MAXSTACKS, and so on, so an old id doesn't name a new thread.
+ *
+ * A thread that exits keeps its slot (and stack) until someone joins
+ * it; after that the slot and its stack go to the next thread
+ * created. _exit or execv in any thread takes the whole process down
+ * to just that thread first: the others are told to exit, which they
+ * do the next time they come into the kernel (at the latest, at the
+ * next timer interrupt) or on their way out of it. Those blocked in a
+ * system call are interrupted (thread_interrupt), so any interruptible
+ * wait (pipes, waitpid, console input) gives up with EINTR; other
+ * waits are ones that end by themselves, like disk I/O.
+ *
+ * ub_nrunning counts threads that haven't called thread_exit; the
+ * last one to do so exits the process. ub_nthreads counts threads
+ * still attached to the process, which is what _exit waits on.
+ * Everything is protected by ub_lock.
+ */
+
+#include <addrspace.h>
+
+struct proc;
+struct lock;
+struct cv;
+
+#define UT_FREE		0	/* slot not in use */
+#define UT_RUNNING	1	/* thread alive */
+#define UT_EXITED	2	/* exited, not yet joined */
+
+struct uthreads {
+	struct lock *ub_lock;
+	struct cv *ub_cv;		/* exits, for join and _exit */
+	unsigned ub_nrunning;		/* threads that haven't exited */
+	unsigned ub_nthreads;		/* threads attached to the proc */
+	bool ub_exiting;		/* _exit or execv in progress */
+	struct {
+		int us_state;		/* UT_* */
+		int us_tid;		/* current thread id */
+		int us_code;		/* thread_exit code, once UT_EXITED */
+	} ub_slots[AS_MAXSTACKS];
+};
+
+/*
+ * uthreads_destroy	Free a process's uthreads (from proc_destroy).
+ * uthread_single	Make curthread the only thread of its process,
+ *			for _exit and execv. Dies instead if another
+ *			thread got there first.
+ * uthread_checkexit	Exit curthread if its process is being taken
+ *			down to one thread. Called on the way back to
+ *			user mode.
+ */
+void uthreads_destroy(struct uthreads *ub);
+void uthread_single(void);
+void uthread_checkexit(void);
+
+#endif /* _UTHREAD_H_ */
@@ -174,6 +174,48 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Directory name lookup cache, for filesystems to use in their
+ * lookup routines. Entries map (directory vnode, name) to the vnode
+ * the name leads to, or to nothing (a negative entry, for names known
+ * not to exist). The filesystem must remove an entry whenever the
+ * name is linked or unlinked in that directory. Names longer than
+ * DCACHE_NAMELEN aren't cached.
+ *
+ *    dcache_lookup  - If (DIR, NAME) is cached, return true and hand
+ *                     back its vnode, with a reference, or NULL for a
+ *                     negative entry. Otherwise return false.
+ *    dcache_enter   - Cache (DIR, NAME) as VN, or as negative if VN
+ *                     is NULL. References the entry it replaces or
+ *                     recycles held are handed back in OLD.
+ *    dcache_remove  - Forget (DIR, NAME), if it's cached, handing
+ *                     back the entry's references in OLD.
+ *    dcache_putrefs - Drop the references in OLD.
+ *    dcache_purgefs - Forget everything on filesystem FS (for
+ *                     unmount, since entries hold vnode references).
+ *
+ * Dropping a reference can reclaim the vnode, so the caller of
+ * dcache_enter or dcache_remove must call dcache_putrefs only once
+ * it holds no vnode locks and is outside any filesystem operation
+ * of its own. OLD must start out empty (DCACHE_REFS_INITIALIZER).
+ */
+
+#define DCACHE_NAMELEN 31
+
+struct dcache_refs {
+	struct vnode *dr_dir;
+	struct vnode *dr_vn;
+};
+#define DCACHE_REFS_INITIALIZER { NULL, NULL }
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  struct dcache_refs *old);
+void dcache_remove(struct vnode *dir, const char *name,
+		   struct dcache_refs *old);
+void dcache_putrefs(struct dcache_refs *old);
+void dcache_purgefs(struct fs *fs);
+
 /*
  * Array of vnodes.
  */
@@ -185,8 +227,10 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global lock for the VFS-level tables: the known device list,
+ * mounts, and the boot filesystem. File and directory operations do
+ * not take it; SFS uses per-vnode and per-filesystem locks instead.
+ * (emufs still uses it for its own material.)
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
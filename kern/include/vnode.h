@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,15 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects vn_refcount and vn_opencount. Everything
+ * else in the vnode is either constant after VOP_INIT or is up to
+ * the filesystem to lock.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for vn_refcount/vn_opencount */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -81,5 +82,38 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Lower-level wakeup primitives, used to build wait morphing and
+ * ownership handoff in the synchronization primitives.
+ *
+ * dequeue	Remove the first sleeper (or return NULL) without waking
+ *		it. The caller must later pass it to wchan_wakethread.
+ * wakethread	Make a thread returned by wchan_dequeue runnable.
+ * requeue	Move one sleeper, or all of them, from one channel to
+ *		another without waking them. Locks FROM, then TO.
+ *		Returns how many threads were moved.
+ */
+struct thread *wchan_dequeue(struct wchan *wc);
+void wchan_wakethread(struct thread *target);
+unsigned wchan_requeue(struct wchan *from, struct wchan *to, bool all);
+
+/*
+ * Interruptible sleeps, for waits that thread_interrupt should be
+ * able to break (ones that may last indefinitely on behalf of a user
+ * process).
+ *
+ * intr_begin	Announce that the current thread is going to sleep on
+ *		WC, interruptibly. Must be called without WC locked
+ *		(thread_interrupt locks it after the thread's own lock).
+ * sleep_intr	Like wchan_sleep, but returns EINTR (still unlocking
+ *		WC) without sleeping if the thread has been interrupted,
+ *		and EINTR if it was woken by thread_interrupt.
+ * intr_end	Done with interruptible sleeping on WC; after this the
+ *		channel may go away.
+ */
+void wchan_intr_begin(struct wchan *wc);
+int wchan_sleep_intr(struct wchan *wc);
+void wchan_intr_end(void);
+
 
 #endif /* _WCHAN_H_ */
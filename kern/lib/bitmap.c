@@ -120,6 +120,46 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned len,
+               unsigned *index)
+{
+        unsigned pass, bit, end, run;
+
+        KASSERT(len > 0);
+        if (start >= b->nbits) {
+                start = 0;
+        }
+
+        /* First from START to the end, then from 0 up to START. */
+        for (pass=0; pass<2; pass++) {
+                bit = (pass == 0) ? start : 0;
+                end = (pass == 0) ? b->nbits : start + len - 1;
+                if (end > b->nbits) {
+                        end = b->nbits;
+                }
+                run = 0;
+                while (bit < end) {
+                        /* skip full words quickly */
+                        if (bit % BITS_PER_WORD == 0 &&
+                            b->v[bit / BITS_PER_WORD] == WORD_ALLBITS) {
+                                run = 0;
+                                bit += BITS_PER_WORD;
+                                continue;
+                        }
+                        if (bitmap_isset(b, bit)) {
+                                run = 0;
+                        }
+                        else if (++run == len) {
+                                *index = bit + 1 - len;
+                                return 0;
+                        }
+                        bit++;
+                }
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -102,6 +102,13 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 			    if (result) {
 				    return result;
 			    }
+			    /* resource accounting; see usage.h */
+			    if (uio->uio_rw == UIO_READ) {
+				    curthread->t_usage.u_inbytes += size;
+			    }
+			    else {
+				    curthread->t_usage.u_outbytes += size;
+			    }
 			    iov->iov_ubase += size;
 			    break;
 		    default:
@@ -48,8 +48,16 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <file.h>
+#include <uthread.h>
 #include <synch.h>
+#include <thread.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>  
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <clock.h>
+#include <limits.h>
 #include "opt-A2.h"
 
 /*
@@ -70,9 +78,404 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 #if OPT_A2
-static volatile pid_t count_pid;
-static struct lock *count_pid_lock;
-bool count_pid_lock_create;
+/*
+ * PID table.
+ *
+ * A fixed table of PIDTABLE_SIZE slots; a process's slot is its PID
+ * modulo PIDTABLE_SIZE, so lookup is a single index. Free slots are
+ * kept on a FIFO free list so a slot is reused only after all the
+ * others, and each reuse hands out the next PID for that slot (PID +
+ * PIDTABLE_SIZE, wrapping before PID_MAX), so a given PID number
+ * doesn't come back until long after its process is gone.
+ *
+ * The slot is also where the process's family ties and exit status
+ * live. A slot is LIVE from fork until _exit, when the struct proc
+ * and everything hanging off it are freed and the slot becomes a
+ * ZOMBIE: just the PID, the parent and the exit status, kept until
+ * the parent collects it with waitpid. Each slot links into its
+ * parent's list of children (by slot number) so waitpid and exit
+ * can unlink in constant time.
+ *
+ * When a process exits, its children are given to the reaper: live
+ * ones are marked as orphans, and zombies (which nobody will ever
+ * wait for now) go on the reaper's queue, as do orphans when they
+ * exit. The reaper is a kernel thread that frees the queued slots,
+ * so exit never has to walk down through generations of processes.
+ *
+ * Everything here is protected by pidtable_lock. It's a sleep lock,
+ * since waitpid sleeps on the parent's p_cv with it held.
+ */
+#define PIDTABLE_SIZE	128
+
+#define PE_FREE		0	/* on the free list */
+#define PE_LIVE		1	/* pe_proc is running */
+#define PE_ZOMBIE	2	/* exited, pe_status is valid */
+
+#define PE_NONE		(-1)	/* null slot link */
+
+static struct {
+	struct proc *pe_proc;		/* process in this slot, if LIVE */
+	pid_t pe_pid;			/* PID using the slot (LIVE, ZOMBIE) */
+	pid_t pe_nextpid;		/* PID for the next use of the slot */
+	int pe_state;			/* PE_FREE, PE_LIVE, or PE_ZOMBIE */
+	int pe_status;			/* exit status (ZOMBIE) */
+	struct usage pe_usage;		/* resources used (ZOMBIE) */
+	int pe_parent;			/* parent's slot, or PE_NONE */
+	int pe_children;		/* first child's slot */
+	int pe_prev, pe_next;		/* siblings; pe_next is also the
+					   free list and reaper queue link */
+} pidtable[PIDTABLE_SIZE];
+static int pid_freehead, pid_freetail;
+static int reaper_head;
+static struct lock *pidtable_lock;
+static struct cv *reaper_cv;
+static bool pidtable_ready;
+
+static
+pid_t
+pid_firstpid(int slot)
+{
+	pid_t pid = slot;
+
+	while (pid < PID_MIN) {
+		pid += PIDTABLE_SIZE;
+	}
+	return pid;
+}
+
+static
+void
+pidtable_init(void)
+{
+	int i;
+
+	for (i=0; i<PIDTABLE_SIZE; i++) {
+		pidtable[i].pe_proc = NULL;
+		pidtable[i].pe_pid = 0;
+		pidtable[i].pe_nextpid = pid_firstpid(i);
+		pidtable[i].pe_state = PE_FREE;
+		pidtable[i].pe_status = 0;
+		pidtable[i].pe_parent = PE_NONE;
+		pidtable[i].pe_children = PE_NONE;
+		pidtable[i].pe_prev = PE_NONE;
+		pidtable[i].pe_next = i + 1;
+	}
+	pidtable[PIDTABLE_SIZE - 1].pe_next = PE_NONE;
+	pid_freehead = 0;
+	pid_freetail = PIDTABLE_SIZE - 1;
+	reaper_head = PE_NONE;
+
+	pidtable_lock = lock_create("pidtable");
+	reaper_cv = cv_create("reaper");
+	if (pidtable_lock == NULL || reaper_cv == NULL) {
+		panic("proc_bootstrap: out of memory for the PID table\n");
+	}
+}
+
+/*
+ * Give PROC a PID and enter it in the table. Fails with ENPROC if
+ * the table is full.
+ */
+static
+int
+pid_alloc(struct proc *proc)
+{
+	int slot;
+	pid_t pid;
+
+	lock_acquire(pidtable_lock);
+	slot = pid_freehead;
+	if (slot == PE_NONE) {
+		lock_release(pidtable_lock);
+		return ENPROC;
+	}
+	pid_freehead = pidtable[slot].pe_next;
+	if (pid_freehead == PE_NONE) {
+		pid_freetail = PE_NONE;
+	}
+
+	pid = pidtable[slot].pe_nextpid;
+	KASSERT(pid % PIDTABLE_SIZE == slot);
+	pidtable[slot].pe_nextpid = pid + PIDTABLE_SIZE;
+	if (pidtable[slot].pe_nextpid > PID_MAX) {
+		pidtable[slot].pe_nextpid = pid_firstpid(slot);
+	}
+	pidtable[slot].pe_proc = proc;
+	pidtable[slot].pe_pid = pid;
+	pidtable[slot].pe_state = PE_LIVE;
+	pidtable[slot].pe_status = 0;
+	pidtable[slot].pe_parent = PE_NONE;
+	pidtable[slot].pe_children = PE_NONE;
+	pidtable[slot].pe_prev = PE_NONE;
+	pidtable[slot].pe_next = PE_NONE;
+	proc->PID = pid;
+	lock_release(pidtable_lock);
+	return 0;
+}
+
+/*
+ * Put SLOT at the end of the free list. It must already be unlinked
+ * from its parent.
+ */
+static
+void
+pid_freeslot(int slot)
+{
+	KASSERT(lock_do_i_hold(pidtable_lock));
+	KASSERT(pidtable[slot].pe_parent == PE_NONE);
+	KASSERT(pidtable[slot].pe_children == PE_NONE);
+
+	pidtable[slot].pe_proc = NULL;
+	pidtable[slot].pe_state = PE_FREE;
+	pidtable[slot].pe_next = PE_NONE;
+	if (pid_freetail == PE_NONE) {
+		pid_freehead = slot;
+	}
+	else {
+		pidtable[pid_freetail].pe_next = slot;
+	}
+	pid_freetail = slot;
+}
+
+/*
+ * Take SLOT off its parent's list of children.
+ */
+static
+void
+pid_unlink(int slot)
+{
+	int parent, prev, next;
+
+	KASSERT(lock_do_i_hold(pidtable_lock));
+	parent = pidtable[slot].pe_parent;
+	if (parent == PE_NONE) {
+		return;
+	}
+	prev = pidtable[slot].pe_prev;
+	next = pidtable[slot].pe_next;
+	if (prev == PE_NONE) {
+		KASSERT(pidtable[parent].pe_children == slot);
+		pidtable[parent].pe_children = next;
+	}
+	else {
+		pidtable[prev].pe_next = next;
+	}
+	if (next != PE_NONE) {
+		pidtable[next].pe_prev = prev;
+	}
+	pidtable[slot].pe_parent = PE_NONE;
+	pidtable[slot].pe_prev = PE_NONE;
+	pidtable[slot].pe_next = PE_NONE;
+}
+
+/*
+ * Hand an unlinked zombie slot to the reaper.
+ */
+static
+void
+pid_reap(int slot)
+{
+	KASSERT(lock_do_i_hold(pidtable_lock));
+	KASSERT(pidtable[slot].pe_state == PE_ZOMBIE);
+	KASSERT(pidtable[slot].pe_parent == PE_NONE);
+
+	pidtable[slot].pe_next = reaper_head;
+	reaper_head = slot;
+	cv_signal(reaper_cv, pidtable_lock);
+}
+
+/*
+ * Make CHILD a child of PARENT.
+ */
+void
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	int pslot = parent->PID % PIDTABLE_SIZE;
+	int cslot = child->PID % PIDTABLE_SIZE;
+	int first;
+
+	lock_acquire(pidtable_lock);
+	KASSERT(pidtable[pslot].pe_proc == parent);
+	KASSERT(pidtable[cslot].pe_proc == child);
+	KASSERT(pidtable[cslot].pe_parent == PE_NONE);
+
+	first = pidtable[pslot].pe_children;
+	pidtable[cslot].pe_parent = pslot;
+	pidtable[cslot].pe_prev = PE_NONE;
+	pidtable[cslot].pe_next = first;
+	if (first != PE_NONE) {
+		pidtable[first].pe_prev = cslot;
+	}
+	pidtable[pslot].pe_children = cslot;
+	lock_release(pidtable_lock);
+}
+
+/*
+ * PROC is exiting with (encoded) status STATUS. Turn its slot into a
+ * zombie and wake up the parent, or pass it to the reaper if there's
+ * no parent to wait for it; give its children to the reaper as well.
+ * After this the slot no longer refers to PROC, which can be
+ * destroyed.
+ */
+void
+proc_exit(struct proc *proc, int status)
+{
+	int slot = proc->PID % PIDTABLE_SIZE;
+	int child, next, parent;
+
+	lock_acquire(pidtable_lock);
+	KASSERT(pidtable[slot].pe_proc == proc);
+
+	for (child = pidtable[slot].pe_children; child != PE_NONE;
+	     child = next) {
+		next = pidtable[child].pe_next;
+		pidtable[child].pe_parent = PE_NONE;
+		pidtable[child].pe_prev = PE_NONE;
+		pidtable[child].pe_next = PE_NONE;
+		if (pidtable[child].pe_state == PE_ZOMBIE) {
+			pid_reap(child);
+		}
+	}
+	pidtable[slot].pe_children = PE_NONE;
+
+	pidtable[slot].pe_proc = NULL;
+	pidtable[slot].pe_state = PE_ZOMBIE;
+	pidtable[slot].pe_status = status;
+	/* what we used, and what our children did, for the parent */
+	proc_getusage(proc, false, &pidtable[slot].pe_usage);
+	spinlock_acquire(&proc->p_lock);
+	usage_add(&pidtable[slot].pe_usage, &proc->p_cusage);
+	spinlock_release(&proc->p_lock);
+
+	parent = pidtable[slot].pe_parent;
+	if (parent == PE_NONE) {
+		pid_reap(slot);
+	}
+	else {
+		KASSERT(pidtable[parent].pe_state == PE_LIVE);
+		cv_broadcast(pidtable[parent].pe_proc->p_cv, pidtable_lock);
+	}
+	lock_release(pidtable_lock);
+}
+
+/*
+ * Wait for the child of PARENT with the given PID to exit, collect
+ * its status and usage (adding the latter to PARENT's p_cusage), and
+ * free its slot. ECHILD if there's no such child, and EINTR if the
+ * wait is interrupted (see thread_interrupt). With NOHANG, a child
+ * that's still running sets *retpid to 0 instead of waiting.
+ */
+int
+proc_wait(struct proc *parent, pid_t pid, bool nohang,
+	  int *status, pid_t *retpid, struct usage *usage)
+{
+	int pslot = parent->PID % PIDTABLE_SIZE;
+	int slot, result;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return ECHILD;
+	}
+	slot = pid % PIDTABLE_SIZE;
+
+	lock_acquire(pidtable_lock);
+	KASSERT(pidtable[pslot].pe_proc == parent);
+	while (1) {
+		/*
+		 * Check every time around: another thread of PARENT
+		 * may have waited for the child while we slept, and the
+		 * slot may since have been handed to someone else.
+		 */
+		if (pidtable[slot].pe_state == PE_FREE ||
+		    pidtable[slot].pe_pid != pid ||
+		    pidtable[slot].pe_parent != pslot) {
+			lock_release(pidtable_lock);
+			return ECHILD;
+		}
+		if (pidtable[slot].pe_state != PE_LIVE) {
+			break;
+		}
+		if (nohang) {
+			lock_release(pidtable_lock);
+			*retpid = 0;
+			return 0;
+		}
+		result = cv_wait_intr(parent->p_cv, pidtable_lock);
+		if (result) {
+			/* our process is being taken down to one thread */
+			lock_release(pidtable_lock);
+			return result;
+		}
+	}
+	KASSERT(pidtable[slot].pe_state == PE_ZOMBIE);
+
+	*status = pidtable[slot].pe_status;
+	if (usage != NULL) {
+		*usage = pidtable[slot].pe_usage;
+	}
+	spinlock_acquire(&parent->p_lock);
+	usage_add(&parent->p_cusage, &pidtable[slot].pe_usage);
+	spinlock_release(&parent->p_lock);
+	pid_unlink(slot);
+	pid_freeslot(slot);
+	lock_release(pidtable_lock);
+
+	*retpid = pid;
+	return 0;
+}
+
+/*
+ * Called from proc_destroy. If PROC never got as far as proc_exit
+ * (fork failed partway), its slot is still live; drop it.
+ */
+static
+void
+pid_destroy(struct proc *proc)
+{
+	int slot = proc->PID % PIDTABLE_SIZE;
+
+	lock_acquire(pidtable_lock);
+	if (pidtable[slot].pe_proc == proc) {
+		KASSERT(pidtable[slot].pe_state == PE_LIVE);
+		KASSERT(pidtable[slot].pe_children == PE_NONE);
+		pid_unlink(slot);
+		pid_freeslot(slot);
+	}
+	lock_release(pidtable_lock);
+}
+
+/*
+ * The reaper thread: frees the slots of zombies nobody will wait for.
+ */
+static
+void
+proc_reaper(void *data1, unsigned long data2)
+{
+	int slot;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(pidtable_lock);
+	while (1) {
+		while (reaper_head == PE_NONE) {
+			cv_wait(reaper_cv, pidtable_lock);
+		}
+		slot = reaper_head;
+		reaper_head = pidtable[slot].pe_next;
+		pid_freeslot(slot);
+	}
+}
+
+void
+proc_reaper_start(void)
+{
+	int result;
+
+	result = thread_fork("reaper", NULL, proc_reaper, NULL, 0);
+	if (result) {
+		panic("proc_reaper_start: thread_fork: %s\n", strerror(result));
+	}
+}
 #endif
 
 /*
@@ -96,29 +499,41 @@ proc_create(const char *name)
 
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+	proc->p_uthreads = NULL;
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_cusage, sizeof(proc->p_cusage));
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	proc->p_filetable = NULL;
 
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
 #if OPT_A2
-if (count_pid_lock_create) {
-  lock_acquire(count_pid_lock);
-  proc->PID = count_pid;
-  count_pid++;
-  lock_release(count_pid_lock);
-}
-	proc->exitCode = 0;
-	proc->zombie = false;
-	proc->parent = NULL; // MAYBE SET THE PARENT HERE FROM CURPROC
-	proc->children = array_create();
-	proc->pLock = lock_create("child lock for process x");
+	/* kproc has no PID; it's created before the table is ready */
+	proc->PID = 0;
+	if (pidtable_ready && pid_alloc(proc)) {
+		threadarray_cleanup(&proc->p_threads);
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
 	proc->p_cv = cv_create("cv for parent process x");
+	if (proc->p_cv == NULL) {
+		if (pidtable_ready) {
+			pid_destroy(proc);
+		}
+		threadarray_cleanup(&proc->p_threads);
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
 #endif
 
 	return proc;
@@ -148,7 +563,16 @@ proc_destroy(struct proc *proc)
 	 * incorrect to destroy it.)
 	 */
 
+	if (proc->p_uthreads) {
+		uthreads_destroy(proc->p_uthreads);
+		proc->p_uthreads = NULL;
+	}
+
 	/* VFS fields */
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
@@ -180,21 +604,9 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-#if OPT_A2	
-	lock_acquire(proc->pLock);
-	for (int i = array_num(proc->children) - 1; i >= 0; i--) {	
-		struct proc *child_proc = array_get(proc->children, i);
-		if (child_proc->zombie) {
-			proc_destroy(child_proc); 
-		}
-		else {
-			child_proc->parent = NULL;
-		}
-		array_remove(proc->children, i);
-	}
-	array_destroy(proc->children);
-	lock_release(proc->pLock);
-	lock_destroy(proc->pLock);
+#if OPT_A2
+	/* children and exit status live in the PID table (see proc_exit) */
+	pid_destroy(proc);
 	cv_destroy(proc->p_cv);
 #endif
 
@@ -242,14 +654,8 @@ proc_bootstrap(void)
   }
 #endif // UW 
 #if OPT_A2
-  count_pid = 1;
-  count_pid_lock = lock_create("count_pid_lock");
-  if (count_pid_lock == NULL) {
-	  panic("count_pid_lock could not be created!");
-  }
-  else {
-      count_pid_lock_create = true;
-  }  
+  pidtable_init();
+  pidtable_ready = true;
 #endif
 }
 
@@ -357,6 +763,9 @@ proc_remthread(struct thread *t)
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
+			/* the process keeps what the thread used */
+			usage_add(&proc->p_usage, &t->t_usage);
+			bzero(&t->t_usage, sizeof(t->t_usage));
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
 			return;
@@ -367,6 +776,64 @@ proc_remthread(struct thread *t)
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
 
+void
+proc_getusage(struct proc *proc, bool children, struct usage *ret)
+{
+	unsigned i, num;
+
+	spinlock_acquire(&proc->p_lock);
+	if (children) {
+		*ret = proc->p_cusage;
+	}
+	else {
+		/*
+		 * What's left plus what's still here. Threads fold their
+		 * counts into p_usage as they leave (proc_remthread),
+		 * which takes p_lock, so none is missed or counted
+		 * twice. The live counts of threads on other cpus may
+		 * be a tick or so behind, which is fine.
+		 */
+		*ret = proc->p_usage;
+		num = threadarray_num(&proc->p_threads);
+		for (i=0; i<num; i++) {
+			usage_add(ret,
+				  &threadarray_get(&proc->p_threads, i)->t_usage);
+		}
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+void
+usage_add(struct usage *to, const struct usage *from)
+{
+	to->u_uticks += from->u_uticks;
+	to->u_sticks += from->u_sticks;
+	to->u_nvcsw += from->u_nvcsw;
+	to->u_nivcsw += from->u_nivcsw;
+	to->u_faults += from->u_faults;
+	to->u_inbytes += from->u_inbytes;
+	to->u_outbytes += from->u_outbytes;
+}
+
+void
+usage_torusage(const struct usage *u, struct rusage *ru)
+{
+	/* HZ divides a million */
+	const uint32_t usecs_per_tick = 1000000 / HZ;
+
+	bzero(ru, sizeof(*ru));
+	ru->ru_utime.tv_sec = u->u_uticks / HZ;
+	ru->ru_utime.tv_usec = (u->u_uticks % HZ) * usecs_per_tick;
+	ru->ru_stime.tv_sec = u->u_sticks / HZ;
+	ru->ru_stime.tv_usec = (u->u_sticks % HZ) * usecs_per_tick;
+	/* no paging, so every fault is a minor one */
+	ru->ru_minflt = u->u_faults;
+	ru->ru_nvcsw = u->u_nvcsw;
+	ru->ru_nivcsw = u->u_nivcsw;
+	ru->ru_inbytes = u->u_inbytes;
+	ru->ru_oubytes = u->u_outbytes;
+}
+
 /*
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
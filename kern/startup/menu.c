@@ -42,9 +42,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <ktrace.h>
+#include <prof.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstats.h"
+#include "opt-syscallstats.h"
+#include "opt-ktrace.h"
+#include "opt-prof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -418,6 +424,144 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_LOCKSTATS
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		spinlock_stats_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: lks [reset]\n");
+		return EINVAL;
+	}
+
+	spinlock_stats_print();
+
+	return 0;
+}
+#endif
+
+#if OPT_SYSCALLSTATS
+/*
+ * Command for printing (or clearing) per-syscall latency histograms.
+ */
+static
+int
+cmd_syscallstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		syscall_stats_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: scs [reset]\n");
+		return EINVAL;
+	}
+
+	syscall_stats_print();
+
+	return 0;
+}
+#endif
+
+#if OPT_SFS
+/*
+ * Command for printing (or clearing) SFS buffer cache statistics.
+ */
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sfs_bufstats_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: sfs [reset]\n");
+		return EINVAL;
+	}
+
+	sfs_bufstats_print();
+
+	return 0;
+}
+#endif
+
+#if OPT_KTRACE
+/*
+ * Command for the kernel trace: dump it (all of it, or the last N
+ * events), save it to a file for ktdecode, or turn it on or off.
+ */
+static
+int
+cmd_ktrace(int nargs, char **args)
+{
+	if (nargs == 1) {
+		ktrace_dump(0);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		ktrace_enable(true);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		ktrace_enable(false);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "clear")) {
+		ktrace_clear();
+		return 0;
+	}
+	if (nargs == 2 && atoi(args[1]) > 0) {
+		ktrace_dump(atoi(args[1]));
+		return 0;
+	}
+	if (nargs == 3 && !strcmp(args[1], "save")) {
+		return ktrace_save(args[2]);
+	}
+	kprintf("Usage: kt [count | save file | on | off | clear]\n");
+	return EINVAL;
+}
+#endif
+
+#if OPT_PROF
+/*
+ * Command for the profiler: start, stop, or clear it, or print the
+ * busiest COUNT functions, looking up names in the kernel image
+ * (by default the one sys161 booted from the emufs root).
+ */
+static
+int
+cmd_prof(int nargs, char **args)
+{
+	/* vfs_open destroys its argument, so not a string constant */
+	char kernel[] = "emu0:kernel";
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		prof_enable(true);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		prof_enable(false);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		prof_reset();
+		return 0;
+	}
+	if (nargs > 3 || (nargs >= 2 && atoi(args[1]) <= 0)) {
+		kprintf("Usage: prof [on | off | reset | count [kernel]]\n");
+		return EINVAL;
+	}
+
+	return prof_print(nargs >= 2 ? atoi(args[1]) : 20,
+			  nargs == 3 ? args[2] : kernel);
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -482,6 +626,7 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt] Thread create benchmark        ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -528,6 +673,21 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_LOCKSTATS
+	"[lks] Spinlock stats [reset]        ",
+#endif
+#if OPT_SYSCALLSTATS
+	"[scs] Syscall stats [reset]         ",
+#endif
+#if OPT_SFS
+	"[sfs] SFS cache stats [reset]       ",
+#endif
+#if OPT_KTRACE
+	"[kt] Kernel trace [n|save f|on|off] ",
+#endif
+#if OPT_PROF
+	"[prof] Profiler [on|off|reset|n]    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -585,6 +745,21 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_LOCKSTATS
+	{ "lks",	cmd_lockstats },
+#endif
+#if OPT_SYSCALLSTATS
+	{ "scs",	cmd_syscallstats },
+#endif
+#if OPT_SFS
+	{ "sfs",	cmd_sfsstats },
+#endif
+#if OPT_KTRACE
+	{ "kt",		cmd_ktrace },
+#endif
+#if OPT_PROF
+	{ "prof",	cmd_prof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -597,6 +772,7 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt",		threadbench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -652,6 +652,7 @@ catmouse(int nargs,
   time_t before_sec, after_sec, wait_sec;
   uint32_t before_nsec, after_nsec, wait_nsec;
   int total_bowl_milliseconds, total_eating_milliseconds, utilization_percent;
+  unsigned before_ctxsw, ctxsw;
 
   /* check and process command line arguments */
   if ((nargs != 9) && (nargs != 5)) {
@@ -734,6 +735,7 @@ catmouse(int nargs,
 
   /* get current time, for measuring total simulation time */
   gettime(&before_sec,&before_nsec);
+  before_ctxsw = thread_ctxswitches();
 
   /*
    * Start NumCats cat_simulation() threads and NumMice mouse_simulation() threads.
@@ -767,6 +769,7 @@ catmouse(int nargs,
 
   /* get current time, for measuring total simulation time */
   gettime(&after_sec,&after_nsec);
+  ctxsw = thread_ctxswitches() - before_ctxsw;
   /* compute total simulation time */
   getinterval(before_sec,before_nsec,after_sec,after_nsec,&wait_sec,&wait_nsec);
   /* compute and report bowl utilization */
@@ -776,6 +779,7 @@ catmouse(int nargs,
     utilization_percent = total_eating_milliseconds*100/total_bowl_milliseconds;
     kprintf("STATS: Bowl utilization: %d%%\n",utilization_percent);
   }
+  kprintf("STATS: Context switches: %u\n",ctxsw);
 
   /* clean up the semaphore that we created */
   sem_destroy(CatMouseWait);
@@ -95,6 +95,8 @@ static struct semaphore *perf_mutex;
 /* simulation start and end time */
 time_t start_sec, end_sec;
 uint32_t start_nsec, end_nsec;
+/* context switch counter at simulation start and end */
+static unsigned start_ctxsw, end_ctxsw;
 
 /* bias direction, for arrival biasing */
 Direction heavy_direction;
@@ -237,6 +239,7 @@ print_perf_stats(void) {
 	  sim_msec/1000,
 	  sim_msec%1000,
 	  total_count);
+  kprintf("Context switches: %u\n", end_ctxsw - start_ctxsw);
 } 
 
 
@@ -585,6 +588,7 @@ traffic_simulation(int nargs,
 
   /* get simulation start time */
   gettime(&start_sec,&start_nsec);
+  start_ctxsw = thread_ctxswitches();
 
   for (i = 0; i < NumThreads; i++) {
     error = thread_fork("vehicle_simulation thread", NULL, vehicle_simulation, NULL, i);
@@ -600,6 +604,7 @@ traffic_simulation(int nargs,
 
   /* get simulation end time */
   gettime(&end_sec,&end_nsec);
+  end_ctxsw = thread_ctxswitches();
 
   /* clean up the simulation state */
   cleanup_state();
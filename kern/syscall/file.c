@@ -0,0 +1,277 @@
+/*
+ * Open files and file tables. See file.h for details.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <file.h>
+
+////////////////////////////////////////////////////////////
+//
+// Open files.
+
+/*
+ * Wrap an open vnode in an openfile. On success the openfile takes
+ * over the caller's reference to (and open of) V.
+ */
+int
+openfile_fromvnode(struct vnode *v, int flags, struct openfile **ret)
+{
+	struct openfile *of;
+	int accmode;
+
+	accmode = flags & O_ACCMODE;
+	if (accmode != O_RDONLY && accmode != O_WRONLY && accmode != O_RDWR) {
+		return EINVAL;
+	}
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_offsetlock = lock_create("openfile");
+	if (of->of_offsetlock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	of->of_vnode = v;
+	of->of_accmode = accmode;
+	of->of_append = (flags & O_APPEND) != 0;
+	of->of_seekable = (VOP_TRYSEEK(v, 0) == 0);
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct vnode *v;
+	int accmode, result;
+
+	accmode = flags & O_ACCMODE;
+	if (accmode != O_RDONLY && accmode != O_WRONLY && accmode != O_RDWR) {
+		return EINVAL;
+	}
+
+	result = vfs_open(path, flags, mode, &v);
+	if (result) {
+		return result;
+	}
+
+	result = openfile_fromvnode(v, flags, ret);
+	if (result) {
+		vfs_close(v);
+		return result;
+	}
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = (of->of_refcount == 0);
+	spinlock_release(&of->of_reflock);
+
+	if (!last) {
+		return;
+	}
+
+	vfs_close(of->of_vnode);
+	spinlock_cleanup(&of->of_reflock);
+	lock_destroy(of->of_offsetlock);
+	kfree(of);
+}
+
+////////////////////////////////////////////////////////////
+//
+// File tables.
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	spinlock_init(&ft->ft_lock);
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		ft->ft_files[fd] = NULL;
+	}
+	return ft;
+}
+
+/*
+ * Nobody else can be using the table by now, so no locking.
+ */
+void
+filetable_destroy(struct filetable *ft)
+{
+	int fd;
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (ft->ft_files[fd] != NULL) {
+			openfile_decref(ft->ft_files[fd]);
+			ft->ft_files[fd] = NULL;
+		}
+	}
+	spinlock_cleanup(&ft->ft_lock);
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&src->ft_lock);
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (src->ft_files[fd] != NULL) {
+			openfile_incref(src->ft_files[fd]);
+			ft->ft_files[fd] = src->ft_files[fd];
+		}
+	}
+	spinlock_release(&src->ft_lock);
+
+	*ret = ft;
+	return 0;
+}
+
+int
+filetable_stdio(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	char path[5];
+	struct openfile *of, *old;
+	int fd, result;
+
+	for (fd=0; fd<3; fd++) {
+		if (ft->ft_files[fd] != NULL) {
+			continue;
+		}
+		/* vfs_open destroys its argument, so use a fresh copy */
+		strcpy(path, "con:");
+		result = openfile_open(path, modes[fd], 0, &of);
+		if (result) {
+			return result;
+		}
+		result = filetable_setfd(ft, fd, of, &old);
+		openfile_decref(of);
+		if (result) {
+			return result;
+		}
+		if (old != NULL) {
+			openfile_decref(old);
+		}
+	}
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	int i;
+
+	spinlock_acquire(&ft->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			spinlock_release(&ft->ft_lock);
+			*fd = i;
+			return 0;
+		}
+	}
+	spinlock_release(&ft->ft_lock);
+	return EMFILE;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	if (of == NULL) {
+		spinlock_release(&ft->ft_lock);
+		return EBADF;
+	}
+	openfile_incref(of);
+	spinlock_release(&ft->ft_lock);
+
+	*ret = of;
+	return 0;
+}
+
+int
+filetable_remove(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	ft->ft_files[fd] = NULL;
+	spinlock_release(&ft->ft_lock);
+
+	if (of == NULL) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+int
+filetable_setfd(struct filetable *ft, int fd, struct openfile *of,
+		struct openfile **oldret)
+{
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	openfile_incref(of);
+	spinlock_acquire(&ft->ft_lock);
+	*oldret = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+	spinlock_release(&ft->ft_lock);
+	return 0;
+}
@@ -8,53 +8,305 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <file.h>
+#include <pipe.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
- *
- * You will need to improve this implementation
+ * File system calls. Descriptors live in curproc->p_filetable; see
+ * file.h for how open files are shared and locked.
  */
 
+/* handler for open() system call */
 int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
 {
+  char *path;
+  struct openfile *of;
+  int fd, result;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr((const_userptr_t)upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  result = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+
+  result = filetable_place(curproc->p_filetable, of, &fd);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+
+  *retval = fd;
+  return 0;
+}
+
+/*
+ * Common code for read and write. The transfer goes straight
+ * between the file and the user buffer, with no kernel bounce
+ * buffer. Only seekable files take the offset lock.
+ */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, size_t nbytes, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
   struct iovec iov;
   struct uio u;
+  struct stat st;
+  bool seekable;
   int res;
 
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
-  }
   KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
   KASSERT(curproc->p_addrspace != NULL);
 
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  if ((rw == UIO_READ && of->of_accmode == O_WRONLY) ||
+      (rw == UIO_WRITE && of->of_accmode == O_RDONLY)) {
+    openfile_decref(of);
+    return EBADF;
+  }
+
+  seekable = of->of_seekable;
+  if (seekable) {
+    lock_acquire(of->of_offsetlock);
+    if (rw == UIO_WRITE && of->of_append) {
+      res = VOP_STAT(of->of_vnode, &st);
+      if (res) {
+        goto out;
+      }
+      of->of_offset = st.st_size;
+    }
+  }
+
   /* set up a uio structure to refer to the user program's buffer (ubuf) */
   iov.iov_ubase = ubuf;
   iov.iov_len = nbytes;
   u.uio_iov = &iov;
   u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
+  u.uio_offset = seekable ? of->of_offset : 0;
   u.uio_resid = nbytes;
   u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
+  u.uio_rw = rw;
   u.uio_space = curproc->p_addrspace;
 
-  res = VOP_WRITE(curproc->console,&u);
+  if (rw == UIO_READ) {
+    res = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    res = VOP_WRITE(of->of_vnode, &u);
+  }
   if (res) {
-    return res;
+    goto out;
+  }
+  if (seekable) {
+    of->of_offset = u.uio_offset;
   }
 
-  /* pass back the number of bytes actually written */
+  /* pass back the number of bytes actually transferred */
   *retval = nbytes - u.uio_resid;
   KASSERT(*retval >= 0);
+
+ out:
+  if (seekable) {
+    lock_release(of->of_offsetlock);
+  }
+  openfile_decref(of);
+  return res;
+}
+
+/* handler for read() system call */
+int
+sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, UIO_READ, retval);
+}
+
+/* handler for write() system call */
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+}
+
+/* handler for lseek() system call */
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  if (!of->of_seekable) {
+    openfile_decref(of);
+    return ESPIPE;
+  }
+
+  lock_acquire(of->of_offsetlock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(of->of_vnode, &st);
+    if (res) {
+      goto out;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    res = EINVAL;
+    goto out;
+  }
+  if (newpos < 0) {
+    res = EINVAL;
+    goto out;
+  }
+  res = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (res) {
+    goto out;
+  }
+  of->of_offset = newpos;
+  *retval = newpos;
+
+ out:
+  lock_release(of->of_offsetlock);
+  openfile_decref(of);
+  return res;
+}
+
+/* handler for close() system call */
+int
+sys_close(int fdesc)
+{
+  struct openfile *of;
+  int res;
+
+  res = filetable_remove(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+/* handler for dup2() system call */
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *old;
+  int res;
+
+  res = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (res) {
+    return res;
+  }
+  if (oldfd == newfd) {
+    openfile_decref(of);
+    *retval = newfd;
+    return 0;
+  }
+
+  res = filetable_setfd(curproc->p_filetable, newfd, of, &old);
+  openfile_decref(of);
+  if (res) {
+    return res;
+  }
+  if (old != NULL) {
+    openfile_decref(old);
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/*
+ * Take fds[0] and fds[1] back out of the file table and drop them.
+ * For undoing sys_pipe.
+ */
+static
+void
+pipe_unplace(int fds[2], int n)
+{
+  struct openfile *of;
+  int i;
+
+  for (i=0; i<n; i++) {
+    if (filetable_remove(curproc->p_filetable, fds[i], &of) == 0) {
+      openfile_decref(of);
+    }
+  }
+}
+
+/* handler for pipe() system call */
+int
+sys_pipe(userptr_t ufds)
+{
+  struct vnode *rv, *wv;
+  struct openfile *rof, *wof;
+  int fds[2];
+  int res;
+
+  res = pipe_create(&rv, &wv);
+  if (res) {
+    return res;
+  }
+  res = openfile_fromvnode(rv, O_RDONLY, &rof);
+  if (res) {
+    vfs_close(rv);
+    vfs_close(wv);
+    return res;
+  }
+  res = openfile_fromvnode(wv, O_WRONLY, &wof);
+  if (res) {
+    openfile_decref(rof);
+    vfs_close(wv);
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, rof, &fds[0]);
+  if (res) {
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return res;
+  }
+  res = filetable_place(curproc->p_filetable, wof, &fds[1]);
+  if (res) {
+    pipe_unplace(fds, 1);
+    openfile_decref(wof);
+    return res;
+  }
+
+  res = copyout(fds, ufds, sizeof(fds));
+  if (res) {
+    pipe_unplace(fds, 2);
+    return res;
+  }
   return 0;
 }
@@ -2,6 +2,8 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
@@ -15,6 +17,9 @@
 #include <vm.h>
 #include <vfs.h>
 #include <test.h>
+#include <file.h>
+#include <uthread.h>
+#include <limits.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
 
@@ -23,33 +28,35 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
   // Step 1: Create process structure for child process
   struct proc *new_child = proc_create_runprogram(curproc->p_name);
   if (new_child == NULL) {
-    panic("The new (child) process is null!");
-    proc_destroy(new_child);
+    /* out of memory, or the PID table is full */
+    return ENPROC;
   }
   // Step 2: Create and copy address space
-  lock_acquire(new_child->pLock); 
-    int error = as_copy(curproc_getas(), &new_child->p_addrspace);
-  lock_release(new_child->pLock);
+  int error = as_copy(curproc_getas(), &new_child->p_addrspace);
 
   if (error != 0) {
     proc_destroy(new_child);
     panic("as_Copy: ENOMEM");
   }
 
-  // Step 3: Assign PID to child process (DONE IN PROC.C) and create the parent/child relationship
-  lock_acquire(curproc->pLock);
-    new_child->parent = curproc;
-  lock_release(curproc->pLock);
+  // Step 2b: Share the parent's open files
+  error = filetable_copy(curproc->p_filetable, &new_child->p_filetable);
+  if (error) {
+    as_destroy(new_child->p_addrspace);
+    new_child->p_addrspace = NULL;
+    proc_destroy(new_child);
+    return error;
+  }
 
+  // Step 3: Assign PID to child process (DONE IN PROC.C) and create the parent/child relationship
   // Step 4: Add to curproc's array of children
-  lock_acquire(curproc->pLock);
-    array_add(curproc->children, new_child, NULL);
-  lock_release(curproc->pLock);
+  proc_addchild(curproc, new_child);
 
   // Step 5: Create Thread for child process
   struct trapframe* tf_copy = kmalloc(sizeof(struct trapframe)); // Trapframe of parent may change by the time child access it
   memcpy(tf_copy, tf, sizeof(struct trapframe));
-  int err = thread_fork(new_child->p_name, new_child, (void *)&enter_forked_process, tf_copy, 0); //What is the last value used for?
+  // (the child keeps running on whichever user stack we're on)
+  int err = thread_fork(new_child->p_name, new_child, (void *)&enter_forked_process, tf_copy, curthread->t_ustack);
   if (err) {
     kfree(tf_copy);
     proc_destroy(new_child);
@@ -82,37 +89,42 @@ void sys__exit(int exitcode)
      an unused variable */
   //(void)exitcode;
 
+  /* stop our other threads, if any, before taking things apart */
+  uthread_single();
+
+  /* close our files now rather than when the parent collects us */
+  if (p->p_filetable != NULL) {
+    filetable_destroy(p->p_filetable);
+    p->p_filetable = NULL;
+  }
+
+  /* a spawned child that failed to load may not have an address space */
+  if (curproc->p_addrspace != NULL) {
+    as_deactivate();
+    /*
+     * clear p_addrspace before calling as_destroy. Otherwise if
+     * as_destroy sleeps (which is quite possible) when we
+     * come back we'll be calling as_activate on a
+     * half-destroyed address space. This tends to be
+     * messily fatal.
+     */
+    as = curproc_setas(NULL);
+    as_destroy(as);
+  }
+
   #if OPT_A2
-  lock_acquire(p->pLock);
-    p->zombie = true;
-    #if OPT_A3
-    if (exit_status == __WSTOPPED) {
-      p->exitCode = _MKWAIT_STOP(exitcode);
-    }
-    else {
-      p->exitCode = _MKWAIT_EXIT(exitcode);
-    }
-    #else
-    p->exitCode = _MKWAIT_EXIT(exitcode);
-    #endif
-  lock_release(p->pLock);
-
-  lock_acquire(p->pLock);
-    cv_signal(p->p_cv, p->pLock);
-  lock_release(p->pLock);
+  /* leave our status for the parent (or the reaper) and wake it up */
+  #if OPT_A3
+  if (exit_status == __WSTOPPED) {
+    proc_exit(p, _MKWAIT_STOP(exitcode));
+  }
+  else {
+    proc_exit(p, _MKWAIT_EXIT(exitcode));
+  }
+  #else
+  proc_exit(p, _MKWAIT_EXIT(exitcode));
+  #endif
   #endif
-
-  KASSERT(curproc->p_addrspace != NULL);
-  as_deactivate();
-  /*
-   * clear p_addrspace before calling as_destroy. Otherwise if
-   * as_destroy sleeps (which is quite possible) when we
-   * come back we'll be calling as_activate on a
-   * half-destroyed address space. This tends to be
-   * messily fatal.
-   */
-  as = curproc_setas(NULL);
-  as_destroy(as);
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
@@ -121,9 +133,8 @@ void sys__exit(int exitcode)
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
   #if OPT_A2
-  if (p->parent == NULL || p->parent->zombie){
-    proc_destroy(p);
-  }
+  /* nothing but the exit status outlives us (see proc_exit) */
+  proc_destroy(p);
   #endif
   
   thread_exit();
@@ -150,15 +161,28 @@ sys_getpid(pid_t *retval)
 //if child and dead, grab exit code and status and merge to singlue int value -> return from waitpid
 //child dead, grab exit code and done (destroy)
 
-//if child is alive go to sleep -parent sleep on childs cv, child calls exit, child signal cv to wake pare up who can grab exit staus, fully delete you and done
+//if child is alive go to sleep on our own cv; the child's exit leaves its status in the pid table and wakes us
 int
 sys_waitpid(pid_t pid,
 	    userptr_t status,
 	    int options,
 	    pid_t *retval)
+{
+  return sys_wait4(pid, status, options, NULL, retval);
+}
+
+/* waitpid, also handing back the child's resource usage if RUSAGE isn't NULL */
+int
+sys_wait4(pid_t pid,
+	  userptr_t status,
+	  int options,
+	  userptr_t rusage,
+	  pid_t *retval)
 {
   int exitstatus;
   int result;
+  struct usage usage;
+  struct rusage ru;
 
   /* this is just a stub implementation that always reports an
      exit status of 0, regardless of the actual exit status of
@@ -169,46 +193,23 @@ sys_waitpid(pid_t pid,
      Fix this!
   */
 
-  if (options != 0) {
+  if ((options & ~WNOHANG) != 0) {
     return(EINVAL);
   }
   
 
   #if OPT_A2
-  //find if parameter pid is a child of the current process
-  lock_acquire(curproc->pLock);
-  bool isChild = false;
-  struct proc *child;
-  for (unsigned int i = 0; i < array_num(curproc->children); i ++) {
-    child = array_get(curproc->children, i);
-    if (child->PID == pid ) {
-      isChild = true;
-      break;
-    }
-  }
-  lock_release(curproc->pLock);
-  if (isChild) {
-    
-      lock_acquire(child->pLock);
-      while (!child->zombie) {
-       cv_wait(child->p_cv, child->pLock);
-      }
-      lock_release(child->pLock);
-      exitstatus = child->exitCode;
-      lock_acquire(curproc->pLock);
-        struct proc *child_temp;
-        for (unsigned int i =0; i < array_num(curproc->children); i++) {
-          child_temp = array_get(curproc->children, i);
-          if (child_temp->PID == pid) {
-            array_remove(curproc->children, i);
-            break;
-          }
-        }
-      lock_release(curproc->pLock);
-      proc_destroy(child); 
+  //collect a child's status from the PID table; the child itself is long gone
+  pid_t donepid;
+  result = proc_wait(curproc, pid, (options & WNOHANG) != 0,
+                     &exitstatus, &donepid, &usage);
+  if (result) {
+    return result;
   }
-  else {
-    panic("Parent does not have children with pid");
+  if (donepid == 0) {
+    /* WNOHANG, and it's still running */
+    *retval = 0;
+    return(0);
   }
   #endif
 
@@ -216,10 +217,38 @@ sys_waitpid(pid_t pid,
   if (result) {
     return(result);
   }
+  #if OPT_A2
+  if (rusage != NULL) {
+    usage_torusage(&usage, &ru);
+    result = copyout(&ru, rusage, sizeof(ru));
+    if (result) {
+      return(result);
+    }
+  }
+  #else
+  (void)usage;
+  (void)ru;
+  (void)rusage;
+  #endif
   *retval = pid;
   return(0);
 }
 
+/* resource usage of this process (RUSAGE_SELF) or its waited-for children */
+int
+sys_getrusage(int who, userptr_t rusage)
+{
+  struct usage usage;
+  struct rusage ru;
+
+  if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+    return(EINVAL);
+  }
+  proc_getusage(curproc, who == RUSAGE_CHILDREN, &usage);
+  usage_torusage(&usage, &ru);
+  return copyout(&ru, rusage, sizeof(ru));
+}
+
 #if OPT_A2
 int sys_execv(const char * prog_name, char ** args)
 {
@@ -261,6 +290,13 @@ int sys_execv(const char * prog_name, char ** args)
   }
   args_kernel[args_count] = NULL;
 
+  //the new image starts with just this thread
+  uthread_single();
+  if (curproc->p_uthreads != NULL) {
+    uthreads_destroy(curproc->p_uthreads);
+    curproc->p_uthreads = NULL;
+  }
+
   //same as run_program
 
 	/* Open the file. */
@@ -330,6 +366,7 @@ int sys_execv(const char * prog_name, char ** args)
   //5. delete old add and free
 
   as_destroy(old_add);
+  curthread->t_ustack = 0;
   kfree(prog_kern);
 
   for (int i = 0; i <= args_count; i++) {
@@ -348,3 +385,230 @@ int sys_execv(const char * prog_name, char ** args)
 }
 #endif
 
+#if OPT_A2
+/*
+ * spawn: fork+execv in one step. The child never gets a copy of the
+ * parent's address space; it starts with none and runprogram_load
+ * builds one straight from the executable. The parent copies in the
+ * arguments and opens the file, so bad arguments and lookup errors
+ * come back from spawn itself. Anything that goes wrong after that
+ * happens in the child, which then exits with status 127 (as the
+ * shell reports a command that couldn't be run).
+ */
+
+#define SPAWN_FAILED 127
+
+struct spawninfo {
+  struct vnode *si_vnode;	/* the executable, already open */
+  char **si_args;		/* NULL-terminated, kernel copies */
+};
+
+static
+void
+spawn_freeargs(char **args)
+{
+  int i;
+
+  for (i = 0; args[i] != NULL; i++) {
+    kfree(args[i]);
+  }
+  kfree(args);
+}
+
+/*
+ * Copy in a NULL-terminated user argv. The total size of the strings
+ * is limited to ARG_MAX; each one goes through a PATH_MAX scratch
+ * buffer (to keep kmalloc out of multi-page allocations), so a
+ * single argument can't be longer than that.
+ */
+static
+int
+spawn_copyinargs(userptr_t uargs, char ***ret)
+{
+  userptr_t uarg;
+  char **args, **newargs;
+  char *buf;
+  size_t len, total;
+  int count, max, result;
+
+  max = 16;
+  args = kmalloc(max * sizeof(char *));
+  if (args == NULL) {
+    return ENOMEM;
+  }
+  args[0] = NULL;
+
+  buf = kmalloc(PATH_MAX);
+  if (buf == NULL) {
+    kfree(args);
+    return ENOMEM;
+  }
+
+  count = 0;
+  total = 0;
+  while (1) {
+    result = copyin(uargs + count * sizeof(userptr_t), &uarg, sizeof(uarg));
+    if (result) {
+      goto fail;
+    }
+    if (uarg == NULL) {
+      break;
+    }
+    len = ARG_MAX - total;
+    if (len > PATH_MAX) {
+      len = PATH_MAX;
+    }
+    result = copyinstr(uarg, buf, len, &len);
+    if (result) {
+      if (result == ENAMETOOLONG) {
+        result = E2BIG;
+      }
+      goto fail;
+    }
+    total += len;
+
+    if (count + 1 >= max) {
+      newargs = kmalloc(2 * max * sizeof(char *));
+      if (newargs == NULL) {
+        result = ENOMEM;
+        goto fail;
+      }
+      memcpy(newargs, args, max * sizeof(char *));
+      kfree(args);
+      args = newargs;
+      max *= 2;
+    }
+    args[count] = kstrdup(buf);
+    if (args[count] == NULL) {
+      result = ENOMEM;
+      goto fail;
+    }
+    args[++count] = NULL;
+  }
+
+  kfree(buf);
+  *ret = args;
+  return 0;
+
+ fail:
+  kfree(buf);
+  spawn_freeargs(args);
+  return result;
+}
+
+/* first code run by the spawned child's thread */
+static
+void
+spawn_entry(void *data, unsigned long unused)
+{
+  struct spawninfo *si = data;
+  vaddr_t entrypoint, stackptr;
+  userptr_t argv;
+  int argc, result;
+
+  (void)unused;
+
+  result = runprogram_load(si->si_vnode, si->si_args, &argc, &argv,
+                           &stackptr, &entrypoint);
+  spawn_freeargs(si->si_args);
+  kfree(si);
+  if (result) {
+#if OPT_A3
+    sys__exit(SPAWN_FAILED, __WEXITED);
+#else
+    sys__exit(SPAWN_FAILED);
+#endif
+  }
+
+  enter_new_process(argc, argv, stackptr, entrypoint);
+  panic("enter_new_process returned\n");
+}
+
+int
+sys_spawn(userptr_t uprog, userptr_t uargs, pid_t *retval)
+{
+  struct spawninfo *si;
+  struct proc *child;
+  char *prog;
+  int result;
+
+  si = kmalloc(sizeof(*si));
+  if (si == NULL) {
+    return ENOMEM;
+  }
+
+  // Step 1: Copy in the program name and arguments
+  prog = kmalloc(PATH_MAX);
+  if (prog == NULL) {
+    kfree(si);
+    return ENOMEM;
+  }
+  result = copyinstr(uprog, prog, PATH_MAX, NULL);
+  if (result) {
+    kfree(prog);
+    kfree(si);
+    return result;
+  }
+  result = spawn_copyinargs(uargs, &si->si_args);
+  if (result) {
+    kfree(prog);
+    kfree(si);
+    return result;
+  }
+
+  // Step 2: Open the executable here so lookup errors go to the caller
+  result = vfs_open(prog, O_RDONLY, 0, &si->si_vnode);
+  kfree(prog);
+  if (result) {
+    spawn_freeargs(si->si_args);
+    kfree(si);
+    return result;
+  }
+
+  // Step 3: Create the child with the parent's files but no address space
+  child = proc_create_runprogram(si->si_args[0] != NULL ?
+                                 si->si_args[0] : curproc->p_name);
+  if (child == NULL) {
+    result = ENPROC;
+    goto fail;
+  }
+  result = filetable_copy(curproc->p_filetable, &child->p_filetable);
+  if (result) {
+    proc_destroy(child);
+    goto fail;
+  }
+  proc_addchild(curproc, child);
+
+  // Step 4: Start it; the child loads the program itself
+  *retval = child->PID;
+  result = thread_fork(child->p_name, child, spawn_entry, si, 0);
+  if (result) {
+    /* proc_destroy unlinks it from us */
+    proc_destroy(child);
+    goto fail;
+  }
+  return 0;
+
+ fail:
+  vfs_close(si->si_vnode);
+  spawn_freeargs(si->si_args);
+  kfree(si);
+  return result;
+}
+#endif
+
+/* set the calling thread's cpu affinity mask (bit N = cpu N) */
+int
+sys_setaffinity(uint32_t mask)
+{
+  return thread_set_cpumask(mask);
+}
+
+/* get the calling thread's cpu affinity mask */
+int
+sys_getaffinity(userptr_t mask)
+{
+  uint32_t kmask = thread_get_cpumask();
+
+  return copyout(&kmask, mask, sizeof(kmask));
+}
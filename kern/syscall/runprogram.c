@@ -44,32 +44,26 @@
 #include <vfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <file.h>
 
 #include <copyinout.h>
 
+#if OPT_A2
 /*
- * Load program "progname" and start running it in usermode.
- * Does not return except on error.
- *
- * Calls vfs_open on progname and thus may destroy it.
+ * Build a fresh address space for curproc from the executable V,
+ * which has already been opened, and copy ARGS onto its user stack.
+ * Closes V either way. On success the old address space (if any) has
+ * been destroyed and *argc, *argv, *stackptr and *entrypoint are ready
+ * for enter_new_process. Shared by runprogram and spawn(), neither of
+ * which has anything in the old address space worth keeping.
  */
-#if OPT_A2
 int
-runprogram(char *progname, char ** args)
-#else
-runprogram(char *progname)
-#endif
+runprogram_load(struct vnode *v, char **args, int *argc, userptr_t *argv,
+		vaddr_t *stackptr, vaddr_t *entrypoint)
 {
-    struct addrspace *as;
-    struct vnode *v;
-    vaddr_t entrypoint, stackptr;
-	int result;
-
-	/* Open the file. */
-	result = vfs_open(progname, O_RDONLY, 0, &v);
-	if (result) {
-		return result;
-	}
+	struct addrspace *as, *old_add;
+	vaddr_t *args_ptr;
+	int args_count, i, result;
 
 	/* Create a new address space. */
 	as = as_create();
@@ -79,11 +73,11 @@ runprogram(char *progname)
 	}
 
 	/* Switch to it and activate it. */
-	struct addrspace * old_add = curproc_setas(as);
+	old_add = curproc_setas(as);
 	as_activate();
 
 	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
+	result = load_elf(v, entrypoint);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
@@ -94,59 +88,158 @@ runprogram(char *progname)
 	vfs_close(v);
 
 	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
+	result = as_define_stack(as, stackptr);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		return result;
 	}
 
-#if OPT_A2
-
   // count number of args
 
-  int args_count = 0;
+  args_count = 0;
   while (args[args_count] != NULL) {
       args_count++;
   }
 
   // copy args to user stack
 
-  vaddr_t *args_ptr = kmalloc((args_count + 1) * sizeof(vaddr_t));
+  args_ptr = kmalloc((args_count + 1) * sizeof(vaddr_t));
+  if (args_ptr == NULL) {
+	return ENOMEM;
+  }
 
-  for (int i = args_count - 1; i >= 0; i--) {
+  for (i = args_count - 1; i >= 0; i--) {
 	size_t args_size =  ROUNDUP(strlen(args[i]) + 1, 4);
-	stackptr -= args_size;
-	result = copyoutstr((void *) args[i], (userptr_t) stackptr, args_size, NULL);
+	*stackptr -= args_size;
+	result = copyoutstr((void *) args[i], (userptr_t) *stackptr, args_size, NULL);
 	if (result) {
+		kfree(args_ptr);
 		return result;
 	}
-	args_ptr[i] = stackptr;
+	args_ptr[i] = *stackptr;
   }
   
   args_ptr[args_count] = (vaddr_t) NULL;
 
  
-  for (int i = args_count; i >= 0; i--) {
+  for (i = args_count; i >= 0; i--) {
 	size_t args_ptr_size = sizeof(vaddr_t);
-	stackptr -= args_ptr_size;
-	result = copyout((void *) &args_ptr[i], (userptr_t) stackptr, args_ptr_size);
+	*stackptr -= args_ptr_size;
+	result = copyout((void *) &args_ptr[i], (userptr_t) *stackptr, args_ptr_size);
 	if (result) {
+	  kfree(args_ptr);
 	  return result;
 	}
   }
+  kfree(args_ptr);
 
   //NOW IT IS SAFE TO DELETE OLD ADDRESS
-  as_destroy(old_add);
-  
-  enter_new_process(args_count, (userptr_t) stackptr, stackptr, entrypoint);
-  
-  #else
+  if (old_add != NULL) {
+	as_destroy(old_add);
+  }
+
+  *argc = args_count;
+  *argv = (userptr_t) *stackptr;
+  return 0;
+}
+#endif
+
+/*
+ * Load program "progname" and start running it in usermode.
+ * Does not return except on error.
+ *
+ * Calls vfs_open on progname and thus may destroy it.
+ */
+#if OPT_A2
+int
+runprogram(char *progname, char ** args)
+{
+	struct vnode *v;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc;
+	int result;
+
+	/* Give the process a file table with stdin/stdout/stderr. */
+	if (curproc->p_filetable == NULL) {
+		curproc->p_filetable = filetable_create();
+		if (curproc->p_filetable == NULL) {
+			return ENOMEM;
+		}
+	}
+	result = filetable_stdio(curproc->p_filetable);
+	if (result) {
+		return result;
+	}
+
+	/* Open the file. */
+	result = vfs_open(progname, O_RDONLY, 0, &v);
+	if (result) {
+		return result;
+	}
+
+	/* Load it; this consumes v. */
+	result = runprogram_load(v, args, &argc, &argv, &stackptr, &entrypoint);
+	if (result) {
+		return result;
+	}
+
+	enter_new_process(argc, argv, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+	return EINVAL;
+}
+#else
+int
+runprogram(char *progname)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	vaddr_t entrypoint, stackptr;
+	int result;
+
+	/* Open the file. */
+	result = vfs_open(progname, O_RDONLY, 0, &v);
+	if (result) {
+		return result;
+	}
+
+	/* Create a new address space. */
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	/* Switch to it and activate it. */
+	curproc_setas(as);
+	as_activate();
+
+	/* Load the executable. */
+	result = load_elf(v, &entrypoint);
+	if (result) {
+		/* p_addrspace will go away when curproc is destroyed */
+		vfs_close(v);
+		return result;
+	}
+
+	/* Done with the file now. */
+	vfs_close(v);
+
+	/* Define the user stack in the address space */
+	result = as_define_stack(as, &stackptr);
+	if (result) {
+		/* p_addrspace will go away when curproc is destroyed */
+		return result;
+	}
+
 	/* Warp to user mode. */
 	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
 			  stackptr, entrypoint);
-  #endif
 
-  /* enter_new_process does not return. */
-  panic("enter_new_process returned\n");
-  return EINVAL;
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+	return EINVAL;
 }
+#endif
@@ -0,0 +1,319 @@
+/*
+ * Threads of multithreaded user processes: thread_create, thread_exit
+ * and thread_join, and taking a process back down to one thread for
+ * _exit and execv. See uthread.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <uthread.h>
+#include "opt-A3.h"
+
+/* where a new thread starts in user mode */
+struct uthread_start {
+	vaddr_t ts_entry;		/* libc's start routine */
+	vaddr_t ts_func;		/* its arguments */
+	vaddr_t ts_arg;
+	vaddr_t ts_stack;		/* top of the thread's stack */
+};
+
+/*
+ * Make the uthreads for curproc, which is running only curthread.
+ */
+static
+struct uthreads *
+uthreads_create(void)
+{
+	struct uthreads *ub;
+	unsigned i;
+
+	ub = kmalloc(sizeof(*ub));
+	if (ub == NULL) {
+		return NULL;
+	}
+	ub->ub_lock = lock_create("uthreads");
+	if (ub->ub_lock == NULL) {
+		kfree(ub);
+		return NULL;
+	}
+	ub->ub_cv = cv_create("uthreads");
+	if (ub->ub_cv == NULL) {
+		lock_destroy(ub->ub_lock);
+		kfree(ub);
+		return NULL;
+	}
+	for (i=0; i<AS_MAXSTACKS; i++) {
+		ub->ub_slots[i].us_state = UT_FREE;
+		ub->ub_slots[i].us_tid = i + 1;
+		ub->ub_slots[i].us_code = 0;
+	}
+	ub->ub_slots[curthread->t_ustack].us_state = UT_RUNNING;
+	ub->ub_nrunning = 1;
+	ub->ub_nthreads = 1;
+	ub->ub_exiting = false;
+	return ub;
+}
+
+void
+uthreads_destroy(struct uthreads *ub)
+{
+	KASSERT(ub->ub_nthreads <= 1);
+	cv_destroy(ub->ub_cv);
+	lock_destroy(ub->ub_lock);
+	kfree(ub);
+}
+
+/*
+ * Leave the process for good. The caller has already given up its
+ * place in ub_nrunning.
+ */
+static
+void
+uthread_detach(struct uthreads *ub)
+{
+	proc_remthread(curthread);
+
+	/* ub may be freed as soon as we let go of the lock */
+	lock_acquire(ub->ub_lock);
+	KASSERT(ub->ub_nthreads > 1);
+	ub->ub_nthreads--;
+	cv_broadcast(ub->ub_cv, ub->ub_lock);
+	lock_release(ub->ub_lock);
+
+	thread_exit();
+}
+
+/*
+ * Exit because the process is going down to one thread.
+ */
+static
+void
+uthread_die(struct uthreads *ub)
+{
+	lock_acquire(ub->ub_lock);
+	KASSERT(ub->ub_exiting);
+	ub->ub_slots[curthread->t_ustack].us_state = UT_EXITED;
+	ub->ub_nrunning--;
+	lock_release(ub->ub_lock);
+
+	uthread_detach(ub);
+}
+
+void
+uthread_single(void)
+{
+	struct proc *p = curproc;
+	struct uthreads *ub = p->p_uthreads;
+	struct thread *t;
+	unsigned i, num;
+
+	if (ub == NULL) {
+		return;
+	}
+
+	lock_acquire(ub->ub_lock);
+	if (ub->ub_exiting) {
+		/* someone else is exiting or execing; they win */
+		lock_release(ub->ub_lock);
+		uthread_die(ub);
+	}
+	ub->ub_exiting = true;
+	cv_broadcast(ub->ub_cv, ub->ub_lock);
+
+	/* get the others out of waits that might never end (pipes etc.) */
+	spinlock_acquire(&p->p_lock);
+	num = threadarray_num(&p->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&p->p_threads, i);
+		if (t != curthread) {
+			thread_interrupt(t);
+		}
+	}
+	spinlock_release(&p->p_lock);
+
+	while (ub->ub_nthreads > 1) {
+		cv_wait(ub->ub_cv, ub->ub_lock);
+	}
+	lock_release(ub->ub_lock);
+}
+
+void
+uthread_checkexit(void)
+{
+	struct proc *p = curproc;
+
+	if (p == NULL || p == kproc || p->p_uthreads == NULL) {
+		return;
+	}
+	/* unlocked peek; ub_exiting never goes back to false */
+	if (p->p_uthreads->ub_exiting) {
+		uthread_die(p->p_uthreads);
+	}
+}
+
+/* first code run by a new user thread */
+static
+void
+uthread_entry(void *data, unsigned long slot)
+{
+	struct uthread_start ts = *(struct uthread_start *)data;
+
+	kfree(data);
+	curthread->t_ustack = slot;
+	enter_new_process((int)ts.ts_func, (userptr_t)ts.ts_arg,
+			  ts.ts_stack, ts.ts_entry);
+	panic("enter_new_process returned\n");
+}
+
+int
+sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+		  int *retval)
+{
+	struct proc *p = curproc;
+	struct uthreads *ub;
+	struct uthread_start *ts;
+	unsigned slot;
+	int result;
+
+	if (p->p_uthreads == NULL) {
+		/* we're the only thread, so no race here */
+		p->p_uthreads = uthreads_create();
+		if (p->p_uthreads == NULL) {
+			return ENOMEM;
+		}
+	}
+	ub = p->p_uthreads;
+
+	ts = kmalloc(sizeof(*ts));
+	if (ts == NULL) {
+		return ENOMEM;
+	}
+	ts->ts_entry = (vaddr_t)entry;
+	ts->ts_func = (vaddr_t)func;
+	ts->ts_arg = (vaddr_t)arg;
+
+	/* Claim a slot */
+	lock_acquire(ub->ub_lock);
+	for (slot=0; slot<AS_MAXSTACKS; slot++) {
+		if (ub->ub_slots[slot].us_state == UT_FREE) {
+			break;
+		}
+	}
+	if (slot == AS_MAXSTACKS) {
+		lock_release(ub->ub_lock);
+		kfree(ts);
+		return EAGAIN;
+	}
+	ub->ub_slots[slot].us_state = UT_RUNNING;
+	ub->ub_nrunning++;
+	ub->ub_nthreads++;
+	*retval = ub->ub_slots[slot].us_tid;
+	lock_release(ub->ub_lock);
+
+	/* Get it a stack (left over from an earlier thread, maybe) */
+	if (slot == 0) {
+		result = as_define_stack(curproc_getas(), &ts->ts_stack);
+	}
+	else {
+		result = as_define_threadstack(curproc_getas(), slot,
+					       &ts->ts_stack);
+	}
+	if (result == 0) {
+		result = thread_fork(curthread->t_name, p, uthread_entry,
+				     ts, slot);
+	}
+	if (result) {
+		kfree(ts);
+		lock_acquire(ub->ub_lock);
+		ub->ub_slots[slot].us_state = UT_FREE;
+		ub->ub_nrunning--;
+		ub->ub_nthreads--;
+		cv_broadcast(ub->ub_cv, ub->ub_lock);
+		lock_release(ub->ub_lock);
+		return result;
+	}
+	return 0;
+}
+
+void
+sys_thread_exit(int code)
+{
+	struct uthreads *ub = curproc->p_uthreads;
+
+	if (ub != NULL) {
+		lock_acquire(ub->ub_lock);
+		if (ub->ub_nrunning > 1 || ub->ub_exiting) {
+			ub->ub_slots[curthread->t_ustack].us_state = UT_EXITED;
+			ub->ub_slots[curthread->t_ustack].us_code = code;
+			ub->ub_nrunning--;
+			cv_broadcast(ub->ub_cv, ub->ub_lock);
+			lock_release(ub->ub_lock);
+			uthread_detach(ub);
+			/* not reached */
+		}
+		lock_release(ub->ub_lock);
+	}
+
+	/* the last thread out takes the process with it */
+#if OPT_A3
+	sys__exit(code, __WEXITED);
+#else
+	sys__exit(code);
+#endif
+}
+
+int
+sys_thread_join(int tid, userptr_t code)
+{
+	struct uthreads *ub = curproc->p_uthreads;
+	unsigned slot;
+	int kcode;
+
+	if (ub == NULL || tid < 1) {
+		return ESRCH;
+	}
+	slot = (tid - 1) % AS_MAXSTACKS;
+
+	lock_acquire(ub->ub_lock);
+	if (ub->ub_slots[slot].us_tid != tid ||
+	    ub->ub_slots[slot].us_state == UT_FREE) {
+		lock_release(ub->ub_lock);
+		return ESRCH;
+	}
+	if (slot == curthread->t_ustack) {
+		lock_release(ub->ub_lock);
+		return EINVAL;
+	}
+	while (ub->ub_slots[slot].us_tid == tid &&
+	       ub->ub_slots[slot].us_state == UT_RUNNING) {
+		if (ub->ub_exiting) {
+			lock_release(ub->ub_lock);
+			uthread_die(ub);
+		}
+		cv_wait(ub->ub_cv, ub->ub_lock);
+	}
+	if (ub->ub_slots[slot].us_tid != tid ||
+	    ub->ub_slots[slot].us_state != UT_EXITED) {
+		/* another thread joined it first */
+		lock_release(ub->ub_lock);
+		return ESRCH;
+	}
+	kcode = ub->ub_slots[slot].us_code;
+	ub->ub_slots[slot].us_state = UT_FREE;
+	ub->ub_slots[slot].us_tid += AS_MAXSTACKS;
+	lock_release(ub->ub_lock);
+
+	if (code != NULL) {
+		return copyout(&kcode, code, sizeof(kcode));
+	}
+	return 0;
+}
@@ -31,9 +31,11 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 #define NTHREADS  8
@@ -144,3 +146,80 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Thread creation benchmark: fork and reap lots of threads that
+ * exit immediately, and report threads per second. This mostly
+ * measures thread_fork/thread_exit/exorcise overhead, so it shows the
+ * effect of the per-cpu thread cache.
+ */
+
+#define TTB_DEFAULT	2000
+#define TTB_BATCH	16
+
+static
+void
+nullthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+int
+threadbench(int nargs, char **args)
+{
+	time_t before_sec, after_sec, secs;
+	uint32_t before_nsec, after_nsec, nsecs;
+	uint64_t usecs;
+	int total, done, batch, i, result;
+
+	if (nargs > 2) {
+		kprintf("Usage: tt [numthreads]\n");
+		return EINVAL;
+	}
+	total = nargs == 2 ? atoi(args[1]) : TTB_DEFAULT;
+	if (total <= 0) {
+		kprintf("tt: invalid number of threads %d\n", total);
+		return EINVAL;
+	}
+
+	init_sem();
+	kprintf("Forking %d threads...\n", total);
+
+	/*
+	 * Go in batches, waiting for each to finish, so the dead
+	 * threads get reaped (and cached) before the next batch.
+	 */
+	gettime(&before_sec, &before_nsec);
+	for (done = 0; done < total; done += batch) {
+		batch = total - done < TTB_BATCH ? total - done : TTB_BATCH;
+		for (i=0; i<batch; i++) {
+			result = thread_fork("threadbench", NULL,
+					     nullthread, NULL, i);
+			if (result) {
+				panic("threadbench: thread_fork failed %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<batch; i++) {
+			P(tsem);
+		}
+	}
+	gettime(&after_sec, &after_nsec);
+
+	getinterval(before_sec, before_nsec, after_sec, after_nsec,
+		    &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	kprintf("%d threads in %lu.%06lu seconds", total,
+		(unsigned long)(usecs / 1000000),
+		(unsigned long)(usecs % 1000000));
+	if (usecs > 0) {
+		kprintf(", %lu threads/sec",
+			(unsigned long)((uint64_t)total * 1000000 / usecs));
+	}
+	kprintf("\n");
+
+	return 0;
+}
@@ -113,11 +113,21 @@ timerclock(void)
  * code.
  */
 void
-hardclock(void)
+hardclock(bool usermode)
 {
 	/*
-	 * Collect statistics here as desired.
+	 * Collect statistics here as desired. (The profiler's samples
+	 * are taken by the caller, which has the trapframe; see
+	 * prof.h.)
 	 */
+	if (!curcpu->c_isidle) {
+		if (usermode) {
+			curthread->t_usage.u_uticks++;
+		}
+		else {
+			curthread->t_usage.u_sticks++;
+		}
+	}
 
 	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
@@ -0,0 +1,303 @@
+/*
+ * Kernel event tracing: per-cpu rings of binary events. See ktrace.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <ktrace.h>
+
+#define KTRACE_MAXCPUS	32		/* as for affinity masks */
+
+struct ktrace_ring {
+	unsigned kr_next;		/* events ever logged here */
+	struct ktrace_event kr_events[KTRACE_NEVENTS];
+};
+
+static struct ktrace_ring *ktrace_rings[KTRACE_MAXCPUS];
+
+/*
+ * Whether to log. Only ever read unlocked; turning it off doesn't
+ * stop an event another cpu is already in the middle of logging, so
+ * a dump may show one garbled event per cpu at the very end.
+ */
+static volatile bool ktrace_on = true;
+
+static const char *const ktrace_typenames[KT_NTYPES] = KTRACE_TYPENAMES;
+
+void
+ktrace_cpuinit(unsigned cpunum)
+{
+	struct ktrace_ring *kr;
+
+	KASSERT(cpunum < KTRACE_MAXCPUS);
+	kr = kmalloc(sizeof(*kr));
+	if (kr == NULL) {
+		panic("ktrace_cpuinit: Out of memory\n");
+	}
+	bzero(kr, sizeof(*kr));
+	ktrace_rings[cpunum] = kr;
+}
+
+void
+ktrace_log(unsigned type, uint32_t arg0, uint32_t arg1, const char *name)
+{
+	struct ktrace_ring *kr;
+	struct ktrace_event *ke;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+	int spl;
+
+	if (!ktrace_on) {
+		return;
+	}
+
+	spl = splhigh();
+	kr = ktrace_rings[curcpu->c_number];
+	if (kr == NULL) {
+		/* cpu still starting up */
+		splx(spl);
+		return;
+	}
+	ke = &kr->kr_events[kr->kr_next % KTRACE_NEVENTS];
+	kr->kr_next++;
+
+	gettime(&secs, &nsecs);
+	ke->ke_secs = secs;
+	ke->ke_nsecs = nsecs;
+	ke->ke_type = type;
+	ke->ke_cpu = curcpu->c_number;
+	ke->ke_thread = (uint32_t)(uintptr_t)curthread;
+	ke->ke_arg0 = arg0;
+	ke->ke_arg1 = arg1;
+	for (i=0; i<sizeof(ke->ke_name); i++) {
+		ke->ke_name[i] = (name != NULL) ? name[i] : 0;
+		if (ke->ke_name[i] == 0) {
+			break;
+		}
+	}
+	for (; i<sizeof(ke->ke_name); i++) {
+		ke->ke_name[i] = 0;
+	}
+	splx(spl);
+}
+
+void
+ktrace_enable(bool on)
+{
+	ktrace_on = on;
+}
+
+void
+ktrace_clear(void)
+{
+	bool was;
+	unsigned cpu;
+
+	was = ktrace_on;
+	ktrace_on = false;
+	for (cpu=0; cpu<KTRACE_MAXCPUS; cpu++) {
+		if (ktrace_rings[cpu] != NULL) {
+			ktrace_rings[cpu]->kr_next = 0;
+		}
+	}
+	ktrace_on = was;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reading the rings back, oldest event first.
+
+struct ktrace_cursor {
+	unsigned kc_pos[KTRACE_MAXCPUS];	/* next event per cpu */
+	unsigned kc_left;			/* events not yet returned */
+};
+
+static
+void
+ktrace_startread(struct ktrace_cursor *kc)
+{
+	struct ktrace_ring *kr;
+	unsigned cpu;
+
+	kc->kc_left = 0;
+	for (cpu=0; cpu<KTRACE_MAXCPUS; cpu++) {
+		kr = ktrace_rings[cpu];
+		if (kr == NULL) {
+			kc->kc_pos[cpu] = 0;
+		}
+		else if (kr->kr_next > KTRACE_NEVENTS) {
+			kc->kc_pos[cpu] = kr->kr_next - KTRACE_NEVENTS;
+			kc->kc_left += KTRACE_NEVENTS;
+		}
+		else {
+			kc->kc_pos[cpu] = 0;
+			kc->kc_left += kr->kr_next;
+		}
+	}
+}
+
+/*
+ * Return the earliest event not yet returned from any cpu, or NULL
+ * when there are no more.
+ */
+static
+const struct ktrace_event *
+ktrace_readnext(struct ktrace_cursor *kc)
+{
+	const struct ktrace_event *ke, *best;
+	struct ktrace_ring *kr;
+	unsigned cpu, bestcpu;
+
+	best = NULL;
+	bestcpu = 0;
+	for (cpu=0; cpu<KTRACE_MAXCPUS; cpu++) {
+		kr = ktrace_rings[cpu];
+		if (kr == NULL || kc->kc_pos[cpu] == kr->kr_next) {
+			continue;
+		}
+		ke = &kr->kr_events[kc->kc_pos[cpu] % KTRACE_NEVENTS];
+		if (best == NULL || ke->ke_secs < best->ke_secs ||
+		    (ke->ke_secs == best->ke_secs &&
+		     ke->ke_nsecs < best->ke_nsecs)) {
+			best = ke;
+			bestcpu = cpu;
+		}
+	}
+	if (best != NULL) {
+		kc->kc_pos[bestcpu]++;
+		kc->kc_left--;
+	}
+	return best;
+}
+
+static
+void
+ktrace_print(const struct ktrace_event *ke)
+{
+	char name[sizeof(ke->ke_name) + 1];
+
+	memcpy(name, ke->ke_name, sizeof(ke->ke_name));
+	name[sizeof(ke->ke_name)] = 0;
+
+	kprintf("%u.%09u cpu%u %08x %-8s ", ke->ke_secs, ke->ke_nsecs,
+		ke->ke_cpu, ke->ke_thread,
+		ke->ke_type < KT_NTYPES ? ktrace_typenames[ke->ke_type] : "?");
+	switch (ke->ke_type) {
+	    case KT_SWITCH:
+		kprintf("-> %08x %s\n", ke->ke_arg0, name);
+		break;
+	    case KT_SLEEP:
+	    case KT_WAKEALL:
+		kprintf("%s (%08x)\n", name, ke->ke_arg0);
+		break;
+	    case KT_WAKEONE:
+		kprintf("%s (%08x) -> %08x\n", name, ke->ke_arg0,
+			ke->ke_arg1);
+		break;
+	    case KT_SYSCALL:
+		kprintf("%u\n", ke->ke_arg0);
+		break;
+	    case KT_SYSRET:
+		kprintf("%u err %u\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	    case KT_VMFAULT:
+		kprintf("type %u addr 0x%08x\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	    case KT_DISKIO:
+		kprintf("%s sector %u\n", ke->ke_arg1 ? "write" : "read",
+			ke->ke_arg0);
+		break;
+	    case KT_DISKDONE:
+		kprintf("err %u\n", ke->ke_arg0);
+		break;
+	    default:
+		kprintf("%08x %08x\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	}
+}
+
+void
+ktrace_dump(unsigned count)
+{
+	struct ktrace_cursor kc;
+	const struct ktrace_event *ke;
+	bool was;
+
+	was = ktrace_on;
+	ktrace_on = false;
+
+	ktrace_startread(&kc);
+	while ((ke = ktrace_readnext(&kc)) != NULL) {
+		/* kc_left no longer counts ke */
+		if (count == 0 || kc.kc_left < count) {
+			ktrace_print(ke);
+		}
+	}
+
+	ktrace_on = was;
+}
+
+/* events per write when saving */
+#define KTRACE_SAVECHUNK	16
+
+int
+ktrace_save(char *path)
+{
+	struct ktrace_cursor kc;
+	struct ktrace_header kh;
+	struct ktrace_event buf[KTRACE_SAVECHUNK];
+	const struct ktrace_event *ke;
+	struct vnode *v;
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	unsigned n;
+	bool was;
+	int result;
+
+	was = ktrace_on;
+	ktrace_on = false;
+
+	result = vfs_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664, &v);
+	if (result) {
+		ktrace_on = was;
+		return result;
+	}
+
+	ktrace_startread(&kc);
+	kh.kh_magic = KTRACE_MAGIC;
+	kh.kh_nevents = kc.kc_left;
+	uio_kinit(&iov, &ku, &kh, sizeof(kh), 0, UIO_WRITE);
+	result = VOP_WRITE(v, &ku);
+	pos = ku.uio_offset;
+
+	while (result == 0 && kc.kc_left > 0) {
+		for (n=0; n<KTRACE_SAVECHUNK; n++) {
+			ke = ktrace_readnext(&kc);
+			if (ke == NULL) {
+				break;
+			}
+			buf[n] = *ke;
+		}
+		uio_kinit(&iov, &ku, buf, n * sizeof(buf[0]), pos, UIO_WRITE);
+		result = VOP_WRITE(v, &ku);
+		pos = ku.uio_offset;
+		if (result == 0 && ku.uio_resid != 0) {
+			result = ENOSPC;
+		}
+	}
+
+	vfs_close(v);
+	ktrace_on = was;
+	return result;
+}
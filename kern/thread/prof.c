@@ -0,0 +1,393 @@
+/*
+ * Sampling profiler. See prof.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <elf.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <prof.h>
+
+#define PROF_MAXCPUS	32		/* as for affinity masks */
+#define PROF_MAXTOP	32		/* most lines prof_print will show */
+
+/* end of the kernel text, from the linker script */
+extern char _etext[];
+
+/* kernel text starts with the exception handlers at the base of kseg0 */
+#define PROF_KBASE	MIPS_KSEG0
+#define PROF_KNBUCKETS	((((vaddr_t)_etext - PROF_KBASE) >> PROF_KSHIFT) + 1)
+
+struct prof_counts {
+	uint32_t pf_kernel;		/* ticks in the kernel, not idle */
+	uint32_t pf_user;		/* ticks in user mode */
+	uint32_t pf_idle;		/* ticks in the idle loop */
+	uint32_t pf_other;		/* PCs outside both histograms */
+	uint32_t *pf_kbuckets;		/* PROF_KNBUCKETS of them */
+	uint32_t pf_ubuckets[PROF_UNBUCKETS];
+};
+
+static struct prof_counts *prof_counts[PROF_MAXCPUS];
+static volatile bool prof_on;
+
+void
+prof_cpuinit(unsigned cpunum)
+{
+	struct prof_counts *pf;
+
+	KASSERT(cpunum < PROF_MAXCPUS);
+	pf = kmalloc(sizeof(*pf));
+	if (pf == NULL) {
+		panic("prof_cpuinit: Out of memory\n");
+	}
+	bzero(pf, sizeof(*pf));
+	pf->pf_kbuckets = kmalloc(PROF_KNBUCKETS * sizeof(uint32_t));
+	if (pf->pf_kbuckets == NULL) {
+		panic("prof_cpuinit: Out of memory\n");
+	}
+	bzero(pf->pf_kbuckets, PROF_KNBUCKETS * sizeof(uint32_t));
+	prof_counts[cpunum] = pf;
+}
+
+/*
+ * Called with interrupts off, from the timer interrupt.
+ */
+void
+prof_sample(vaddr_t pc, bool usermode)
+{
+	struct prof_counts *pf;
+	vaddr_t b;
+
+	if (!prof_on) {
+		return;
+	}
+	pf = prof_counts[curcpu->c_number];
+	if (pf == NULL) {
+		return;
+	}
+
+	if (usermode) {
+		pf->pf_user++;
+		b = (pc - PROF_UBASE) >> PROF_USHIFT;
+		if (pc >= PROF_UBASE && b < PROF_UNBUCKETS) {
+			pf->pf_ubuckets[b]++;
+		}
+		else {
+			pf->pf_other++;
+		}
+	}
+	else if (curcpu->c_isidle) {
+		pf->pf_idle++;
+	}
+	else {
+		pf->pf_kernel++;
+		b = (pc - PROF_KBASE) >> PROF_KSHIFT;
+		if (pc >= PROF_KBASE && b < PROF_KNBUCKETS) {
+			pf->pf_kbuckets[b]++;
+		}
+		else {
+			pf->pf_other++;
+		}
+	}
+}
+
+void
+prof_enable(bool on)
+{
+	prof_on = on;
+}
+
+void
+prof_reset(void)
+{
+	struct prof_counts *pf;
+	unsigned cpu;
+
+	for (cpu=0; cpu<PROF_MAXCPUS; cpu++) {
+		pf = prof_counts[cpu];
+		if (pf == NULL) {
+			continue;
+		}
+		pf->pf_kernel = pf->pf_user = pf->pf_idle = pf->pf_other = 0;
+		bzero(pf->pf_kbuckets, PROF_KNBUCKETS * sizeof(uint32_t));
+		bzero(pf->pf_ubuckets, sizeof(pf->pf_ubuckets));
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Printing.
+
+/* one line of output: a kernel function or a user range */
+struct prof_top {
+	uint32_t pt_count;
+	uint32_t pt_addr;
+	uint32_t pt_name;		/* string table offset, for functions */
+};
+
+/*
+ * Add an entry to TOP, which holds the N busiest so far, busiest
+ * first.
+ */
+static
+void
+prof_addtop(struct prof_top *top, unsigned n, uint32_t count,
+	    uint32_t addr, uint32_t name)
+{
+	unsigned i;
+
+	if (count == 0 || count <= top[n-1].pt_count) {
+		return;
+	}
+	for (i=n-1; i>0 && top[i-1].pt_count < count; i--) {
+		top[i] = top[i-1];
+	}
+	top[i].pt_count = count;
+	top[i].pt_addr = addr;
+	top[i].pt_name = name;
+}
+
+static
+uint32_t
+prof_kbucket(unsigned b)
+{
+	uint32_t sum;
+	unsigned cpu;
+
+	sum = 0;
+	for (cpu=0; cpu<PROF_MAXCPUS; cpu++) {
+		if (prof_counts[cpu] != NULL) {
+			sum += prof_counts[cpu]->pf_kbuckets[b];
+		}
+	}
+	return sum;
+}
+
+static
+uint32_t
+prof_ubucket(unsigned b)
+{
+	uint32_t sum;
+	unsigned cpu;
+
+	sum = 0;
+	for (cpu=0; cpu<PROF_MAXCPUS; cpu++) {
+		if (prof_counts[cpu] != NULL) {
+			sum += prof_counts[cpu]->pf_ubuckets[b];
+		}
+	}
+	return sum;
+}
+
+static
+int
+prof_readat(struct vnode *v, off_t pos, void *buf, size_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * Find the symbol table and its string table in the kernel image.
+ */
+static
+int
+prof_findsyms(struct vnode *v, Elf_Shdr *symtab, Elf_Shdr *strtab)
+{
+	Elf_Ehdr eh;
+	unsigned i;
+	int result;
+
+	result = prof_readat(v, 0, &eh, sizeof(eh));
+	if (result) {
+		return result;
+	}
+	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
+	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
+	    eh.e_ident[EI_MAG2] != ELFMAG2 ||
+	    eh.e_ident[EI_MAG3] != ELFMAG3 ||
+	    eh.e_shentsize != sizeof(Elf_Shdr)) {
+		return ENOEXEC;
+	}
+
+	for (i=0; i<eh.e_shnum; i++) {
+		result = prof_readat(v, eh.e_shoff + i * sizeof(Elf_Shdr),
+				     symtab, sizeof(*symtab));
+		if (result) {
+			return result;
+		}
+		if (symtab->sh_type == SHT_SYMTAB) {
+			if (symtab->sh_link >= eh.e_shnum) {
+				return ENOEXEC;
+			}
+			return prof_readat(v, eh.e_shoff +
+					   symtab->sh_link * sizeof(Elf_Shdr),
+					   strtab, sizeof(*strtab));
+		}
+	}
+	/* stripped */
+	return ENOEXEC;
+}
+
+/* symbols read per VOP_READ */
+#define PROF_SYMCHUNK	16
+
+/*
+ * Fill TOP with the N busiest kernel functions. Returns the number of
+ * samples charged to some function in *FOUND.
+ */
+static
+int
+prof_ktop(struct vnode *v, const Elf_Shdr *symtab,
+	  struct prof_top *top, unsigned n, uint32_t *found)
+{
+	Elf_Sym syms[PROF_SYMCHUNK];
+	unsigned nsyms, i, j, chunk;
+	uint32_t count, start, end, b;
+	int result;
+
+	*found = 0;
+	nsyms = symtab->sh_size / sizeof(Elf_Sym);
+	for (i=0; i<nsyms; i+=chunk) {
+		chunk = nsyms - i;
+		if (chunk > PROF_SYMCHUNK) {
+			chunk = PROF_SYMCHUNK;
+		}
+		result = prof_readat(v, symtab->sh_offset + i * sizeof(Elf_Sym),
+				     syms, chunk * sizeof(Elf_Sym));
+		if (result) {
+			return result;
+		}
+		for (j=0; j<chunk; j++) {
+			if (ELF32_ST_TYPE(syms[j].st_info) != STT_FUNC ||
+			    syms[j].st_size == 0 ||
+			    syms[j].st_value < PROF_KBASE ||
+			    syms[j].st_value >= (vaddr_t)_etext) {
+				continue;
+			}
+			/* buckets whose first byte is in the function */
+			start = syms[j].st_value - PROF_KBASE;
+			end = start + syms[j].st_size;
+			count = 0;
+			for (b = (start + (1 << PROF_KSHIFT) - 1) >> PROF_KSHIFT;
+			     b < PROF_KNBUCKETS && (b << PROF_KSHIFT) < end;
+			     b++) {
+				count += prof_kbucket(b);
+			}
+			*found += count;
+			prof_addtop(top, n, count, syms[j].st_value,
+				    syms[j].st_name);
+		}
+	}
+	return 0;
+}
+
+static
+void
+prof_printline(uint32_t count, uint32_t total, const char *what,
+	       uint32_t addr)
+{
+	uint32_t tenths;
+
+	tenths = total ? (uint64_t)count * 1000 / total : 0;
+	kprintf("%3u.%u%% %8u  0x%08x %s\n", tenths / 10, tenths % 10,
+		count, addr, what);
+}
+
+int
+prof_print(unsigned count, char *kernfile)
+{
+	struct prof_top top[PROF_MAXTOP];
+	Elf_Shdr symtab, strtab;
+	struct vnode *v;
+	uint32_t kernel, user, idle, other, found, total;
+	char name[64];
+	unsigned cpu, i, b;
+	bool was;
+	int result;
+
+	if (count == 0 || count > PROF_MAXTOP) {
+		count = PROF_MAXTOP;
+	}
+
+	/* hold still while we look */
+	was = prof_on;
+	prof_on = false;
+
+	kernel = user = idle = other = 0;
+	for (cpu=0; cpu<PROF_MAXCPUS; cpu++) {
+		if (prof_counts[cpu] != NULL) {
+			kernel += prof_counts[cpu]->pf_kernel;
+			user += prof_counts[cpu]->pf_user;
+			idle += prof_counts[cpu]->pf_idle;
+			other += prof_counts[cpu]->pf_other;
+		}
+	}
+	total = kernel + user + idle;
+	kprintf("%u samples: %u kernel, %u user, %u idle, %u unplaced\n",
+		total, kernel, user, idle, other);
+
+	/* Kernel functions */
+	result = vfs_open(kernfile, O_RDONLY, 0, &v);
+	if (result) {
+		prof_on = was;
+		return result;
+	}
+	result = prof_findsyms(v, &symtab, &strtab);
+	if (result == 0) {
+		bzero(top, sizeof(top));
+		result = prof_ktop(v, &symtab, top, count, &found);
+	}
+	if (result == 0) {
+		kprintf("kernel (%u samples in no function):\n",
+			kernel - found);
+		for (i=0; i<count && top[i].pt_count > 0; i++) {
+			name[0] = 0;
+			if (top[i].pt_name < strtab.sh_size) {
+				/* a short read near the end is fine */
+				prof_readat(v, strtab.sh_offset + top[i].pt_name,
+					    name, sizeof(name));
+				name[sizeof(name) - 1] = 0;
+			}
+			prof_printline(top[i].pt_count, total, name,
+				       top[i].pt_addr);
+		}
+	}
+	vfs_close(v);
+	if (result) {
+		prof_on = was;
+		return result;
+	}
+
+	/* User ranges */
+	bzero(top, sizeof(top));
+	for (b=0; b<PROF_UNBUCKETS; b++) {
+		prof_addtop(top, count, prof_ubucket(b),
+			    PROF_UBASE + (b << PROF_USHIFT), 0);
+	}
+	kprintf("user (by %u-byte range):\n", 1 << PROF_USHIFT);
+	for (i=0; i<count && top[i].pt_count > 0; i++) {
+		prof_printline(top[i].pt_count, total, "", top[i].pt_addr);
+	}
+
+	prof_on = was;
+	return 0;
+}
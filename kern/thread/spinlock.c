@@ -48,8 +48,14 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTATS
+	lk->lk_stats.ls_acquires = 0;
+	lk->lk_stats.ls_contended = 0;
+	lk->lk_stats.ls_spins = 0;
+#endif
 }
 
 /*
@@ -59,20 +65,23 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for it to come up.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	uint32_t spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +96,30 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Fetch-and-increment is the only atomic operation; after
+	 * that we only read lk_serving, which the holder alone
+	 * writes. Waiters are therefore served strictly in the order
+	 * they took tickets.
+	 */
+	ticket = spinlock_data_fetchinc(&lk->lk_next);
+	spins = 0;
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+		spins++;
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKSTATS
+	/* We hold the lock now, so plain updates are safe. */
+	lk->lk_stats.ls_acquires++;
+	if (spins > 0) {
+		lk->lk_stats.ls_contended++;
+		lk->lk_stats.ls_spins += spins;
+	}
+#else
+	(void)spins;
+#endif
 }
 
 /*
@@ -122,7 +134,9 @@ spinlock_release(struct spinlock *lk)
 	}
 
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* Only the holder writes lk_serving, so this needn't be atomic. */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +153,96 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+#if OPT_LOCKSTATS
+
+/*
+ * Registry of named locks for spinlock_stats_print. This is a fixed
+ * table so it can be used before kmalloc works and from inside
+ * kmalloc itself. The locks listed must live forever; entries are
+ * never removed.
+ */
+
+#define SPINLOCK_MAXSTATS 32
+
+static struct {
+	struct spinlock *ln_lock;
+	const char *ln_name;
+} spinlock_names[SPINLOCK_MAXSTATS];
+static unsigned spinlock_numnames;
+static struct spinlock spinlock_names_lock = SPINLOCK_INITIALIZER;
+
+void
+spinlock_stats_register(struct spinlock *lk, const char *name)
+{
+	unsigned i;
+
+	spinlock_acquire(&spinlock_names_lock);
+	for (i=0; i<spinlock_numnames; i++) {
+		if (spinlock_names[i].ln_lock == lk) {
+			spinlock_names[i].ln_name = name;
+			spinlock_release(&spinlock_names_lock);
+			return;
+		}
+	}
+	if (spinlock_numnames < SPINLOCK_MAXSTATS) {
+		spinlock_names[spinlock_numnames].ln_lock = lk;
+		spinlock_names[spinlock_numnames].ln_name = name;
+		spinlock_numnames++;
+	}
+	spinlock_release(&spinlock_names_lock);
+}
+
+/*
+ * The counters are read without taking the locks they belong to, so
+ * a busy lock's numbers may be slightly inconsistent with each other.
+ * That's fine for a diagnostic dump and it keeps us from perturbing
+ * the very locks we're trying to observe.
+ */
+void
+spinlock_stats_print(void)
+{
+	unsigned i, num;
+	struct spinlock *lk;
+	uint32_t acq, cont;
+	uint64_t spins;
+
+	spinlock_acquire(&spinlock_names_lock);
+	num = spinlock_numnames;
+	spinlock_release(&spinlock_names_lock);
+
+	kprintf("%-24s %10s %10s %12s %8s\n",
+		"lock", "acquires", "contended", "spins", "spins/c");
+	for (i=0; i<num; i++) {
+		lk = spinlock_names[i].ln_lock;
+		acq = lk->lk_stats.ls_acquires;
+		cont = lk->lk_stats.ls_contended;
+		spins = lk->lk_stats.ls_spins;
+		kprintf("%-24s %10u %10u %12llu %8llu\n",
+			spinlock_names[i].ln_name, acq, cont,
+			(unsigned long long) spins,
+			cont > 0 ? (unsigned long long) (spins / cont) : 0ULL);
+	}
+}
+
+void
+spinlock_stats_reset(void)
+{
+	unsigned i, num;
+	struct spinlock *lk;
+
+	spinlock_acquire(&spinlock_names_lock);
+	num = spinlock_numnames;
+	spinlock_release(&spinlock_names_lock);
+
+	for (i=0; i<num; i++) {
+		lk = spinlock_names[i].ln_lock;
+		spinlock_acquire(lk);
+		lk->lk_stats.ls_acquires = 0;
+		lk->lk_stats.ls_contended = 0;
+		lk->lk_stats.ls_spins = 0;
+		spinlock_release(lk);
+	}
+}
+
+#endif /* OPT_LOCKSTATS */
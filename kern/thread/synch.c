@@ -127,6 +127,38 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+P_intr(struct semaphore *sem)
+{
+	int result = 0;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	wchan_intr_begin(sem->sem_wchan);
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0 && result == 0) {
+		/* as in P */
+		wchan_lock(sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		result = wchan_sleep_intr(sem->sem_wchan);
+
+		spinlock_acquire(&sem->sem_lock);
+        }
+	/*
+	 * If there's a count, take it even if we were interrupted:
+	 * the V that put it there may have woken us rather than
+	 * someone who'd have used it.
+	 */
+	if (sem->sem_count > 0) {
+		sem->sem_count--;
+		result = 0;
+	}
+	spinlock_release(&sem->sem_lock);
+	wchan_intr_end();
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -194,28 +226,55 @@ lock_acquire(struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock) == false);
         spinlock_acquire(&lock->spin);
-        while (lock->held)
+        if (!lock->held) {
+                lock->held = true;
+                lock->owner = curthread;
+                spinlock_release(&lock->spin);
+                return;
+        }
+        /*
+         * The lock is busy. lock_release hands it straight to the
+         * first sleeper (it never becomes free while anyone is
+         * waiting), so once we're woken it's already ours and we
+         * don't race newcomers for it.
+         */
+        while (lock->owner != curthread)
         {
                 wchan_lock(lock->wchan);
                 spinlock_release(&lock->spin);
                 wchan_sleep(lock->wchan);
                 spinlock_acquire(&lock->spin);
         }
-        lock->held = true;
-        lock->owner = curthread;
+        KASSERT(lock->held);
         spinlock_release(&lock->spin);
 }
 
 void 
 lock_release(struct lock *lock)
 {
+        struct thread *next;
+
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock) == true);
         spinlock_acquire(&lock->spin);
-        lock->held = false;
-        lock->owner = NULL;
-        wchan_wakeone(lock->wchan);
+        /*
+         * Wake one with handoff: if anyone is waiting, make the
+         * first waiter the owner before it runs, so it doesn't have
+         * to fight for the lock and go back to sleep.
+         */
+        next = wchan_dequeue(lock->wchan);
+        if (next != NULL) {
+                lock->owner = next;
+        }
+        else {
+                lock->held = false;
+                lock->owner = NULL;
+        }
         spinlock_release(&lock->spin);
+
+        if (next != NULL) {
+                wchan_wakethread(next);
+        }
 }
 
 bool 
@@ -274,8 +333,33 @@ cv_wait(struct cv *cv, struct lock *lock)
         wchan_lock(cv->wchan);
         lock_release(lock);
         wchan_sleep(cv->wchan);
-        lock_acquire(lock);
+        /*
+         * cv_signal and cv_broadcast don't wake us; they move us
+         * onto the lock's channel, and lock_release hands us the
+         * lock when it wakes us. So normally we already own it.
+         */
+        if (!lock_do_i_hold(lock)) {
+                lock_acquire(lock);
+        }
+}
 
+int
+cv_wait_intr(struct cv *cv, struct lock *lock)
+{
+	int result;
+
+        KASSERT(cv != NULL);
+        KASSERT(lock_do_i_hold(lock));
+	wchan_intr_begin(cv->wchan);
+        wchan_lock(cv->wchan);
+        lock_release(lock);
+        result = wchan_sleep_intr(cv->wchan);
+	/* as in cv_wait; if interrupted we weren't handed the lock */
+        if (!lock_do_i_hold(lock)) {
+                lock_acquire(lock);
+        }
+	wchan_intr_end();
+	return result;
 }
 
 void
@@ -283,7 +367,12 @@ cv_signal(struct cv *cv, struct lock *lock)
 {
         KASSERT(cv != NULL);
         KASSERT(lock_do_i_hold(lock));
-        wchan_wakeone(cv->wchan);       
+        /*
+         * Wait morphing: the waiter can't do anything until we
+         * release the lock, so rather than waking it just to have it
+         * block on the lock, move it to the lock's wait channel.
+         */
+        wchan_requeue(cv->wchan, lock->wchan, false);
 }
 
 void
@@ -291,5 +380,10 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 {
         KASSERT(cv != NULL);
 	KASSERT(lock_do_i_hold(lock));
-        wchan_wakeall(cv->wchan);
+        /*
+         * As in cv_signal. This is where it really pays: instead of
+         * a herd of threads waking up to fight over the lock, they
+         * are handed it one at a time by lock_release.
+         */
+        wchan_requeue(cv->wchan, lock->wchan, true);
 }
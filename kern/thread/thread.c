@@ -46,12 +46,16 @@
 #include <threadprivate.h>
 #include <proc.h>
 #include <current.h>
+#include <syscall.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <ktrace.h>
+#include <prof.h>
 
 #include "opt-synchprobs.h"
+#include "opt-syscallstats.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -111,6 +115,41 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Fill in the fields of a new or recycled thread. Takes ownership
+ * of NAME. Leaves t_stack alone.
+ */
+static
+void
+thread_initfields(struct thread *thread, char *name)
+{
+	thread->t_name = name;
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_cpumask = THREAD_CPUMASK_ALL;
+	thread->t_proc = NULL;
+	spinlock_init(&thread->t_intrlock);
+	thread->t_intr = false;
+	thread->t_intrwc = NULL;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* Public fields */
+	thread->t_ustack = 0;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -120,6 +159,7 @@ struct thread *
 thread_create(const char *name)
 {
 	struct thread *thread;
+	char *tname;
 
 	DEBUGASSERT(name != NULL);
 
@@ -128,29 +168,82 @@ thread_create(const char *name)
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
+	tname = kstrdup(name);
+	if (tname == NULL) {
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	thread_initfields(thread, tname);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
 
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	return thread;
+}
 
-	/* If you add to struct thread, be sure to initialize here */
+/*
+ * Per-cpu cache of dead threads.
+ *
+ * Rather than freeing the thread structure and stack of every
+ * exited thread, exorcise() parks up to THREAD_CACHE_MAX of them on
+ * the current cpu, and thread_fork takes them back. That saves two
+ * kmallocs and two kfrees per thread, and the stack guard band is
+ * still intact from the last use so it needn't be set up again.
+ *
+ * c_threadcache is only touched by its own cpu, with interrupts
+ * off so we can't be preempted (and thus migrated) halfway through.
+ */
+#define THREAD_CACHE_MAX	16
+
+/*
+ * Park a zombie in the cache. Returns false if it doesn't qualify
+ * (no freeable stack, or cache full) and should be destroyed.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+	thread_checkstack(thread);
+
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+	return true;
+}
 
+/*
+ * Get a thread out of the cache, or NULL if it's empty.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	char *tname;
+	int spl;
+
+	tname = kstrdup(name);
+	if (tname == NULL) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+
+	if (thread == NULL) {
+		kfree(tname);
+		return NULL;
+	}
+	thread_initfields(thread, tname);
+	thread_checkstack(thread);
 	return thread;
 }
 
@@ -179,9 +272,12 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
+	c->c_ctxswitches = 0;
 
 	c->c_isidle = false;
+	c->c_rehome = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
@@ -193,6 +289,23 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	/* Affinity masks are 32 bits wide. */
+	KASSERT(c->c_number < 32);
+#if OPT_LOCKSTATS
+	/* one row per cpu in the lock stats, so they need their own names */
+	snprintf(c->c_runqueue_lockname, sizeof(c->c_runqueue_lockname),
+		 "runqueue cpu%u", c->c_number);
+	spinlock_stats_register(&c->c_runqueue_lock, c->c_runqueue_lockname);
+#endif
+#if OPT_SYSCALLSTATS
+	syscall_stats_cpuinit(c->c_number);
+#endif
+#if OPT_KTRACE
+	ktrace_cpuinit(c->c_number);
+#endif
+#if OPT_PROF
+	prof_cpuinit(c->c_number);
+#endif
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -254,6 +367,8 @@ thread_destroy(struct thread *thread)
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
+	KASSERT(thread->t_intrwc == NULL);
+	spinlock_cleanup(&thread->t_intrlock);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
@@ -277,7 +392,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -426,10 +543,66 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Check if thread T may run on cpu C.
+ */
+static
+bool
+thread_cpu_allowed(struct thread *t, struct cpu *c)
+{
+	return (t->t_cpumask & ((uint32_t)1 << c->c_number)) != 0;
+}
+
+/*
+ * Choose a cpu out of MASK for a thread to run on. Unless SPREAD is
+ * set, stay on the current cpu if allowed. Otherwise take the least
+ * loaded allowed cpu, starting the scan at a rotating position so
+ * that ties (e.g. several idle cpus) get spread around.
+ *
+ * The loads are read without locking; this is only a heuristic.
+ */
+static
+struct cpu *
+thread_pickcpu(uint32_t mask, bool spread)
+{
+	static unsigned rotor;
+	unsigned i, numcpus, start, load, bestload;
+	struct cpu *c, *best;
+
+	if (!spread && (mask & ((uint32_t)1 << curcpu->c_number))) {
+		return curcpu->c_self;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	start = spread ? rotor++ : 0;
+	best = NULL;
+	bestload = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if ((mask & ((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		load = c->c_runqueue.tl_count + (c->c_isidle ? 0 : 1);
+		if (best == NULL || load < bestload) {
+			best = c;
+			bestload = load;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too. 
+ *
+ * If the thread isn't allowed on its cpu any more (its affinity mask
+ * changed), move it to one it is allowed on. We can't do that if the
+ * old cpu is still running on the thread's stack (it's the current
+ * thread there, either yielding with the runqueue lock held or idle
+ * in thread_switch after going to sleep); then we leave it and set
+ * c_rehome so thread_rehome moves it once it's off the cpu.
  */
 static
 void
@@ -449,6 +622,18 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	if (!thread_cpu_allowed(target, targetcpu)) {
+		if (already_have_lock || targetcpu->c_curthread == target) {
+			targetcpu->c_rehome = true;
+		}
+		else {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target->t_cpumask, false);
+			target->t_cpu = targetcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
+	}
+
 	isidle = targetcpu->c_isidle;
 	threadlist_addtail(&targetcpu->c_runqueue, target);
 	if (isidle) {
@@ -465,20 +650,59 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Move threads that aren't allowed on this cpu off its run queue.
+ * Cheap unless thread_make_runnable has flagged us. Called after
+ * every context switch (next to exorcise) and from migration.
  */
+static
+void
+thread_rehome(void)
+{
+	struct threadlist movers;
+	struct threadlistnode *node;
+	struct thread *t;
+
+	if (!curcpu->c_rehome) {
+		return;
+	}
+
+	threadlist_init(&movers);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_rehome = false;
+	node = curcpu->c_runqueue.tl_head.tln_next;
+	while (node->tln_next != NULL) {
+		t = node->tln_self;
+		node = node->tln_next;
+		if (thread_cpu_allowed(t, curcpu->c_self)) {
+			continue;
+		}
+		if (t == curthread) {
+			/* Still on our stack; see thread_consider_migration */
+			curcpu->c_rehome = true;
+			continue;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		threadlist_addtail(&movers, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	while ((t = threadlist_remhead(&movers)) != NULL) {
+		t->t_cpu = thread_pickcpu(t->t_cpumask, false);
+		thread_make_runnable(t, false);
+	}
+	threadlist_cleanup(&movers);
+}
+
+/*
+ * thread_fork, with affinity mask MASK rather than the caller's.
+ */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_mask(const char *name,
+		 struct proc *proc,
+		 uint32_t mask,
+		 void (*entrypoint)(void *data1, unsigned long data2),
+		 void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -487,30 +711,42 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a cached thread and stack if there is one */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
-
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
 	}
+
+	/*
+	 * Thread subsystem fields. Kernel threads start on the current
+	 * cpu (if allowed), where they're likely to share cache with
+	 * their siblings; new processes and the threads of user
+	 * processes (which are there to use more cpus) get spread out.
+	 */
+	newthread->t_cpumask = mask;
+	newthread->t_cpu = thread_pickcpu(newthread->t_cpumask,
+					  proc != curthread->t_proc ||
+					  proc != kproc);
 	result = proc_addthread(proc, newthread);
 	if (result) {
 		/* thread_destroy will clean up the stack */
@@ -534,6 +770,29 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It inherits the caller's CPU
+ * affinity mask (see thread_fork_mask). A kernel thread in the
+ * caller's process starts on the caller's CPU if the mask allows;
+ * the first thread of a new process, or a user thread, goes to the
+ * least loaded CPU in the mask.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_mask(name, proc, curthread->t_cpumask,
+				entrypoint, data1, data2);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -585,9 +844,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		cur->t_usage.u_nivcsw++;
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		cur->t_usage.u_nvcsw++;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -651,6 +912,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	if (next != cur) {
+		curcpu->c_ctxswitches++;
+		KTRACE(KT_SWITCH, next, 0, next->t_name);
+	}
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -714,6 +980,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Send away threads no longer allowed on this cpu. */
+	thread_rehome();
+
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -747,6 +1016,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Send away threads no longer allowed on this cpu. */
+	thread_rehome();
+
 	/* Enable interrupts. */
 	spl0();
 
@@ -861,6 +1133,8 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	thread_rehome();
+
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
@@ -922,6 +1196,15 @@ thread_consider_migration(void)
 				to_send--;
 				continue;
 			}
+			/*
+			 * Likewise skip threads whose affinity mask
+			 * doesn't include the destination.
+			 */
+			if (!thread_cpu_allowed(t, c)) {
+				threadlist_addtail(&victims, t);
+				to_send--;
+				continue;
+			}
 
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
@@ -957,6 +1240,90 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+/*
+ * Affinity.
+ */
+
+/*
+ * Entry point of the thread thread_set_cpumask leaves behind on the
+ * cpu it's leaving. Switching to it is all it's for.
+ */
+static
+void
+thread_mover(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+}
+
+uint32_t
+thread_get_cpumask(void)
+{
+	return curthread->t_cpumask;
+}
+
+int
+thread_set_cpumask(uint32_t mask)
+{
+	struct cpu *here;
+	unsigned numcpus;
+	uint32_t valid, oldmask;
+	int result;
+
+	numcpus = cpuarray_num(&allcpus);
+	valid = numcpus >= 32 ? THREAD_CPUMASK_ALL :
+		((uint32_t)1 << numcpus) - 1;
+	if ((mask & valid) == 0) {
+		return EINVAL;
+	}
+
+	/* Only we write our own mask, so no locking is needed. */
+	here = curcpu->c_self;
+	oldmask = curthread->t_cpumask;
+	curthread->t_cpumask = mask;
+
+	if (!thread_cpu_allowed(curthread, here)) {
+		/*
+		 * Get off this cpu: thread_switch puts us back on its
+		 * run queue and flags it, and the next thread to run
+		 * here sends us elsewhere (thread_rehome). But we're
+		 * still on our own stack until something else runs, so
+		 * if nothing else is runnable here the cpu would just
+		 * pick us again. Make sure something is: a thread
+		 * pinned to this cpu that does nothing but exit.
+		 *
+		 * (If we get preempted and moved before the yield, the
+		 * mover just runs and exits on its own.)
+		 */
+		result = thread_fork_mask("cpumask mover", kproc,
+					  (uint32_t)1 << here->c_number,
+					  thread_mover, NULL, 0);
+		if (result) {
+			curthread->t_cpumask = oldmask;
+			return result;
+		}
+		thread_yield();
+		KASSERT(thread_cpu_allowed(curthread, curcpu->c_self));
+	}
+	return 0;
+}
+
+/*
+ * Return the number of context switches done by all CPUs.
+ */
+unsigned
+thread_ctxswitches(void)
+{
+	unsigned i, numcpus, total;
+
+	total = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		total += cpuarray_get(&allcpus, i)->c_ctxswitches;
+	}
+	return total;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1025,6 +1392,7 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+	KTRACE(KT_SLEEP, wc, 0, wc->wc_name);
 	thread_switch(S_SLEEP, wc);
 }
 
@@ -1036,15 +1404,7 @@ wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
 
-	/* Lock the channel and grab a thread from it */
-	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
-	/*
-	 * Nobody else can wake up this thread now, so we don't need
-	 * to hang onto the lock.
-	 */
-	spinlock_release(&wc->wc_lock);
-
+	target = wchan_dequeue(wc);
 	if (target == NULL) {
 		/* Nobody was sleeping. */
 		return;
@@ -1059,10 +1419,13 @@ wchan_wakeone(struct wchan *wc)
 void
 wchan_wakeall(struct wchan *wc)
 {
-	struct thread *target;
-	struct threadlist list;
+	struct thread *target, *t;
+	struct threadlist list, strays;
+	struct threadlistnode *node;
+	struct cpu *targetcpu;
 
 	threadlist_init(&list);
+	threadlist_init(&strays);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
@@ -1078,18 +1441,212 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_release(&wc->wc_lock);
 
+	if (!threadlist_isempty(&list)) {
+		KTRACE(KT_WAKEALL, wc, 0, wc->wc_name);
+	}
+
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Hand the threads out one cpu at a time: take the first
+	 * thread's cpu, lock its run queue once, and move over every
+	 * thread on the list that belongs to it, sending at most one
+	 * IPI. With lots of sleepers (lbolt, minibolt) this is much
+	 * cheaper than a lock round trip and a possible IPI per
+	 * thread. Sleeping threads can't migrate, so t_cpu is stable.
+	 *
+	 * Threads whose affinity no longer allows their cpu are set
+	 * aside and go through thread_make_runnable afterwards, which
+	 * moves them; the exception is a thread the cpu is still on
+	 * the stack of, which has to stay and be rehomed later, as in
+	 * thread_make_runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		targetcpu = target->t_cpu;
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		threadlist_addhead(&list, target);
+
+		node = list.tl_head.tln_next;
+		while (node->tln_next != NULL) {
+			t = node->tln_self;
+			node = node->tln_next;
+			if (t->t_cpu != targetcpu) {
+				continue;
+			}
+			threadlist_remove(&list, t);
+			if (thread_cpu_allowed(t, targetcpu)) {
+				threadlist_addtail(&targetcpu->c_runqueue, t);
+			}
+			else if (targetcpu->c_curthread == t) {
+				threadlist_addtail(&targetcpu->c_runqueue, t);
+				targetcpu->c_rehome = true;
+			}
+			else {
+				threadlist_addtail(&strays, t);
+			}
+		}
+
+		if (targetcpu->c_isidle &&
+		    !threadlist_isempty(&targetcpu->c_runqueue)) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+
+	while ((target = threadlist_remhead(&strays)) != NULL) {
 		thread_make_runnable(target, false);
 	}
 
+	threadlist_cleanup(&strays);
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Interruptible sleeps.
+ *
+ * t_intrwc says which channel a thread may be sleeping on, so that
+ * thread_interrupt can find it there. Both sides hold t_intrlock
+ * while looking at it, and thread_interrupt keeps holding it while
+ * it locks the channel, so the channel can't go away under it: the
+ * sleeper has to get t_intrlock back (in wchan_intr_end) before it
+ * can let go of whatever owns the channel.
+ *
+ * The sleeper checks t_intr again with the channel locked before
+ * sleeping. thread_interrupt sets t_intr before locking the channel,
+ * so either the sleeper sees it then, or it's already on the channel
+ * when thread_interrupt looks.
+ */
+void
+wchan_intr_begin(struct wchan *wc)
+{
+	spinlock_acquire(&curthread->t_intrlock);
+	KASSERT(curthread->t_intrwc == NULL);
+	curthread->t_intrwc = wc;
+	spinlock_release(&curthread->t_intrlock);
+}
+
+int
+wchan_sleep_intr(struct wchan *wc)
+{
+	KASSERT(curthread->t_intrwc == wc);
+
+	if (curthread->t_intr) {
+		spinlock_release(&wc->wc_lock);
+		return EINTR;
+	}
+	wchan_sleep(wc);
+	return curthread->t_intr ? EINTR : 0;
+}
+
+void
+wchan_intr_end(void)
+{
+	spinlock_acquire(&curthread->t_intrlock);
+	KASSERT(curthread->t_intrwc != NULL);
+	curthread->t_intrwc = NULL;
+	spinlock_release(&curthread->t_intrlock);
+}
+
+void
+thread_interrupt(struct thread *t)
+{
+	struct wchan *wc;
+	struct threadlistnode *node;
+	bool found;
+
+	KASSERT(t != curthread);
+
+	spinlock_acquire(&t->t_intrlock);
+	t->t_intr = true;
+	wc = t->t_intrwc;
+	found = false;
+	if (wc != NULL) {
+		/*
+		 * It may not have gone to sleep yet, or may have been
+		 * woken already, or moved to a lock's channel by wait
+		 * morphing; in all of those cases leave it be.
+		 */
+		spinlock_acquire(&wc->wc_lock);
+		for (node = wc->wc_threads.tl_head.tln_next;
+		     node->tln_next != NULL; node = node->tln_next) {
+			if (node->tln_self == t) {
+				threadlist_remove(&wc->wc_threads, t);
+				found = true;
+				break;
+			}
+		}
+		spinlock_release(&wc->wc_lock);
+	}
+	if (found) {
+		thread_make_runnable(t, false);
+	}
+	spinlock_release(&t->t_intrlock);
+}
+
+/*
+ * Take the first thread off a wait channel without waking it. The
+ * thread is then on no list at all and nobody else can wake it, so
+ * the caller owns it and must pass it to wchan_wakethread. Between
+ * the two the caller can hand the thread whatever it was waiting for
+ * (see lock_release) so that it doesn't have to compete for it.
+ */
+struct thread *
+wchan_dequeue(struct wchan *wc)
+{
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	target = threadlist_remhead(&wc->wc_threads);
+	spinlock_release(&wc->wc_lock);
+
+	if (target != NULL) {
+		KTRACE(KT_WAKEONE, wc, target, wc->wc_name);
+	}
+	return target;
+}
+
+/*
+ * Make runnable a thread previously taken off a channel with
+ * wchan_dequeue.
+ */
+void
+wchan_wakethread(struct thread *target)
+{
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Move one (or, if ALL, every) thread sleeping on FROM onto the end
+ * of TO, leaving them asleep. Returns the number of threads moved.
+ *
+ * Both channels are locked, FROM first; callers must not lock the
+ * same pair of channels in the other order. In practice this is a
+ * CV's channel and its lock's channel, and the synch code always
+ * gets the CV's first.
+ */
+unsigned
+wchan_requeue(struct wchan *from, struct wchan *to, bool all)
+{
+	struct thread *target;
+	unsigned moved;
+
+	KASSERT(from != to);
+
+	moved = 0;
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+		moved++;
+		if (!all) {
+			break;
+		}
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+
+	return moved;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,614 @@
+/*
+ * Pipes. See pipe.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <current.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vnode.h>
+#include <pipe.h>
+
+struct pipe {
+	struct lock *p_lock;		/* protects everything below */
+	struct cv *p_readcv;		/* readers wait here for data */
+	struct cv *p_writecv;		/* writers wait here for space */
+	unsigned p_start;		/* first byte in p_buf */
+	unsigned p_count;		/* bytes in p_buf */
+	bool p_readopen;		/* read end not yet closed */
+	bool p_writeopen;		/* write end not yet closed */
+	unsigned p_nvnodes;		/* ends not yet reclaimed */
+
+	/* the posted direct read, if p_das isn't NULL */
+	struct addrspace *p_das;	/* reader's address space */
+	vaddr_t p_dbuf;			/* reader's buffer */
+	size_t p_dlen;			/* its length */
+	size_t p_ddone;			/* bytes a writer put there */
+	int p_derror;			/* or why a writer couldn't */
+
+	struct vnode p_readvn;
+	struct vnode p_writevn;
+	char p_buf[PIPE_SIZE];
+};
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	cv_destroy(p->p_writecv);
+	cv_destroy(p->p_readcv);
+	lock_destroy(p->p_lock);
+	kfree(p);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Moving data.
+
+/*
+ * Copy from the ring to UIO until one or the other runs out.
+ */
+static
+int
+pipe_ringread(struct pipe *p, struct uio *uio)
+{
+	size_t n;
+	int result;
+
+	while (p->p_count > 0 && uio->uio_resid > 0) {
+		n = p->p_count;
+		if (n > PIPE_SIZE - p->p_start) {
+			n = PIPE_SIZE - p->p_start;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(p->p_buf + p->p_start, n, uio);
+		if (result) {
+			return result;
+		}
+		p->p_start = (p->p_start + n) % PIPE_SIZE;
+		p->p_count -= n;
+	}
+	if (p->p_count == 0) {
+		/* keep the next write in one piece */
+		p->p_start = 0;
+	}
+	return 0;
+}
+
+/*
+ * Copy from UIO to the ring until one or the other runs out.
+ */
+static
+int
+pipe_ringwrite(struct pipe *p, struct uio *uio)
+{
+	unsigned end;
+	size_t n;
+	int result;
+
+	while (p->p_count < PIPE_SIZE && uio->uio_resid > 0) {
+		end = (p->p_start + p->p_count) % PIPE_SIZE;
+		n = PIPE_SIZE - p->p_count;
+		if (n > PIPE_SIZE - end) {
+			n = PIPE_SIZE - end;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(p->p_buf + end, n, uio);
+		if (result) {
+			return result;
+		}
+		p->p_count += n;
+	}
+	return 0;
+}
+
+/*
+ * Whether a read of an empty pipe should post its buffer for a
+ * writer to fill. The direct path only handles a plain user buffer.
+ */
+static
+bool
+pipe_candirect(struct pipe *p, struct uio *uio)
+{
+	return p->p_das == NULL &&
+		uio->uio_segflg == UIO_USERSPACE &&
+		uio->uio_iovcnt == 1 &&
+		uio->uio_resid >= PIPE_DIRECTMIN;
+}
+
+/*
+ * Post UIO's buffer and wait for a writer to fill some of it, or for
+ * the write end to close. Writers leave the ring alone while a read
+ * is posted, so nothing can overtake the data that goes direct.
+ */
+static
+int
+pipe_directread(struct pipe *p, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t n;
+	int result, intr;
+
+	KASSERT(p->p_count == 0);
+
+	iov = uio->uio_iov;
+	p->p_das = uio->uio_space;
+	p->p_dbuf = (vaddr_t)iov->iov_ubase;
+	p->p_dlen = uio->uio_resid;
+	p->p_ddone = 0;
+	p->p_derror = 0;
+
+	intr = 0;
+	while (p->p_ddone == 0 && p->p_derror == 0 && p->p_writeopen) {
+		intr = cv_wait_intr(p->p_readcv, p->p_lock);
+		if (intr) {
+			break;
+		}
+	}
+
+	n = p->p_ddone;
+	result = p->p_derror != 0 ? p->p_derror : intr;
+	p->p_das = NULL;
+	/* let any other reader post its buffer */
+	cv_broadcast(p->p_readcv, p->p_lock);
+
+	if (n == 0) {
+		/* EOF, or the writer couldn't get at our buffer, or EINTR */
+		return result;
+	}
+
+	/* the writer filled it behind uiomove's back; catch up */
+	iov->iov_ubase += n;
+	iov->iov_len -= n;
+	uio->uio_resid -= n;
+	uio->uio_offset += n;
+	curthread->t_usage.u_inbytes += n;
+	return 0;
+}
+
+/*
+ * Copy from UIO straight into the posted reader's buffer. dumbvm
+ * regions are physically contiguous, so this is usually one uiomove
+ * into the reader's pages through kseg0.
+ */
+static
+int
+pipe_directwrite(struct pipe *p, struct uio *uio)
+{
+	paddr_t paddr;
+	size_t want, n, done;
+	int result;
+
+	want = uio->uio_resid;
+	if (want > p->p_dlen) {
+		want = p->p_dlen;
+	}
+
+	for (done = 0; done < want; done += n) {
+		result = as_translate(p->p_das, p->p_dbuf + done, true,
+				      &paddr, &n);
+		if (result) {
+			/* the reader's problem, not ours */
+			if (done == 0) {
+				p->p_derror = result;
+			}
+			break;
+		}
+		if (n > want - done) {
+			n = want - done;
+		}
+		result = uiomove((void *)PADDR_TO_KVADDR(paddr), n, uio);
+		if (result) {
+			p->p_ddone = done;
+			return result;
+		}
+	}
+	p->p_ddone = done;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Vnode operations.
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	(void)v;
+	(void)flags;
+	return 0;
+}
+
+/*
+ * Last close of one end. Wake everyone on the other side so they can
+ * see it.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+
+	lock_acquire(p->p_lock);
+	if (v == &p->p_readvn) {
+		p->p_readopen = false;
+		cv_broadcast(p->p_writecv, p->p_lock);
+	}
+	else {
+		p->p_writeopen = false;
+		cv_broadcast(p->p_readcv, p->p_lock);
+	}
+	lock_release(p->p_lock);
+	return 0;
+}
+
+/*
+ * Last reference to one end. The pipe goes when both are gone.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool last;
+
+	VOP_CLEANUP(v);
+
+	lock_acquire(p->p_lock);
+	KASSERT(p->p_nvnodes > 0);
+	p->p_nvnodes--;
+	last = (p->p_nvnodes == 0);
+	lock_release(p->p_lock);
+
+	if (last) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	if (v != &p->p_readvn) {
+		return EBADF;
+	}
+
+	lock_acquire(p->p_lock);
+	while (p->p_count == 0 && p->p_writeopen) {
+		if (pipe_candirect(p, uio)) {
+			result = pipe_directread(p, uio);
+			lock_release(p->p_lock);
+			return result;
+		}
+		result = cv_wait_intr(p->p_readcv, p->p_lock);
+		if (result) {
+			lock_release(p->p_lock);
+			return result;
+		}
+	}
+	result = pipe_ringread(p, uio);
+	cv_broadcast(p->p_writecv, p->p_lock);
+	lock_release(p->p_lock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t orig;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	if (v != &p->p_writevn) {
+		return EBADF;
+	}
+
+	orig = uio->uio_resid;
+	result = 0;
+
+	lock_acquire(p->p_lock);
+	while (uio->uio_resid > 0) {
+		if (!p->p_readopen) {
+			result = EPIPE;
+			break;
+		}
+		if (p->p_das != NULL && p->p_ddone == 0 &&
+		    p->p_derror == 0) {
+			result = pipe_directwrite(p, uio);
+			cv_broadcast(p->p_readcv, p->p_lock);
+		}
+		else if (p->p_count == PIPE_SIZE) {
+			result = cv_wait_intr(p->p_writecv, p->p_lock);
+		}
+		else {
+			result = pipe_ringwrite(p, uio);
+			cv_broadcast(p->p_readcv, p->p_lock);
+		}
+		if (result) {
+			break;
+		}
+	}
+	lock_release(p->p_lock);
+
+	if ((result == EPIPE || result == EINTR) && uio->uio_resid < orig) {
+		/* report the short write; the next one gets the error */
+		result = 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_SIZE;
+	lock_acquire(p->p_lock);
+	statbuf->st_size = p->p_count;
+	lock_release(p->p_lock);
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_notdir_io(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return EUNIMP;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v, const char *n1, struct vnode *v2, const char *n2)
+{
+	(void)v;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *path, struct vnode **result)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *path, struct vnode **result,
+		char *buf, size_t len)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_notdir_io,	/* readlink */
+	pipe_notdir_io,	/* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_notdir_io,	/* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,	/* remove */
+	pipe_nameop,	/* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
+
+////////////////////////////////////////////////////////////
+//
+// Creation.
+
+int
+pipe_create(struct vnode **readret, struct vnode **writeret)
+{
+	struct pipe *p;
+	int result;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_lock = lock_create("pipe");
+	if (p->p_lock == NULL) {
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_readcv = cv_create("pipe-read");
+	if (p->p_readcv == NULL) {
+		lock_destroy(p->p_lock);
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_writecv = cv_create("pipe-write");
+	if (p->p_writecv == NULL) {
+		cv_destroy(p->p_readcv);
+		lock_destroy(p->p_lock);
+		kfree(p);
+		return ENOMEM;
+	}
+
+	p->p_start = 0;
+	p->p_count = 0;
+	p->p_readopen = true;
+	p->p_writeopen = true;
+	p->p_nvnodes = 2;
+	p->p_das = NULL;
+	p->p_dbuf = 0;
+	p->p_dlen = 0;
+	p->p_ddone = 0;
+	p->p_derror = 0;
+
+	result = VOP_INIT(&p->p_readvn, &pipe_vnode_ops, NULL, p);
+	if (result) {
+		pipe_destroy(p);
+		return result;
+	}
+	result = VOP_INIT(&p->p_writevn, &pipe_vnode_ops, NULL, p);
+	if (result) {
+		VOP_CLEANUP(&p->p_readvn);
+		pipe_destroy(p);
+		return result;
+	}
+
+	/* as if from vfs_open */
+	VOP_INCOPEN(&p->p_readvn);
+	VOP_INCOPEN(&p->p_writevn);
+
+	*readret = &p->p_readvn;
+	*writeret = &p->p_writevn;
+	return 0;
+}
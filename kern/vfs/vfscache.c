@@ -0,0 +1,252 @@
+/*
+ * Directory name lookup cache. See vfs.h.
+ *
+ * A fixed pool of DCACHE_SIZE entries, found by hashing (directory,
+ * name) and recycled least recently used first. Each entry holds a
+ * reference to its directory and, unless it's negative, to the vnode
+ * the name leads to. When the entry is removed or recycled those are
+ * handed back to the caller in a struct dcache_refs rather than
+ * dropped here: dropping the last reference can reclaim the vnode,
+ * and the caller may be holding locks (or be inside a filesystem
+ * operation) that reclaim mustn't run under.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vfs.h>
+
+#define DCACHE_SIZE	256		/* entries */
+#define DCACHE_HASHSIZE	128		/* chains (a power of 2) */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory, or NULL if unused */
+	struct vnode *dc_vn;		/* what NAME is, or NULL if nothing */
+	char dc_name[DCACHE_NAMELEN+1];
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lrunext;	/* LRU list */
+	struct dcentry *dc_lruprev;
+};
+
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+static struct dcentry dcache_entries[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static bool dcache_ready;
+
+/* LRU list; the head's next is the most recently used */
+static struct dcentry dcache_lru;
+
+/* Set up the LRU list (on first use; called with dcache_lock held). */
+static
+void
+dcache_init(void)
+{
+	unsigned i;
+
+	dcache_lru.dc_lrunext = dcache_lru.dc_lruprev = &dcache_lru;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].dc_lrunext = dcache_lru.dc_lrunext;
+		dcache_entries[i].dc_lruprev = &dcache_lru;
+		dcache_lru.dc_lrunext->dc_lruprev = &dcache_entries[i];
+		dcache_lru.dc_lrunext = &dcache_entries[i];
+	}
+	dcache_ready = true;
+}
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h & (DCACHE_HASHSIZE - 1);
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	for (dc = dcache_hash[dcache_hashfn(dir, name)];
+	     dc != NULL; dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/* make DC the most recently used */
+static
+void
+dcache_touch(struct dcentry *dc)
+{
+	dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	dc->dc_lrunext = dcache_lru.dc_lrunext;
+	dc->dc_lruprev = &dcache_lru;
+	dcache_lru.dc_lrunext->dc_lruprev = dc;
+	dcache_lru.dc_lrunext = dc;
+}
+
+/*
+ * Take DC out of the cache and hand back the references it held,
+ * for the caller to drop once it lets go of dcache_lock.
+ */
+static
+void
+dcache_drop(struct dcentry *dc, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry **dcp;
+
+	KASSERT(dc->dc_dir != NULL);
+
+	for (dcp = &dcache_hash[dcache_hashfn(dc->dc_dir, dc->dc_name)];
+	     *dcp != dc; dcp = &(*dcp)->dc_hashnext) {
+		KASSERT(*dcp != NULL);
+	}
+	*dcp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+
+	*dir = dc->dc_dir;
+	*vn = dc->dc_vn;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+
+	/* unused now, so make it the first to be recycled */
+	dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	dc->dc_lrunext = &dcache_lru;
+	dc->dc_lruprev = dcache_lru.dc_lruprev;
+	dcache_lru.dc_lruprev->dc_lrunext = dc;
+	dcache_lru.dc_lruprev = dc;
+}
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return false;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	if (!dcache_ready) {
+		dcache_init();
+	}
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	dcache_touch(dc);
+	*ret = dc->dc_vn;
+	if (*ret != NULL) {
+		VOP_INCREF(*ret);
+	}
+	spinlock_release(&dcache_lock);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     struct dcache_refs *old)
+{
+	struct dcentry *dc;
+
+	KASSERT(old->dr_dir == NULL && old->dr_vn == NULL);
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return;
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&dcache_lock);
+	if (!dcache_ready) {
+		dcache_init();
+	}
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		/* recycle the least recently used entry */
+		dc = dcache_lru.dc_lruprev;
+		if (dc->dc_dir != NULL) {
+			dcache_drop(dc, &old->dr_dir, &old->dr_vn);
+		}
+		strcpy(dc->dc_name, name);
+		dc->dc_hashnext = dcache_hash[dcache_hashfn(dir, name)];
+		dcache_hash[dcache_hashfn(dir, name)] = dc;
+	}
+	else {
+		/* replace what's there */
+		old->dr_dir = dc->dc_dir;
+		old->dr_vn = dc->dc_vn;
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	dcache_touch(dc);
+	spinlock_release(&dcache_lock);
+}
+
+void
+dcache_remove(struct vnode *dir, const char *name, struct dcache_refs *old)
+{
+	struct dcentry *dc;
+
+	KASSERT(old->dr_dir == NULL && old->dr_vn == NULL);
+
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	if (!dcache_ready) {
+		dcache_init();
+	}
+	dc = dcache_find(dir, name);
+	if (dc != NULL) {
+		dcache_drop(dc, &old->dr_dir, &old->dr_vn);
+	}
+	spinlock_release(&dcache_lock);
+}
+
+void
+dcache_putrefs(struct dcache_refs *old)
+{
+	if (old->dr_vn != NULL) {
+		VOP_DECREF(old->dr_vn);
+		old->dr_vn = NULL;
+	}
+	if (old->dr_dir != NULL) {
+		VOP_DECREF(old->dr_dir);
+		old->dr_dir = NULL;
+	}
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	struct dcache_refs old = DCACHE_REFS_INITIALIZER;
+	unsigned i;
+
+	/* one at a time, since the lock has to be dropped for each */
+	for (i=0; i<DCACHE_SIZE; i++) {
+		spinlock_acquire(&dcache_lock);
+		if (dcache_entries[i].dc_dir != NULL &&
+		    dcache_entries[i].dc_dir->vn_fs == fs) {
+			dcache_drop(&dcache_entries[i],
+				    &old.dr_dir, &old.dr_vn);
+		}
+		spinlock_release(&dcache_lock);
+		dcache_putrefs(&old);
+	}
+}
@@ -235,11 +235,15 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The big lock covers only the device table and bootfs; once
+	 * we hold a reference to the starting vnode the filesystem
+	 * does its own locking.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -257,7 +261,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -268,22 +271,19 @@ vfs_lookup(char *path, struct vnode **retval)
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
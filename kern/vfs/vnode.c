@@ -51,6 +51,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -66,6 +67,7 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	spinlock_cleanup(&vn->vn_countlock);
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -83,32 +85,42 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
  * Calls VOP_RECLAIM if the refcount hits zero.
+ *
+ * The last reference is handed to VOP_RECLAIM rather than dropped
+ * here, because someone may pick the vnode up again between our
+ * releasing vn_countlock and the filesystem locking its vnode table.
+ * The filesystem rechecks the count under its own locks and consumes
+ * the reference if it returns EBUSY.
  */
 void
 vnode_decref(struct vnode *vn)
 {
+	bool destroy;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		destroy = false;
 	}
 	else {
+		destroy = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +128,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -129,9 +139,9 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -145,16 +155,18 @@ vnode_decopen(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
 
 	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+		spinlock_release(&vn->vn_countlock);
 		return;
 	}
 
+	spinlock_release(&vn->vn_countlock);
+
 	result = VOP_CLOSE(vn);
 	if (result) {
 		// XXX: also lame.
@@ -162,8 +174,6 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -173,8 +183,6 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
-
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -202,6 +210,8 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
+	spinlock_acquire(&v->vn_countlock);
+
 	if (v->vn_refcount < 0) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
 		      v->vn_refcount);
@@ -223,5 +233,5 @@ vnode_check(struct vnode *v, const char *opstr)
 			opstr, v->vn_opencount);
 	}
 
-	vfs_biglock_release();
+	spinlock_release(&v->vn_countlock);
 }
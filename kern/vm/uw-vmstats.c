@@ -54,6 +54,7 @@ vmstats_init(void)
    * again in case we want use/reset these stats repeatedly without shutting down the kernel.
    */
   spinlock_init(&stats_lock);
+  spinlock_stats_register(&stats_lock, "stats_lock");
 
   spinlock_acquire(&stats_lock);
     _vmstats_init();
@@ -69,18 +69,21 @@ static int timing = 0;
 #define MAXBG 128
 static pid_t bgpids[MAXBG];
 
+/* most commands in one pipeline */
+#define MAXSTAGES 16
+
 /*
  * can_bg
- * just checks for an open slot.
+ * just checks for n open slots.
  */
 static
 int
-can_bg(void)
+can_bg(int n)
 {
 	int i;
 	
 	for (i = 0; i < MAXBG; i++) {
-		if (bgpids[i] == 0) {
+		if (bgpids[i] == 0 && --n == 0) {
 			return 1;
 		}
 	}
@@ -292,21 +295,93 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * startcmd
+ * starts one command with its stdin and stdout on infd and outfd (which
+ * are left open), returning its pid, or -1 after complaining. closefd,
+ * if not -1, is a descriptor the command shouldn't get: the read end of
+ * the pipe to the next stage.
+ */
+static
+pid_t
+startcmd(char **args, int infd, int outfd, int closefd)
+{
+	pid_t pid;
+
+#ifndef HOST
+	/*
+	 * spawn builds the child straight from the executable, without
+	 * copying our address space first. It reports lookup errors
+	 * itself; a program that fails to load exits with status 127.
+	 * But the child gets every descriptor we have, with no way to
+	 * leave any out, so it's only for commands that aren't part
+	 * of a pipeline. A stage that kept the read end of its own
+	 * output pipe would never see EPIPE, and would block forever
+	 * once the pipe filled if the next stage quit early.
+	 */
+	if (infd == STDIN_FILENO && outfd == STDOUT_FILENO && closefd < 0) {
+		pid = spawn(args[0], args);
+		if (pid < 0) {
+			warn("%s", args[0]);
+		}
+		return pid;
+	}
+#endif
+
+	pid = fork();
+	switch (pid) {
+		case -1:
+			/* error */
+			warn("fork");
+			return -1;
+		case 0:
+			/* child */
+			if (closefd >= 0) {
+				close(closefd);
+			}
+			if (infd != STDIN_FILENO) {
+				dup2(infd, STDIN_FILENO);
+				close(infd);
+			}
+			if (outfd != STDOUT_FILENO) {
+				dup2(outfd, STDOUT_FILENO);
+				close(outfd);
+			}
+			execv(args[0], args);
+			warn("%s", args[0]);
+			/*
+			 * Use _exit() instead of exit() in the child
+			 * process to avoid calling atexit() functions,
+			 * which would cause hostcompat (if present) to
+			 * reset the tty state and mess up our input
+			 * handling.
+			 */
+			_exit(1);
+		default:
+			break;
+	}
+	return pid;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
- * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * otherwise, it's a standard command, or several joined with '|' into a
+ * pipeline.  check for the '&', try to background the job if possible,
+ * otherwise just run it and wait on it (all of it, for a pipeline; the
+ * status is the last command's).
  */
 static
 int
 docommand(char *buf)
 {
 	char *args[NARG_MAX + 1];
-	int nargs, i;
+	char **stages[MAXSTAGES];
+	pid_t pids[MAXSTAGES];
+	int nargs, nstages, i, j;
+	int fds[2], infd, outfd, nextfd;
 	char *s;
-	pid_t pid;
 	int status;
 	int bg=0;
 	time_t startsecs, endsecs;
@@ -338,55 +413,101 @@ docommand(char *buf)
 	/* Not a builtin; run it */
 
 	if (nargs > 0 && !strcmp(args[nargs-1], "&")) {
-		/* background */
-		if (!can_bg()) {
-			printf("%s: Too many background jobs; wait for "
-			       "some to finish before starting more\n",
-			       args[0]);
-			return -1;
-		}
 		nargs--;
 		args[nargs] = NULL;
 		bg = 1;
 	}
 
+	/* split into pipeline stages at each '|' */
+	nstages = 1;
+	stages[0] = args;
+	for (i=0; i<nargs; i++) {
+		if (!strcmp(args[i], "|")) {
+			if (nstages >= MAXSTAGES) {
+				printf("%s: Too many commands in pipeline\n",
+				       args[0]);
+				return 1;
+			}
+			args[i] = NULL;
+			stages[nstages++] = &args[i+1];
+		}
+	}
+	for (i=0; i<nstages; i++) {
+		if (stages[i][0] == NULL) {
+			printf("sh: Missing command in pipeline\n");
+			return 1;
+		}
+	}
+
+	if (bg && !can_bg(nstages)) {
+		/* background */
+		printf("%s: Too many background jobs; wait for "
+		       "some to finish before starting more\n",
+		       args[0]);
+		return -1;
+	}
+
 	if (timing) {
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			return _MKWAIT_EXIT(255);
-		case 0:
-			/* child */
-			execv(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
+	infd = STDIN_FILENO;
+	for (i=0; i<nstages; i++) {
+		if (i < nstages - 1) {
+			if (pipe(fds) < 0) {
+				warn("pipe");
+				if (infd != STDIN_FILENO) {
+					close(infd);
+				}
+				break;
+			}
+			outfd = fds[1];
+			nextfd = fds[0];
+		}
+		else {
+			outfd = STDOUT_FILENO;
+			nextfd = -1;
+		}
+
+		pids[i] = startcmd(stages[i], infd, outfd, nextfd);
+
+		/* the commands have these now */
+		if (infd != STDIN_FILENO) {
+			close(infd);
+		}
+		if (outfd != STDOUT_FILENO) {
+			close(outfd);
+		}
+		infd = nextfd;
+
+		if (pids[i] < 0) {
+			if (infd >= 0) {
+				close(infd);
+			}
 			break;
+		}
 	}
+	/* i is now how many got started */
 
 	/* parent */
 	if (bg) {
 		/* background this command */
-		remember_bg(pid);
-		printf("[%d] %s ... &\n", pid, args[0]);
-		return 0;
+		for (j=0; j<i; j++) {
+			remember_bg(pids[j]);
+			printf("[%d] %s ... &\n", pids[j], stages[j][0]);
+		}
+		return i < nstages ? _MKWAIT_EXIT(1) : 0;
 	}
 
-	if (waitpid(pid, &status, 0) < 0) {
-		warn("waitpid");
-		status = -1;
+	status = _MKWAIT_EXIT(1);
+	for (j=0; j<i; j++) {
+		if (waitpid(pids[j], &status, 0) < 0) {
+			warn("waitpid");
+			status = -1;
+		}
+	}
+	if (i < nstages) {
+		status = _MKWAIT_EXIT(1);
 	}
 
 	if (timing) {
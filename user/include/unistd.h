@@ -42,6 +42,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -154,14 +155,35 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+/* WHO is RUSAGE_SELF or RUSAGE_CHILDREN (those waited for). */
+int getrusage(int who, struct rusage *usage);
+/* waitpid, also returning the child's usage (including its children's). */
+pid_t wait4(pid_t pid, int *returncode, int flags, struct rusage *usage);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
+/* OS/161 extensions. */
+/* CPU affinity of the calling thread: bit N of the mask allows cpu N. */
+int setaffinity(unsigned mask);
+int getaffinity(unsigned *mask);
+/* Run PROG with ARGS in a new child process, like fork+execv; returns the pid. */
+pid_t spawn(const char *prog, char *const *args);
+/*
+ * User threads. thread_create runs FUNC(ARG) in a new thread of this
+ * process and returns its id; returning from FUNC is the same as
+ * calling thread_exit(0). _exit (or exit) in any thread ends them all.
+ */
+int __thread_create(void (*entry)(void (*)(void *), void *),
+		    void (*func)(void *), void *arg);
+__DEAD void thread_exit(int code);
+int thread_join(int tid, int *code);
+
 /*
  * These are not themselves system calls, but wrapper routines in libc.
  */
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void (*func)(void *), void *arg); /* calls __thread_create */
 
 #endif /* _UNISTD_H_ */
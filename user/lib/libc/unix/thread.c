@@ -0,0 +1,24 @@
+/*
+ * thread_create: start a user thread.
+ */
+
+#include <unistd.h>
+
+/*
+ * New threads start here rather than in the caller's function, so
+ * that returning from the function ends the thread instead of
+ * running off the top of its stack.
+ */
+static
+void
+__thread_start(void (*func)(void *), void *arg)
+{
+	func(arg);
+	thread_exit(0);
+}
+
+int
+thread_create(void (*func)(void *), void *arg)
+{
+	return __thread_create(__thread_start, func, arg);
+}
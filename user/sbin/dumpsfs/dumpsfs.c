@@ -56,25 +56,132 @@
 
 #include "disk.h"
 
+static
+void
+dumpjournal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jheader jh;
+
+	diskread(&jh, jstart);
+	printf("Journal: %u blocks at %u; ", jblocks, jstart);
+	if (SWAPL(jh.jh_magic) != SFS_JHMAGIC) {
+		printf("header damaged\n");
+	}
+	else {
+		printf("next transaction %u\n", SWAPL(jh.jh_seq));
+	}
+}
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
+	uint32_t blocksize;
+
 	diskread(&sp, SFS_SB_LOCATION);
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = SWAPL(sp.sp_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_OLDBLOCKSIZE;
+	}
+	if (blocksize != SFS_BLOCKSIZE) {
+		errx(1, "Filesystem has %u-byte blocks; dumpsfs was built "
+		     "for %u", blocksize, SFS_BLOCKSIZE);
+	}
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
-	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
-	       SWAPL(sp.sp_nblocks));
+	printf("Volume name: %-40s  %u blocks of %u bytes\n", sp.sp_volname,
+	       SWAPL(sp.sp_nblocks), SFS_BLOCKSIZE);
+
+	if (sp.sp_jblocks == 0) {
+		printf("No journal\n");
+	}
+	else {
+		dumpjournal(SWAPL(sp.sp_jstart), SWAPL(sp.sp_jblocks));
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
 
+/*
+ * Call FN for each block of a file, with its number within the file
+ * and ARG: the direct blocks, then the ones under the single, double,
+ * and triple indirect blocks.
+ */
+
+typedef void (*blockfn)(uint32_t block, uint32_t fileblock, void *arg);
+
 static
 void
-dodirblock(uint32_t block)
+walkindirect(uint32_t iblock, int levels, uint32_t *fileblock,
+	     blockfn fn, void *arg)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block, span;
+	int i;
+
+	if (iblock == 0) {
+		for (span = SFS_DBPERIDB, i = 1; i < levels; i++) {
+			span *= SFS_DBPERIDB;
+		}
+		*fileblock += span;
+		return;
+	}
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (levels > 1) {
+			walkindirect(block, levels-1, fileblock, fn, arg);
+		}
+		else {
+			if (block) {
+				fn(block, *fileblock, arg);
+			}
+			(*fileblock)++;
+		}
+	}
+}
+
+static
+void
+walkfile(const struct sfs_inode *sfi, blockfn fn, void *arg)
+{
+	uint32_t fileblock, block;
+
+	for (fileblock=0; fileblock<SFS_NDIRECT; fileblock++) {
+		block = SWAPL(sfi->sfi_direct[fileblock]);
+		if (block) {
+			fn(block, fileblock, arg);
+		}
+	}
+	walkindirect(SWAPL(sfi->sfi_indirect), 1, &fileblock, fn, arg);
+	walkindirect(SWAPL(sfi->sfi_dindirect), 2, &fileblock, fn, arg);
+	walkindirect(SWAPL(sfi->sfi_tindirect), 3, &fileblock, fn, arg);
+}
+
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	while (*name) {
+		h = SFS_DIRHASH_STEP(h, *name++);
+	}
+	return h;
+}
+
+/*
+ * Dump a block of directory entries, the first of which is slot
+ * FIRSTSLOT. For a hashed directory of DIRSLOTS slots, show where
+ * each entry's home slot is too.
+ */
+static
+void
+dodirblock(uint32_t block, uint32_t firstslot, uint32_t dirslots)
 {
 	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
 	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
@@ -88,6 +195,12 @@ dodirblock(uint32_t block)
 		if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
 		}
+		else if (dirslots > 0) {
+			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+			printf("        %u %s (slot %u, home %u)\n",
+			       ino, sds[i].sfd_name, firstslot + i,
+			       dirhash(sds[i].sfd_name) & (dirslots - 1));
+		}
 		else {
 			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
 			printf("        %u %s\n", ino, sds[i].sfd_name);
@@ -95,14 +208,29 @@ dodirblock(uint32_t block)
 	}
 }
 
+struct dirinfo {
+	uint32_t dirslots;		/* hashed table size, or 0 */
+	uint32_t nblocks;		/* blocks seen so far */
+};
+
+static
+void
+dumpdirblock(uint32_t block, uint32_t fileblock, void *arg)
+{
+	struct dirinfo *di = arg;
+
+	dodirblock(block, fileblock * (SFS_BLOCKSIZE/sizeof(struct sfs_dir)),
+		   di->dirslots);
+	di->nblocks++;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
-	uint32_t block, nblocks=0;
+	struct dirinfo di;
+	int nentries;
 
 	diskread(&sfi, ino);
 
@@ -110,26 +238,108 @@ dumpdir(uint32_t ino)
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
-	printf("Directory %u: %d entries\n", ino, nentries);
-
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = SWAPL(sfi.sfi_direct[i]);
-		if (block) {
-			dodirblock(block);
-			nblocks++;
+	di.dirslots = SWAPL(sfi.sfi_dirslots);
+	di.nblocks = 0;
+	if (di.dirslots > 0) {
+		printf("Directory %u: %d entries, hashed (%u slots, "
+		       "%u in use)\n", ino, nentries, di.dirslots,
+		       SWAPL(sfi.sfi_dirused));
+		if ((di.dirslots & (di.dirslots - 1)) != 0) {
+			warnx("Warning: hash table size is not a power of 2");
+			di.dirslots = 0;
 		}
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
+	else {
+		printf("Directory %u: %d entries\n", ino, nentries);
+	}
+
+	walkfile(&sfi, dumpdirblock, &di);
+	printf("    %u blocks in directory\n", di.nblocks);
+}
+
+/*
+ * Layout: how many extents (runs of consecutive disk blocks) each
+ * file's data is in, and over the whole volume.
+ */
+
+static uint32_t total_blocks, total_extents;
+
+struct layout {
+	uint32_t last;			/* previous block */
+	uint32_t nblocks;
+	uint32_t nextents;
+};
+
+static
+void
+countblock(uint32_t block, uint32_t fileblock, void *arg)
+{
+	struct layout *lo = arg;
+
+	(void)fileblock;
+	lo->nblocks++;
+	if (lo->last == 0 || block != lo->last + 1) {
+		lo->nextents++;
+	}
+	lo->last = block;
+}
+
+static
+void
+dumpfilelayout(uint32_t ino, const char *name)
+{
+	struct sfs_inode sfi;
+	struct layout lo;
+
+	lo.last = lo.nblocks = lo.nextents = 0;
+
+	diskread(&sfi, ino);
+	walkfile(&sfi, countblock, &lo);
+	printf("    %u %s: %u blocks in %u extents\n",
+	       ino, name, lo.nblocks, lo.nextents);
+	total_blocks += lo.nblocks;
+	total_extents += lo.nextents;
+}
+
+static
+void
+dumplayoutblock(uint32_t block, uint32_t fileblock, void *arg)
+{
+	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	int i;
+
+	(void)fileblock;
+	(void)arg;
+
+	diskread(&sds, block);
+	for (i=0; i<nsds; i++) {
+		uint32_t ino = SWAPL(sds[i].sfd_ino);
+		if (ino != SFS_NOINO) {
+			sds[i].sfd_name[SFS_NAMELEN-1] = 0;
+			dumpfilelayout(ino, sds[i].sfd_name);
 		}
 	}
-	printf("    %u blocks in directory\n", nblocks);
+}
+
+static
+void
+dumplayout(uint32_t dirino)
+{
+	struct sfs_inode sfi;
+
+	printf("Layout of directory %u:\n", dirino);
+
+	diskread(&sfi, dirino);
+	walkfile(&sfi, dumplayoutblock, NULL);
+
+	if (total_extents > 0) {
+		printf("    total: %u blocks in %u extents "
+		       "(%u.%02u blocks per extent)\n",
+		       total_blocks, total_extents,
+		       total_blocks / total_extents,
+		       total_blocks * 100 / total_extents % 100);
+	}
 }
 
 static
@@ -171,6 +381,7 @@ main(int argc, char **argv)
 	nblocks = dumpsb();
 	dumpbits(nblocks);
 	dumpdir(SFS_ROOT_LOCATION);
+	dumplayout(SFS_ROOT_LOCATION);
 
 	closedisk();
 
@@ -0,0 +1,182 @@
+/*
+ * ktdecode - print a kernel trace saved with the "kt save" menu
+ * command.
+ *
+ * Usage: ktdecode [-c cpu] tracefile
+ *
+ * Prints one event per line: the time since the first event and
+ * since the previous event on the same cpu (both in microseconds),
+ * then what happened. Builds for the host as well as for OS/161, so
+ * the trace can be read from the disk image without booting.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "kern/ktrace.h"
+
+#ifdef HOST
+
+#include <netinet/in.h> // for arpa/inet.h
+#include <arpa/inet.h>  // for ntohl
+#include "hostcompat.h"
+#define SWAPL(x) ntohl(x)
+#define SWAPS(x) ntohs(x)
+
+#else
+
+#define SWAPL(x) (x)
+#define SWAPS(x) (x)
+
+#endif
+
+#define MAXCPUS 32
+
+static const char *const typenames[KT_NTYPES] = KTRACE_TYPENAMES;
+
+/* time of the last event seen on each cpu, in usec since the first */
+static uint64_t lastusec[MAXCPUS];
+
+static
+void
+doread(int fd, void *buf, size_t len, const char *what)
+{
+	ssize_t r;
+
+	r = read(fd, buf, len);
+	if (r < 0) {
+		err(1, "read");
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: unexpected EOF", what);
+	}
+}
+
+static
+void
+swapevent(struct ktrace_event *ke)
+{
+	ke->ke_secs = SWAPL(ke->ke_secs);
+	ke->ke_nsecs = SWAPL(ke->ke_nsecs);
+	ke->ke_type = SWAPS(ke->ke_type);
+	ke->ke_cpu = SWAPS(ke->ke_cpu);
+	ke->ke_thread = SWAPL(ke->ke_thread);
+	ke->ke_arg0 = SWAPL(ke->ke_arg0);
+	ke->ke_arg1 = SWAPL(ke->ke_arg1);
+}
+
+static
+void
+printevent(const struct ktrace_event *ke, uint64_t usec)
+{
+	char name[sizeof(ke->ke_name) + 1];
+	unsigned cpu;
+	uint64_t delta;
+
+	memcpy(name, ke->ke_name, sizeof(ke->ke_name));
+	name[sizeof(ke->ke_name)] = 0;
+
+	cpu = ke->ke_cpu < MAXCPUS ? ke->ke_cpu : MAXCPUS - 1;
+	delta = usec - lastusec[cpu];
+	lastusec[cpu] = usec;
+
+	printf("%10llu %8llu cpu%u %08x %-8s ",
+	       (unsigned long long)usec, (unsigned long long)delta,
+	       ke->ke_cpu, ke->ke_thread,
+	       ke->ke_type < KT_NTYPES ? typenames[ke->ke_type] : "?");
+
+	switch (ke->ke_type) {
+	    case KT_SWITCH:
+		printf("-> %08x %s\n", ke->ke_arg0, name);
+		break;
+	    case KT_SLEEP:
+	    case KT_WAKEALL:
+		printf("%s (%08x)\n", name, ke->ke_arg0);
+		break;
+	    case KT_WAKEONE:
+		printf("%s (%08x) -> %08x\n", name, ke->ke_arg0, ke->ke_arg1);
+		break;
+	    case KT_SYSCALL:
+		printf("%u\n", ke->ke_arg0);
+		break;
+	    case KT_SYSRET:
+		printf("%u err %u\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	    case KT_VMFAULT:
+		printf("type %u addr 0x%08x\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	    case KT_DISKIO:
+		printf("%s sector %u\n", ke->ke_arg1 ? "write" : "read",
+		       ke->ke_arg0);
+		break;
+	    case KT_DISKDONE:
+		printf("err %u\n", ke->ke_arg0);
+		break;
+	    default:
+		printf("%08x %08x\n", ke->ke_arg0, ke->ke_arg1);
+		break;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ktrace_header kh;
+	struct ktrace_event ke;
+	uint32_t i, firstsecs, firstnsecs;
+	int64_t usec;
+	int fd, onlycpu;
+	const char *file;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	onlycpu = -1;
+	if (argc == 4 && !strcmp(argv[1], "-c")) {
+		onlycpu = atoi(argv[2]);
+		file = argv[3];
+	}
+	else if (argc == 2) {
+		file = argv[1];
+	}
+	else {
+		errx(1, "Usage: ktdecode [-c cpu] tracefile");
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+
+	doread(fd, &kh, sizeof(kh), file);
+	if (SWAPL(kh.kh_magic) != KTRACE_MAGIC) {
+		errx(1, "%s: not a kernel trace", file);
+	}
+	kh.kh_nevents = SWAPL(kh.kh_nevents);
+
+	firstsecs = firstnsecs = 0;
+	for (i=0; i<kh.kh_nevents; i++) {
+		doread(fd, &ke, sizeof(ke), file);
+		swapevent(&ke);
+		if (i == 0) {
+			firstsecs = ke.ke_secs;
+			firstnsecs = ke.ke_nsecs;
+		}
+		usec = ((int64_t)ke.ke_secs - firstsecs) * 1000000 +
+			((int64_t)ke.ke_nsecs - firstnsecs) / 1000;
+		if (onlycpu >= 0 && ke.ke_cpu != onlycpu) {
+			continue;
+		}
+		printevent(&ke, usec);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -38,10 +38,22 @@
 #include <err.h>
 
 #include "support.h"
+#include "kern/sfs.h"
 #include "disk.h"
 
+/*
+ * We read and write whole SFS blocks, which are some number of disk
+ * sectors. On the host, disk images start with a one-sector header.
+ */
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
+#define BLOCKSIZE  SFS_BLOCKSIZE
+
+#ifdef HOST
+#define HEADERSIZE SECTORSIZE
+#else
+#define HEADERSIZE 0
+#endif
 
 #ifndef EINTR
 #define EINTR 0
@@ -64,11 +76,9 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nblocks = (statbuf.st_size - HEADERSIZE) / BLOCKSIZE;
 
 #ifdef HOST
-	nblocks--;
-
 	{
 		char buf[64];
 		int len;
@@ -113,12 +123,8 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	// skip over disk file header, if any
+	if (lseek(fd, HEADERSIZE + (off_t)block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
@@ -146,12 +152,8 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	// skip over disk file header, if any
+	if (lseek(fd, HEADERSIZE + (off_t)block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
@@ -164,7 +166,7 @@ diskread(void *data, uint32_t block)
 			err(1, "read");
 		}
 		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+			err(1, "unexpected EOF in mid-block");
 		}
 		tot += len;
 	}
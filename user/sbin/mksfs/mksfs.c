@@ -57,6 +57,17 @@
 
 #define MAXBITBLOCKS 32
 
+/* The journal follows the freemap; it's a sixteenth of the volume */
+#define JOURNALSTART(fsblocks) (SFS_MAP_LOCATION + SFS_BITBLOCKS(fsblocks))
+#define MINJOURNAL 16
+#define MAXJOURNAL 1024
+
+/* The root directory's blocks, which follow the journal, and slots */
+#define ROOTDIRBLOCKS \
+	(SFS_ROUNDUP(SFS_DIRHASH_MIN * sizeof(struct sfs_dir), SFS_BLOCKSIZE) \
+	 / SFS_BLOCKSIZE)
+#define ROOTDIRSLOTS (ROOTDIRBLOCKS * SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
 static
 void
 check(void)
@@ -64,6 +75,25 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert((SFS_BLOCKSIZE & (SFS_BLOCKSIZE - 1)) == 0);
+	assert(SFS_BLOCKSIZE % 512 == 0);
+	assert((ROOTDIRSLOTS & (ROOTDIRSLOTS - 1)) == 0);
+	assert(ROOTDIRBLOCKS <= SFS_NDIRECT);
+}
+
+static
+uint32_t
+journalblocks(uint32_t fsblocks)
+{
+	uint32_t n = fsblocks / 16;
+
+	if (n < MINJOURNAL) {
+		n = MINJOURNAL;
+	}
+	if (n > MAXJOURNAL) {
+		n = MAXJOURNAL;
+	}
+	return n;
 }
 
 static
@@ -80,26 +110,73 @@ writesuper(const char *volname, uint32_t nblocks)
 
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
+	sp.sp_blocksize = SWAPL(SFS_BLOCKSIZE);
+	sp.sp_jstart = SWAPL(JOURNALSTART(nblocks));
+	sp.sp_jblocks = SWAPL(journalblocks(nblocks));
 	strcpy(sp.sp_volname, volname);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
 
+/*
+ * The root directory starts out as an empty hashed directory of at
+ * least SFS_DIRHASH_MIN slots (as many as fill its blocks).
+ */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t fsblocks)
 {
 	struct sfs_inode sfi;
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t block = JOURNALSTART(fsblocks) + journalblocks(fsblocks);
+	uint32_t i;
+
+	if (block + ROOTDIRBLOCKS > fsblocks) {
+		errx(1, "Filesystem too small");
+	}
 
 	bzero((void *)&sfi, sizeof(sfi));
+	bzero(zeros, sizeof(zeros));
 
-	sfi.sfi_size = SWAPL(0);
+	sfi.sfi_size = SWAPL(ROOTDIRSLOTS * sizeof(struct sfs_dir));
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	sfi.sfi_dirslots = SWAPL(ROOTDIRSLOTS);
+	sfi.sfi_dirused = SWAPL(0);
+
+	for (i=0; i<ROOTDIRBLOCKS; i++) {
+		diskwrite(zeros, block+i);
+		sfi.sfi_direct[i] = SWAPL(block+i);
+	}
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
 
+/*
+ * The journal starts out empty: a header, and a first log block that
+ * isn't a descriptor, so there's nothing to replay.
+ */
+static
+void
+writejournal(uint32_t fsblocks)
+{
+	struct sfs_jheader jh;
+	char zeros[SFS_BLOCKSIZE];
+
+	if (JOURNALSTART(fsblocks) + journalblocks(fsblocks) > fsblocks) {
+		errx(1, "Filesystem too small");
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	bzero(zeros, sizeof(zeros));
+
+	jh.jh_magic = SWAPL(SFS_JHMAGIC);
+	jh.jh_seq = SWAPL(1);
+
+	diskwrite(&jh, JOURNALSTART(fsblocks));
+	diskwrite(zeros, JOURNALSTART(fsblocks) + 1);
+}
+
 static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
 
 static
@@ -120,6 +197,7 @@ writebitmap(uint32_t fsblocks)
 
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
 	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t jblocks = journalblocks(fsblocks);
 	char *ptr;
 	uint32_t i;
 
@@ -133,6 +211,12 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(JOURNALSTART(fsblocks)+i);
+	}
+	for (i=0; i<ROOTDIRBLOCKS; i++) {
+		doallocbit(JOURNALSTART(fsblocks)+jblocks+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
@@ -186,7 +270,8 @@ main(int argc, char **argv)
 	size = diskblocks();
 
 	writesuper(volname, size);
-	writerootdir();
+	writejournal(size);
+	writerootdir(size);
 	writebitmap(size);
 
 	closedisk();
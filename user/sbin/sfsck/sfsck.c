@@ -83,6 +83,9 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
 }
 
 static
@@ -126,6 +129,9 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_dirslots = SWAPL(sfi->sfi_dirslots);
+	sfi->sfi_dirused = SWAPL(sfi->sfi_dirused);
 }
 
 static
@@ -172,6 +178,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -185,6 +192,25 @@ static uint32_t uniquecounter = 1;
 
 static unsigned long count_blocks=0, count_dirs=0, count_files=0;
 
+/*
+ * Fragmentation: data blocks seen, and how many extents (runs of
+ * consecutive disk blocks) they're in. A file's blocks are fed to
+ * frag_note in file order; frag_last is the one before.
+ */
+static unsigned long count_datablocks=0, count_extents=0;
+static uint32_t frag_last;
+
+static
+void
+frag_note(uint32_t block)
+{
+	count_datablocks++;
+	if (frag_last == 0 || block != frag_last + 1) {
+		count_extents++;
+	}
+	frag_last = block;
+}
+
 ////////////////////////////////////////////////////////////
 
 static uint8_t *bitmapdata;
@@ -210,6 +236,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -508,6 +535,231 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Check where the superblock says the journal is. (No journal at
+ * all is fine.)
+ */
+static
+int
+journal_ok(const struct sfs_super *sp)
+{
+	if (sp->sp_jblocks == 0) {
+		return 1;
+	}
+	return sp->sp_jblocks >= 4 &&
+		sp->sp_jstart >= SFS_MAP_LOCATION +
+				 SFS_BITBLOCKS(sp->sp_nblocks) &&
+		sp->sp_jstart < sp->sp_nblocks &&
+		sp->sp_jblocks <= sp->sp_nblocks - sp->sp_jstart;
+}
+
+/*
+ * Journal replay. This does what the kernel does at mount: find the
+ * transactions that were committed, collect what they revoke, and
+ * write the images home that aren't revoked by a later transaction.
+ * The journal's own blocks are all 32-bit words; images are copied
+ * as they are, but their checksum is over the words as numbers.
+ */
+
+union jblock {
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct sfs_jcommit jc;
+	uint32_t words[SFS_BLOCKSIZE/4];
+};
+
+struct jrevoked {
+	uint32_t block;
+	uint32_t seq;		/* transaction that revoked it */
+};
+
+#define J_SCAN		0	/* check the transaction */
+#define J_REVOKES	1	/* collect what it revokes */
+#define J_APPLY		2	/* write its images home */
+
+static uint32_t jstart, jloglen, jfsblocks;
+static struct jrevoked *jrevoked;
+static unsigned jnrevoked, jmaxrevoked, jnimages;
+
+static
+void
+jread(union jblock *jb, uint32_t logblock)
+{
+	unsigned i;
+
+	diskread(jb, jstart + 1 + logblock);
+	for (i=0; i<SFS_BLOCKSIZE/4; i++) {
+		jb->words[i] = SWAPL(jb->words[i]);
+	}
+}
+
+static
+uint32_t
+jsum(uint32_t sum, const union jblock *jb)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/4; i++) {
+		sum = SFS_JSUM_STEP(sum, jb->words[i]);
+	}
+	return sum;
+}
+
+static
+int
+jisrevoked(uint32_t block, uint32_t seq)
+{
+	unsigned i;
+
+	for (i=0; i<jnrevoked; i++) {
+		if (jrevoked[i].block == block &&
+		    jrevoked[i].seq - seq < 0x80000000U &&
+		    jrevoked[i].seq != seq) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do PASS to the transaction SEQ at log block POS. Returns its length
+ * in blocks, or 0 if there's no committed transaction there.
+ */
+static
+uint32_t
+jreplaytxn(unsigned pass, uint32_t pos, uint32_t seq, unsigned *nrevokeret)
+{
+	union jblock desc, data;
+	uint32_t p, i, home, sum;
+	unsigned nrevoke;
+
+	sum = SFS_JSUM_INIT;
+	nrevoke = 0;
+	p = pos;
+	while (1) {
+		if (p >= jloglen) {
+			return 0;
+		}
+		jread(&desc, p);
+		if (desc.jc.jc_magic == SFS_JCMAGIC &&
+		    desc.jc.jc_seq == seq && p > pos) {
+			if (desc.jc.jc_sum != sum) {
+				return 0;
+			}
+			break;
+		}
+		if (desc.jd.jd_magic != SFS_JDMAGIC ||
+		    desc.jd.jd_seq != seq ||
+		    desc.jd.jd_nblocks > SFS_JDESCMAX ||
+		    desc.jd.jd_nrevoke > SFS_JDESCMAX - desc.jd.jd_nblocks ||
+		    desc.jd.jd_nblocks >= jloglen - p) {
+			return 0;
+		}
+		sum = jsum(sum, &desc);
+		nrevoke += desc.jd.jd_nrevoke;
+
+		if (pass == J_REVOKES) {
+			for (i=0; i<desc.jd.jd_nrevoke; i++) {
+				assert(jnrevoked < jmaxrevoked);
+				jrevoked[jnrevoked].block =
+				    desc.jd.jd_blocks[desc.jd.jd_nblocks + i];
+				jrevoked[jnrevoked].seq = seq;
+				jnrevoked++;
+			}
+		}
+		else {
+			for (i=0; i<desc.jd.jd_nblocks; i++) {
+				home = desc.jd.jd_blocks[i];
+				if (pass == J_SCAN) {
+					jread(&data, p + 1 + i);
+					sum = jsum(sum, &data);
+				}
+				else if (home < jfsblocks &&
+					 !jisrevoked(home, seq)) {
+					diskread(&data, jstart + 2 + p + i);
+					diskwrite(&data, home);
+					jnimages++;
+				}
+			}
+		}
+		p += 1 + desc.jd.jd_nblocks;
+	}
+
+	if (nrevokeret != NULL) {
+		*nrevokeret = nrevoke;
+	}
+	return p + 1 - pos;
+}
+
+static
+void
+replay_journal(void)
+{
+	struct sfs_super sp;
+	union jblock jh;
+	uint32_t firstseq, seq, pos, len, ntxns, n;
+	unsigned nrevoke, pass;
+
+	diskread(&sp, SFS_SB_LOCATION);
+	swapsb(&sp);
+	if (sp.sp_magic != SFS_MAGIC || sp.sp_jblocks == 0 ||
+	    !journal_ok(&sp)) {
+		/* check_sb will complain */
+		return;
+	}
+	jstart = sp.sp_jstart;
+	jloglen = sp.sp_jblocks - 1;
+	jfsblocks = sp.sp_nblocks;
+
+	diskread(&jh, jstart);
+	jh.jh.jh_magic = SWAPL(jh.jh.jh_magic);
+	jh.jh.jh_seq = SWAPL(jh.jh.jh_seq);
+	if (jh.jh.jh_magic != SFS_JHMAGIC) {
+		warnx("Journal header damaged (NOT FIXED)");
+		setbadness(EXIT_UNRECOV);
+		return;
+	}
+	firstseq = jh.jh.jh_seq;
+
+	/* Find the committed transactions */
+	ntxns = 0;
+	pos = 0;
+	seq = firstseq;
+	while ((len = jreplaytxn(J_SCAN, pos, seq, &nrevoke)) > 0) {
+		jmaxrevoked += nrevoke;
+		ntxns++;
+		pos += len;
+		seq++;
+	}
+	if (ntxns == 0) {
+		return;
+	}
+
+	/* Collect the revokes, and then write the images home */
+	jrevoked = domalloc((jmaxrevoked + 1) * sizeof(struct jrevoked));
+	for (pass = J_REVOKES; pass <= J_APPLY; pass++) {
+		pos = 0;
+		for (n=0; n<ntxns; n++) {
+			len = jreplaytxn(pass, pos, firstseq + n, NULL);
+			assert(len > 0);
+			pos += len;
+		}
+	}
+	free(jrevoked);
+
+	/* Start the log over */
+	bzero(&jh, sizeof(jh));
+	jh.jh.jh_magic = SWAPL(SFS_JHMAGIC);
+	jh.jh.jh_seq = SWAPL(seq);
+	diskwrite(&jh, jstart);
+
+	warnx("Replayed %lu transactions (%u blocks) from the journal",
+	      (unsigned long) ntxns, jnimages);
+	setbadness(EXIT_RECOV);
+}
+
+////////////////////////////////////////////////////////////
+
 static
 void
 check_sb(void)
@@ -521,6 +773,13 @@ check_sb(void)
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
+	if ((sp.sp_blocksize ? sp.sp_blocksize : SFS_OLDBLOCKSIZE) !=
+	    SFS_BLOCKSIZE) {
+		errx(EXIT_UNRECOV, "Filesystem has %lu-byte blocks; "
+		     "sfsck was built for %lu", (unsigned long)
+		     (sp.sp_blocksize ? sp.sp_blocksize : SFS_OLDBLOCKSIZE),
+		     (unsigned long) SFS_BLOCKSIZE);
+	}
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
@@ -554,6 +813,17 @@ check_sb(void)
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+
+	if (!journal_ok(&sp)) {
+		warnx("Journal (%lu blocks at %lu) is not within the volume "
+		      "(NOT FIXED)", (unsigned long) sp.sp_jblocks,
+		      (unsigned long) sp.sp_jstart);
+		setbadness(EXIT_UNRECOV);
+		return;
+	}
+	for (i=0; i<sp.sp_jblocks; i++) {
+		bitmap_mark(sp.sp_jstart+i, B_JOURNAL, i);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -567,17 +837,24 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	uint32_t entries[SFS_DBPERIDB];
 	uint32_t i, ct;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/*
+		 * Nothing under it; just skip the blocks it would
+		 * map, rather than walk SFS_DBPERIDB^indirection
+		 * zeros.
+		 */
+		ct = SFS_DBPERIDB;
+		for (i=1; i<(uint32_t)indirection; i++) {
+			ct *= SFS_DBPERIDB;
 		}
+		*blockp += ct;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -596,6 +873,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 					bitmap_mark(entries[i],
 						    isdir ? B_DIRDATA : B_DATA,
 						    ino);
+					frag_note(entries[i]);
 				}
 			}
 			else {
@@ -643,11 +921,13 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 	nblocks = size/SFS_BLOCKSIZE;
 
+	frag_last = 0;
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
 			if (sfi->sfi_direct[block] != 0) {
 				bitmap_mark(sfi->sfi_direct[block],
 					    isdir ? B_DIRDATA : B_DATA, ino);
+				frag_note(sfi->sfi_direct[block]);
 			}
 		}
 		else {
@@ -966,6 +1246,95 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	while (*name) {
+		h = SFS_DIRHASH_STEP(h, *name++);
+	}
+	return h;
+}
+
+/*
+ * Check that each entry of a hashed directory is where lookups will
+ * look for it (no free slot between its home slot and it), and that
+ * the inode's count of entries is right. If entries are out of place,
+ * or have been changed (which may have left them so), put them all
+ * back in place. Returns nonzero if the inode was modified.
+ */
+static
+int
+check_dirhash(const char *pathsofar, struct sfs_inode *sfi,
+	      struct sfs_dir *d, uint32_t nd, int *dchangedp)
+{
+	struct sfs_dir *table;
+	uint32_t mask = sfi->sfi_dirslots - 1;
+	uint32_t i, j, used, misplaced;
+	int ichanged = 0;
+
+	if (nd != sfi->sfi_dirslots) {
+		/* An entry had to be added past the end */
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Hash table full (made flat)",
+		      pathsofar);
+		sfi->sfi_dirslots = 0;
+		sfi->sfi_dirused = 0;
+		return 1;
+	}
+
+	used = misplaced = 0;
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		used++;
+		for (j = dirhash(d[i].sfd_name) & mask; j != i;
+		     j = (j+1) & mask) {
+			if (d[j].sfd_ino == SFS_NOINO) {
+				misplaced++;
+				break;
+			}
+		}
+	}
+
+	if (misplaced > 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: %lu entries out of place in hash "
+		      "table (fixed)", pathsofar, (unsigned long) misplaced);
+	}
+	if (misplaced > 0 || *dchangedp) {
+		table = domalloc(nd * sizeof(struct sfs_dir));
+		bzero(table, nd * sizeof(struct sfs_dir));
+		for (i=0; i<nd; i++) {
+			if (d[i].sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			j = dirhash(d[i].sfd_name) & mask;
+			while (table[j].sfd_ino != SFS_NOINO) {
+				j = (j+1) & mask;
+			}
+			table[j] = d[i];
+		}
+		memcpy(d, table, nd * sizeof(struct sfs_dir));
+		free(table);
+		*dchangedp = 1;
+	}
+
+	if (sfi->sfi_dirused != used) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Hash table count %lu should be %lu "
+		      "(fixed)", pathsofar, (unsigned long) sfi->sfi_dirused,
+		      (unsigned long) used);
+		sfi->sfi_dirused = used;
+		ichanged = 1;
+	}
+
+	return ichanged;
+}
+
 static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
@@ -996,6 +1365,26 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (sfi.sfi_dirslots != 0 &&
+	    (sfi.sfi_dirslots < SFS_DIRHASH_MIN ||
+	     (sfi.sfi_dirslots & (sfi.sfi_dirslots - 1)) != 0 ||
+	     sfi.sfi_size != sfi.sfi_dirslots * sizeof(struct sfs_dir))) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Invalid hash table size %lu "
+		      "(made flat)", pathsofar,
+		      (unsigned long) sfi.sfi_dirslots);
+		sfi.sfi_dirslots = 0;
+		sfi.sfi_dirused = 0;
+		ichanged = 1;
+	}
+	else if (sfi.sfi_dirslots == 0 && sfi.sfi_dirused != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Flat directory with hash table "
+		      "count (cleared)", pathsofar);
+		sfi.sfi_dirused = 0;
+		ichanged = 1;
+	}
+
 	if (check_inode_blocks(ino, &sfi, 1)) {
 		ichanged = 1;
 	}
@@ -1194,6 +1583,12 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (sfi.sfi_dirslots != 0 &&
+	    check_dirhash(pathsofar, &sfi, direntries, ndirentries,
+			  &dchanged)) {
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
@@ -1257,6 +1652,7 @@ main(int argc, char **argv)
 
 	opendisk(argv[1]);
 
+	replay_journal();
 	check_sb();
 	check_root_dir();
 	check_bitmap();
@@ -1266,6 +1662,13 @@ main(int argc, char **argv)
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
 	      count_blocks, (unsigned long) nblocks, count_dirs, count_files);
+	if (count_extents > 0) {
+		warnx("%lu data blocks in %lu extents "
+		      "(%lu.%02lu blocks per extent)",
+		      count_datablocks, count_extents,
+		      count_datablocks / count_extents,
+		      count_datablocks * 100 / count_extents % 100);
+	}
 
 	switch (badness) {
 	    case EXIT_USAGE:
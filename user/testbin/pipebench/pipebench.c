@@ -0,0 +1,146 @@
+/*
+ * pipebench - measure pipe throughput between two processes.
+ *
+ * Usage: pipebench [kilobytes]
+ *
+ * For each of several transfer sizes, forks a child that writes
+ * KILOBYTES through a pipe in pieces of that size while the parent
+ * reads them back in pieces of the same size, and prints the rate.
+ * Small pieces go through the pipe's ring buffer; pieces of
+ * PIPE_DIRECTMIN (1K) and up are copied by the writer straight into
+ * the waiting reader's buffer. The data is checked on the way out.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_KB 1024
+#define MAXCHUNK (32*1024)
+
+static const size_t chunks[] = { 64, 512, 4096, MAXCHUNK };
+#define NCHUNKS (sizeof(chunks) / sizeof(chunks[0]))
+
+static unsigned char buf[MAXCHUNK];
+
+/* the byte at offset POS of the stream */
+#define PATTERN(pos) ((unsigned char)((pos) * 7 + ((pos) >> 12)))
+
+static
+void
+writer(int fd, size_t total, size_t chunk)
+{
+	size_t pos, i, n;
+	ssize_t r;
+
+	for (pos = 0; pos < total; pos += n) {
+		n = total - pos < chunk ? total - pos : chunk;
+		for (i=0; i<n; i++) {
+			buf[i] = PATTERN(pos + i);
+		}
+		for (i=0; i<n; i+=r) {
+			r = write(fd, buf + i, n - i);
+			if (r <= 0) {
+				err(1, "write");
+			}
+		}
+	}
+}
+
+/* returns elapsed microseconds */
+static
+unsigned long
+runone(size_t total, size_t chunk)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	int fds[2], status;
+	size_t pos, i;
+	ssize_t r;
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	__time(&s0, &ns0);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		writer(fds[1], total, chunk);
+		close(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	for (pos = 0; pos < total; pos += r) {
+		r = read(fds[0], buf, chunk);
+		if (r < 0) {
+			err(1, "read");
+		}
+		if (r == 0) {
+			errx(1, "%lu-byte pieces: EOF after %lu of %lu bytes",
+			     (unsigned long)chunk, (unsigned long)pos,
+			     (unsigned long)total);
+		}
+		for (i=0; i<(size_t)r; i++) {
+			if (buf[i] != PATTERN(pos + i)) {
+				errx(1, "%lu-byte pieces: bad data at %lu",
+				     (unsigned long)chunk,
+				     (unsigned long)(pos + i));
+			}
+		}
+	}
+	if (read(fds[0], buf, 1) != 0) {
+		errx(1, "%lu-byte pieces: no EOF at end",
+		     (unsigned long)chunk);
+	}
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	__time(&s1, &ns1);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "writer failed (status %d)", status);
+	}
+
+	return (unsigned long)(s1 - s0) * 1000000
+		+ ns1 / 1000 - ns0 / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long us;
+	size_t total;
+	unsigned i;
+	int kb;
+
+	kb = argc > 1 ? atoi(argv[1]) : DEFAULT_KB;
+	if (kb <= 0) {
+		errx(1, "Usage: pipebench [kilobytes]");
+	}
+	total = (size_t)kb * 1024;
+
+	printf("pipebench: %d KB per run\n", kb);
+	for (i=0; i<NCHUNKS; i++) {
+		us = runone(total, chunks[i]);
+		if (us == 0) {
+			us = 1;
+		}
+		printf("%6lu-byte pieces: %8lu us, %6lu KB/s\n",
+		       (unsigned long)chunks[i], us,
+		       (unsigned long)((unsigned long long)kb * 1000000 / us));
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * spawnbench - compare spawn() against fork()+execv().
+ *
+ * Usage: spawnbench [iterations] [program]
+ *
+ * Runs the program (default /bin/true) ITERATIONS times each way,
+ * waiting for every child, and prints the average time per run.
+ * The data segment carries some ballast so that fork has a realistic
+ * amount of address space to copy, as it would in the shell.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_ITERS 50
+#define BALLAST (256*1024)
+
+static char ballast[BALLAST];
+
+static
+void
+touch_ballast(void)
+{
+	int i;
+
+	/* make sure every page of it is really there */
+	for (i=0; i<BALLAST; i+=512) {
+		ballast[i] = (char)i;
+	}
+}
+
+static
+void
+checkstatus(const char *how, int status)
+{
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%s: child failed (status %d)", how, status);
+	}
+}
+
+static
+void
+run_forkexec(char **args)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(args[0], args);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	checkstatus("fork+execv", status);
+}
+
+static
+void
+run_spawn(char **args)
+{
+	pid_t pid;
+	int status;
+
+	pid = spawn(args[0], args);
+	if (pid < 0) {
+		err(1, "spawn: %s", args[0]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	checkstatus("spawn", status);
+}
+
+/* returns elapsed microseconds for ITERS runs */
+static
+unsigned long
+timeit(void (*func)(char **), char **args, int iters)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	int i;
+
+	__time(&s0, &ns0);
+	for (i=0; i<iters; i++) {
+		func(args);
+	}
+	__time(&s1, &ns1);
+
+	return (unsigned long)(s1 - s0) * 1000000
+		+ ns1 / 1000 - ns0 / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *args[2];
+	int iters;
+	unsigned long fe, sp;
+
+	iters = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERS;
+	if (iters <= 0) {
+		errx(1, "Usage: spawnbench [iterations] [program]");
+	}
+	args[0] = argc > 2 ? argv[2] : (char *)"/bin/true";
+	args[1] = NULL;
+
+	touch_ballast();
+
+	/* warm up the buffer cache and the executable's vnode */
+	run_spawn(args);
+
+	fe = timeit(run_forkexec, args, iters);
+	sp = timeit(run_spawn, args, iters);
+
+	printf("spawnbench: %d runs of %s\n", iters, args[0]);
+	printf("fork+execv: %lu us total, %lu us each\n", fe, fe / iters);
+	printf("spawn:      %lu us total, %lu us each\n", sp, sp / iters);
+	return 0;
+}
@@ -35,14 +35,9 @@
  * This won't do much of anything unless you implement user-level
  * threads.
  *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * It uses the thread_create/thread_join API from <unistd.h>. The
+ * parent joins the threads before returning, since returning from
+ * main exits the whole process, threads and all.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +46,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,22 +57,29 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void ThreadRunner(void *);
+void BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int i, tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+	if (tids[i] < 0)
+	    err(1, "thread_create");
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], NULL) < 0)
+	    err(1, "thread_join");
     }
 
     printf("Parent has left.\n");
@@ -89,8 +92,9 @@ main(int argc, char *argv[])
 */
 
 void
-BladeRunner()
+BladeRunner(void *unused)
 {
+    (void)unused;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
@@ -99,8 +103,9 @@ BladeRunner()
 }
 
 void
-ThreadRunner()
+ThreadRunner(void *unused)
 {
+    (void)unused;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");